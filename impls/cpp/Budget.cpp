@@ -0,0 +1,76 @@
+#include "Budget.h"
+#include "Types.h"
+
+#include <algorithm>
+
+typedef std::chrono::steady_clock Clock;
+
+// The steps granted when there is no limit to check against.
+static const int64_t UNLIMITED = INT64_MAX / 2;
+
+// How often the clock is read, when there is a deadline.
+static const int64_t DEADLINE_STEPS = 4096;
+
+// The steps the code that handles the error can take.
+static const int64_t GRACE_STEPS = 10000;
+
+int64_t     malBudget::s_fuel      = 0;
+int64_t     malBudget::s_deadline  = 0;
+int64_t     malBudget::s_spent     = 0;
+int64_t     malBudget::s_granted   = UNLIMITED;
+int64_t     malBudget::s_countdown = UNLIMITED;
+const char* malBudget::s_exhausted = NULL;
+Clock::time_point malBudget::s_end;
+
+void malBudget::setFuel(int64_t steps)
+{
+    s_fuel = steps;
+    start();
+}
+
+void malBudget::setDeadline(int64_t msecs)
+{
+    s_deadline = msecs;
+    start();
+}
+
+void malBudget::start()
+{
+    s_spent = 0;
+    s_exhausted = NULL;
+    s_end = Clock::now() + std::chrono::milliseconds(s_deadline);
+    grant(s_fuel ? s_fuel : UNLIMITED);
+}
+
+void malBudget::grant(int64_t steps)
+{
+    if (s_deadline && !s_exhausted) {
+        steps = std::min(steps, DEADLINE_STEPS);
+    }
+    s_granted = s_countdown = steps;
+}
+
+malValuePtr malBudget::refill()
+{
+    s_spent += s_granted - s_countdown;
+    if (s_exhausted) {
+        // The grace is over.
+        grant(1);
+    }
+    else if (s_fuel && s_spent >= s_fuel) {
+        s_exhausted = "fuel";
+        grant(GRACE_STEPS);
+    }
+    else if (s_deadline && Clock::now() >= s_end) {
+        s_exhausted = "deadline";
+        grant(GRACE_STEPS);
+    }
+    else {
+        grant(s_fuel ? s_fuel - s_spent : UNLIMITED);
+        return NULL;
+    }
+    String text = s_exhausted[0] == 'f'
+        ? STRF("Evaluation fuel of %lld steps used up", (long long)s_fuel)
+        : STRF("Deadline of %lld msecs passed", (long long)s_deadline);
+    return malError::raise(malException::exhausted(s_exhausted, text));
+}
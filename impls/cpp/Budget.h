@@ -0,0 +1,51 @@
+#ifndef INCLUDE_BUDGET_H
+#define INCLUDE_BUDGET_H
+
+#include "MAL.h"
+
+#include <chrono>
+#include <cstdint>
+
+// Limits on how much evaluating one input can do, each call of rep, or one
+// run of a program malc compiled: a number of steps, its fuel, and a time
+// by which it must finish, its deadline. EVAL spends a step each time round
+// its loop, as does each pass round a loop malc compiled, and builtins that
+// loop, such as map and apply, spend one for each item.
+//
+// The steps are counted down in one counter, so that with no limits set,
+// spending one is a subtraction and a test. Only once the counter runs out
+// are the steps added up, and the clock read; with a deadline, that is
+// every DEADLINE_STEPS steps.
+class malBudget {
+public:
+    // A limit of 0 is none.
+    static void    setFuel(int64_t steps);
+    static void    setDeadline(int64_t msecs);
+    static int64_t fuel() { return s_fuel; }
+    static int64_t deadline() { return s_deadline; }
+
+    // Starts the budget of one input again.
+    static void start();
+
+    // Returns NULL while there is budget left. Once there isn't, raises an
+    // error of kind malException::EXHAUSTED, see malError. The code that
+    // handles it can take another GRACE_STEPS steps; past that, each step
+    // raises the error again, so that it gets out of any try*.
+    static malValuePtr spend(int64_t steps = 1) {
+        return (s_countdown -= steps) > 0 ? malValuePtr() : refill();
+    }
+
+private:
+    static malValuePtr refill();
+    static void grant(int64_t steps);
+
+    static int64_t     s_fuel;
+    static int64_t     s_deadline;
+    static int64_t     s_spent;     // before the steps granted last
+    static int64_t     s_granted;
+    static int64_t     s_countdown;
+    static const char* s_exhausted; // "fuel" or "deadline", once it is
+    static std::chrono::steady_clock::time_point s_end;
+};
+
+#endif // INCLUDE_BUDGET_H
@@ -0,0 +1,524 @@
+#include "MAL.h"
+#include "Environment.h"
+#include "Types.h"
+
+//  The compiled tier of stepA. A fn* or loop* body that has been entered
+//  often enough, see malBindingPlan::enter, is compiled once into a tree of
+//  nodes, one for each form, which know what kind of form they are. Running
+//  them doesn't look for special forms by name, or make a malCallFrame and
+//  a try block for each argument, as EVAL does. What they can't do more
+//  cheaply is left to EVAL, and so is a tail call, so that it can replace
+//  the frame:
+//
+//  constants   quoted forms, and the forms that evaluate to themselves.
+//  symbols     looked up through the caches in malSymbol, or raised as an
+//              error by EVAL if they aren't found.
+//  if, do, let*
+//              run by the node. A let* is bound by its malBindingPlan.
+//  and, or     run by the node while the symbol still finds the builtin
+//              macro, see isBuiltinMacro.
+//  recur       in tail position, the arguments are evaluated by the node
+//              and handed to EVAL to bind.
+//  calls       through a symbol to anything but a macro. The node evaluates
+//              the arguments, does calls which have only been passed
+//              integers itself, see malList::callIntegers, and calls the
+//              rest through evalCall.
+//  guards      as left by the optimiser, see malGuard.
+//
+//  Everything else, such as fn*, try* and loop*, and vectors and hash-maps
+//  that aren't constants, is evaluated by EVAL, as are the bodies of any
+//  fn* or loop* inside, until they are hot in their turn.
+
+class malNode;
+typedef RefCountedPtr<malNode> malNodePtr;
+typedef std::vector<malNodePtr> malNodeVec;
+
+class malNode : public RefCounted {
+public:
+    // Evaluates the form, other than in tail position. Returns its value,
+    // or a raised error.
+    virtual malValuePtr eval(const malEnvPtr& env) const = 0;
+
+    // Evaluates the form in tail position, see malCompiled::run.
+    virtual malCompiled::Tail run(malValuePtr& ast, malEnvPtr& env,
+                                  malValuePtr& value, malValueVec& args) const
+    {
+        value = eval(env);
+        return malCompiled::VALUE;
+    }
+};
+
+static malNodePtr compile(malValuePtr form, bool isTail);
+
+class malCompiledBody : public malCompiled {
+public:
+    malCompiledBody(malValuePtr body)
+    : malCompiled(body), m_node(compile(body, true)) { }
+    malCompiledBody(const malCompiledBody& that, malValuePtr meta)
+    : malCompiled(that, meta), m_node(that.m_node) { }
+
+    virtual Tail run(malValuePtr& ast, malEnvPtr& env,
+                     malValuePtr& value, malValueVec& args) const {
+        return m_node->run(ast, env, value, args);
+    }
+
+    WITH_META(malCompiledBody);
+
+private:
+    const malNodePtr m_node;
+};
+
+malValuePtr compileBody(malValuePtr body)
+{
+    return mal::list(new malCompiledBody(body));
+}
+
+class malConstantNode : public malNode {
+public:
+    malConstantNode(malValuePtr value) : m_value(value) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        return m_value;
+    }
+
+private:
+    const malValuePtr m_value;
+};
+
+//  Anything left to EVAL.
+class malFormNode : public malNode {
+public:
+    malFormNode(malValuePtr form) : m_form(form) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        return evalRaising(m_form, env);
+    }
+
+    virtual malCompiled::Tail run(malValuePtr& ast, malEnvPtr& env,
+                                  malValuePtr& value, malValueVec& args) const
+    {
+        ast = m_form;
+        return malCompiled::FORM;
+    }
+
+private:
+    const malValuePtr m_form;
+};
+
+class malSymbolNode : public malNode {
+public:
+    malSymbolNode(malValuePtr form)
+    : m_form(form), m_symbol(STATIC_CAST(malSymbol, form)) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        if (malValuePtr value = m_symbol->lookup(env)) {
+            return value;
+        }
+        return evalRaising(m_form, env); // to raise the error
+    }
+
+private:
+    const malValuePtr m_form;
+    const malSymbol*  m_symbol;
+};
+
+class malIfNode : public malNode {
+public:
+    malIfNode(malNodePtr test, malNodePtr then, malNodePtr otherwise)
+    : m_test(test), m_then(then), m_else(otherwise) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        malValuePtr test = m_test->eval(env);
+        if (malError::isRaised(test)) {
+            return test;
+        }
+        if (test->isTrue()) {
+            return m_then->eval(env);
+        }
+        return m_else ? m_else->eval(env) : mal::nilValue();
+    }
+
+    virtual malCompiled::Tail run(malValuePtr& ast, malEnvPtr& env,
+                                  malValuePtr& value, malValueVec& args) const
+    {
+        malValuePtr test = m_test->eval(env);
+        if (malError::isRaised(test)) {
+            value = test;
+            return malCompiled::VALUE;
+        }
+        if (test->isTrue()) {
+            return m_then->run(ast, env, value, args);
+        }
+        if (m_else) {
+            return m_else->run(ast, env, value, args);
+        }
+        value = mal::nilValue();
+        return malCompiled::VALUE;
+    }
+
+private:
+    const malNodePtr m_test;
+    const malNodePtr m_then;
+    const malNodePtr m_else;
+};
+
+//  do, and the and and or cascades, which stop at the first value that is
+//  false, or true. Only the last form is in tail position.
+class malSequenceNode : public malNode {
+public:
+    enum Kind { DO, AND, OR };
+
+    malSequenceNode(Kind kind, const malNodeVec& forms)
+    : m_kind(kind), m_forms(forms) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        malValuePtr value;
+        if (!evalInitial(env, value)) {
+            return value;
+        }
+        return m_forms.back()->eval(env);
+    }
+
+    virtual malCompiled::Tail run(malValuePtr& ast, malEnvPtr& env,
+                                  malValuePtr& value, malValueVec& args) const
+    {
+        if (!evalInitial(env, value)) {
+            return malCompiled::VALUE;
+        }
+        return m_forms.back()->run(ast, env, value, args);
+    }
+
+private:
+    // Evaluates all but the last form, and returns whether to go on to it.
+    bool evalInitial(const malEnvPtr& env, malValuePtr& value) const {
+        for (size_t i = 0, count = m_forms.size() - 1; i < count; i++) {
+            value = m_forms[i]->eval(env);
+            if (malError::isRaised(value) ||
+                (m_kind == AND && !value->isTrue()) ||
+                (m_kind == OR && value->isTrue())) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const Kind       m_kind;
+    const malNodeVec m_forms;
+};
+
+//  A call to and or or, which is left to EVAL once the symbol no longer
+//  finds the builtin macro.
+class malCascadeNode : public malNode {
+public:
+    malCascadeNode(malValuePtr form, bool isAnd, malNodePtr sequence)
+    : m_form(form), m_symbol(STATIC_CAST(malSymbol,
+                                         STATIC_CAST(malList, form)->item(0)))
+    , m_name(isAnd ? "and" : "or"), m_sequence(sequence) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        if (isBuiltin(env)) {
+            return m_sequence->eval(env);
+        }
+        return evalRaising(m_form, env);
+    }
+
+    virtual malCompiled::Tail run(malValuePtr& ast, malEnvPtr& env,
+                                  malValuePtr& value, malValueVec& args) const
+    {
+        if (isBuiltin(env)) {
+            return m_sequence->run(ast, env, value, args);
+        }
+        ast = m_form;
+        return malCompiled::FORM;
+    }
+
+private:
+    bool isBuiltin(const malEnvPtr& env) const {
+        malValuePtr op = m_symbol->lookup(env);
+        return op && isBuiltinMacro(op, m_name);
+    }
+
+    const malValuePtr m_form;
+    const malSymbol*  m_symbol;
+    const char* const m_name;
+    const malNodePtr  m_sequence;
+};
+
+class malLetNode : public malNode {
+public:
+    malLetNode(malBindingPlanPtr plan, const malNodeVec& values,
+               malNodePtr body)
+    : m_plan(plan), m_values(values), m_body(body) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        malEnvPtr inner = malEnv::make(env, m_plan->slotCount());
+        malValuePtr value;
+        if (bind(inner, value)) {
+            value = m_body->eval(inner);
+        }
+        malEnv::recycle(inner);
+        return value;
+    }
+
+    virtual malCompiled::Tail run(malValuePtr& ast, malEnvPtr& env,
+                                  malValuePtr& value, malValueVec& args) const
+    {
+        env = malEnv::make(env, m_plan->slotCount());
+        if (!bind(env, value)) {
+            return malCompiled::VALUE;
+        }
+        return m_body->run(ast, env, value, args);
+    }
+
+private:
+    // Binds each value in turn, and returns whether they all had one.
+    bool bind(const malEnvPtr& inner, malValuePtr& value) const {
+        for (size_t i = 0; i < m_values.size(); i++) {
+            value = m_values[i]->eval(inner);
+            if (malError::isRaised(value)) {
+                return false;
+            }
+            m_plan->bindLet(i, value, inner.ptr());
+        }
+        return true;
+    }
+
+    const malBindingPlanPtr m_plan;
+    const malNodeVec        m_values;
+    const malNodePtr        m_body;
+};
+
+//  Evaluates the arguments of a call or a recur into args. Returns NULL,
+//  or the first error raised.
+static malValuePtr evalArgs(const malNodeVec& nodes, const malEnvPtr& env,
+                            malValueVec& args)
+{
+    args.clear();
+    for (auto& node : nodes) {
+        malValuePtr value = node->eval(env);
+        if (malError::isRaised(value)) {
+            return value;
+        }
+        args.push_back(value);
+    }
+    return NULL;
+}
+
+class malRecurNode : public malNode {
+public:
+    malRecurNode(malValuePtr form, const malNodeVec& args)
+    : m_form(form), m_args(args) { }
+
+    // Never compiled other than in tail position, where EVAL raises the
+    // error.
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        return evalRaising(m_form, env);
+    }
+
+    virtual malCompiled::Tail run(malValuePtr& ast, malEnvPtr& env,
+                                  malValuePtr& value, malValueVec& args) const
+    {
+        if ((value = evalArgs(m_args, env, args))) {
+            return malCompiled::VALUE;
+        }
+        return malCompiled::RECUR;
+    }
+
+private:
+    const malValuePtr m_form;
+    const malNodeVec  m_args;
+};
+
+//  A call through a symbol, which is looked up each time, so that it can
+//  be redefined, or turn out to be a macro after all, which is left to EVAL.
+class malCallNode : public malNode {
+public:
+    malCallNode(malValuePtr form, malNodePtr op, const malNodeVec& args)
+    : m_form(form), m_list(STATIC_CAST(malList, form))
+    , m_op(op), m_args(args) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        malValuePtr op;
+        malValueVec args;
+        if (prepare(env, op, args)) {
+            return op ? op : evalRaising(m_form, env);
+        }
+        return evalCall(m_form, op, args);
+    }
+
+    virtual malCompiled::Tail run(malValuePtr& ast, malEnvPtr& env,
+                                  malValuePtr& value, malValueVec& args) const
+    {
+        if (prepare(env, value, args)) {
+            if (value) {
+                return malCompiled::VALUE;
+            }
+            ast = m_form;
+            return malCompiled::FORM;
+        }
+        ast = m_form;
+        return malCompiled::CALL;
+    }
+
+private:
+    // Evaluates the operator and arguments, as EVAL does, and returns
+    // false, with op and args, for the caller to make the call. Returns
+    // true, with the value of the call in op, when it's already done, or
+    // with NULL in op when the call is a macro, to be left to EVAL.
+    bool prepare(const malEnvPtr& env,
+                 malValuePtr& op, malValueVec& args) const {
+        op = m_op->eval(env);
+        if (malError::isRaised(op)) {
+            return true;
+        }
+        if (m_list->isIntegerCall(op)) {
+            if (malValuePtr error = evalArgs(m_args, env, args)) {
+                op = error;
+                return true;
+            }
+            if (malValuePtr value = m_list->callIntegers(args)) {
+                op = value;
+                return true;
+            }
+            return false;
+        }
+        const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
+        if (handler && handler->isMacro()) {
+            op = NULL;
+            return true;
+        }
+        if (handler && handler->isPure()) {
+            if (malValuePtr value = m_list->fold(op)) {
+                op = value;
+                return true;
+            }
+        }
+        if (malValuePtr error = evalArgs(m_args, env, args)) {
+            op = error;
+            return true;
+        }
+        m_list->recordCall(op, args);
+        return false;
+    }
+
+    const malValuePtr m_form;
+    const malList*    m_list;
+    const malNodePtr  m_op;
+    const malNodeVec  m_args;
+};
+
+class malGuardNode : public malNode {
+public:
+    malGuardNode(const malGuard* guard,
+                 malNodePtr optimized, malNodePtr original)
+    : m_guard(guard), m_optimized(optimized), m_original(original) { }
+
+    virtual malValuePtr eval(const malEnvPtr& env) const {
+        return (m_guard->holds() ? m_optimized : m_original)->eval(env);
+    }
+
+    virtual malCompiled::Tail run(malValuePtr& ast, malEnvPtr& env,
+                                  malValuePtr& value, malValueVec& args) const
+    {
+        return (m_guard->holds() ? m_optimized : m_original)
+                    ->run(ast, env, value, args);
+    }
+
+private:
+    const malGuard*  m_guard;  // kept by the form
+    const malNodePtr m_optimized;
+    const malNodePtr m_original;
+};
+
+static malNodeVec compileItems(const malList* list, int start, bool isTail)
+{
+    malNodeVec nodes;
+    for (int i = start, count = list->count(); i < count; i++) {
+        nodes.push_back(compile(list->item(i), isTail && i == count - 1));
+    }
+    return nodes;
+}
+
+static malNodePtr compileLet(malValuePtr form, bool isTail)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    malBindingPlanPtr plan;
+    try {
+        plan = malBindingPlan::forLet(list->item(1));
+    }
+    catch (malException&) {
+        return new malFormNode(form); // for EVAL to raise the error
+    }
+    catch (String&) {
+        return new malFormNode(form);
+    }
+    malNodeVec values;
+    for (int i = 0; i < plan->letCount(); i++) {
+        values.push_back(compile(plan->letValue(i), false));
+    }
+    return new malLetNode(plan, values, compile(list->item(2), isTail));
+}
+
+//  The special forms, as handled by EVAL, with the number of arguments
+//  they take when compiled. Those that aren't here, other than recur, are
+//  left to EVAL.
+static malNodePtr compileSpecial(malValuePtr form, const String& special,
+                                 bool isTail)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    int argCount = list->count() - 1;
+    if (special == "if" && (argCount == 2 || argCount == 3)) {
+        return new malIfNode(compile(list->item(1), false),
+                          compile(list->item(2), isTail),
+                          argCount == 3 ? compile(list->item(3), isTail)
+                                        : malNodePtr());
+    }
+    if (special == "do" && argCount >= 1) {
+        return new malSequenceNode(malSequenceNode::DO,
+                                compileItems(list, 1, isTail));
+    }
+    if (special == "let*" && argCount == 2) {
+        return compileLet(form, isTail);
+    }
+    if (special == "quote" && argCount == 1) {
+        return new malConstantNode(list->item(1));
+    }
+    if (special == "recur" && isTail) {
+        return new malRecurNode(form, compileItems(list, 1, false));
+    }
+    return new malFormNode(form);
+}
+
+static malNodePtr compile(malValuePtr form, bool isTail)
+{
+    if (DYNAMIC_CAST(malSymbol, form)) {
+        return new malSymbolNode(form);
+    }
+    if (evaluatesToItself(form)) {
+        return new malConstantNode(form);
+    }
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (!list || list->isEmpty()) {
+        return new malFormNode(form);
+    }
+    malValuePtr head = list->item(0);
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, head)) {
+        if (isSpecialForm(symbol->value())) {
+            return compileSpecial(form, symbol->value(), isTail);
+        }
+        bool isAnd = symbol->value() == "and";
+        if ((isAnd || symbol->value() == "or") && list->count() > 1) {
+            return new malCascadeNode(form, isAnd,
+                new malSequenceNode(isAnd ? malSequenceNode::AND
+                                          : malSequenceNode::OR,
+                                    compileItems(list, 1, isTail)));
+        }
+        return new malCallNode(form, new malSymbolNode(head),
+                            compileItems(list, 1, false));
+    }
+    if (const malGuard* guard = DYNAMIC_CAST(malGuard, head)) {
+        return new malGuardNode(guard, compile(list->item(1), isTail),
+                             compile(list->item(2), isTail));
+    }
+    return new malFormNode(form);
+}
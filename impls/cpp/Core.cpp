@@ -1,26 +1,41 @@
 #include "MAL.h"
+#include "Budget.h"
 #include "Environment.h"
 #include "StaticList.h"
 #include "Types.h"
 
 #include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 
+#include <sys/stat.h>
+
+// Builtins raise argument count errors rather than throwing them, so that
+// try* can catch them cheaply, see malError.
+#define ARG_COUNT std::distance(argsBegin, argsEnd)
+
+#define RAISE_UNLESS(condition, error) \
+    if (!(condition)) { return malError::raise(error); } else { }
+
 #define CHECK_ARGS_IS(expected) \
-    checkArgsIs(name.c_str(), expected, \
-                  std::distance(argsBegin, argsEnd))
+    RAISE_UNLESS(ARG_COUNT == (expected), \
+        malException::argCount(name.c_str(), expected, expected, ARG_COUNT))
 
 #define CHECK_ARGS_BETWEEN(min, max) \
-    checkArgsBetween(name.c_str(), min, max, \
-                       std::distance(argsBegin, argsEnd))
+    RAISE_UNLESS(ARG_COUNT >= (min) && ARG_COUNT <= (max), \
+        malException::argCount(name.c_str(), min, max, ARG_COUNT))
 
 #define CHECK_ARGS_AT_LEAST(expected) \
-    checkArgsAtLeast(name.c_str(), expected, \
-                        std::distance(argsBegin, argsEnd))
+    RAISE_UNLESS(ARG_COUNT >= (expected), \
+        malException::argCount(name.c_str(), expected, -1, ARG_COUNT))
 
 static String printValues(malValueIter begin, malValueIter end,
                            const String& sep, bool readably);
+static String readFile(const String& filename);
+static malValuePtr embeddedForms(const String& filename);
 
 static StaticList<malBuiltIn*> handlers;
 
@@ -28,14 +43,30 @@ static StaticList<malBuiltIn*> handlers;
 
 #define FUNCNAME(uniq) builtIn ## uniq
 #define HRECNAME(uniq) handler ## uniq
-#define BUILTIN_DEF(uniq, symbol) \
+#define BUILTIN_DEF(uniq, symbol, isMacro, isPure, intOp) \
     static malBuiltIn::ApplyFunc FUNCNAME(uniq); \
     static StaticList<malBuiltIn*>::Node HRECNAME(uniq) \
-        (handlers, new malBuiltIn(symbol, FUNCNAME(uniq))); \
+        (handlers, new malBuiltIn(symbol, FUNCNAME(uniq), \
+                                  isMacro, isPure, intOp)); \
     malValuePtr FUNCNAME(uniq)(const String& name, \
         malValueIter argsBegin, malValueIter argsEnd)
 
-#define BUILTIN(symbol)  BUILTIN_DEF(__LINE__, symbol)
+#define BUILTIN(symbol) \
+    BUILTIN_DEF(__LINE__, symbol, false, false, INT_OP_NONE)
+
+// Macros are passed their arguments unevaluated, and return a new form.
+#define BUILTIN_MACRO(symbol) \
+    BUILTIN_DEF(__LINE__, symbol, true, false, INT_OP_NONE)
+
+// Pure builtins return equal values for equal arguments, and have no side
+// effects, so that calls with constant arguments can be folded.
+#define BUILTIN_PURE(symbol) \
+    BUILTIN_DEF(__LINE__, symbol, false, true, INT_OP_NONE)
+
+// Arithmetic and comparison builtins are pure too, and call sites which
+// only pass them integers do intOp themselves, see malList::callIntegers.
+#define BUILTIN_ARITH(symbol, intOp) \
+    BUILTIN_DEF(__LINE__, symbol, false, true, intOp)
 
 #define BUILTIN_ISA(symbol, type) \
     BUILTIN(symbol) { \
@@ -49,8 +80,8 @@ static StaticList<malBuiltIn*> handlers;
         return mal::boolean(*argsBegin == mal::constant()); \
     }
 
-#define BUILTIN_INTOP(op, checkDivByZero) \
-    BUILTIN(#op) { \
+#define BUILTIN_INTOP(op, intOp, checkDivByZero) \
+    BUILTIN_ARITH(#op, intOp) { \
         CHECK_ARGS_IS(2); \
         ARG(malInteger, lhs); \
         ARG(malInteger, rhs); \
@@ -65,23 +96,25 @@ BUILTIN_ISA("keyword?",     malKeyword);
 BUILTIN_ISA("list?",        malList);
 BUILTIN_ISA("map?",         malHash);
 BUILTIN_ISA("number?",      malInteger);
+BUILTIN_ISA("record?",      malRecord);
 BUILTIN_ISA("sequential?",  malSequence);
 BUILTIN_ISA("string?",      malString);
 BUILTIN_ISA("symbol?",      malSymbol);
 BUILTIN_ISA("vector?",      malVector);
 
-BUILTIN_INTOP(+,            false);
-BUILTIN_INTOP(/,            true);
-BUILTIN_INTOP(*,            false);
-BUILTIN_INTOP(%,            true);
+BUILTIN_INTOP(+,            INT_OP_ADD, false);
+BUILTIN_INTOP(/,            INT_OP_DIV, true);
+BUILTIN_INTOP(*,            INT_OP_MUL, false);
+BUILTIN_INTOP(%,            INT_OP_MOD, true);
 
 BUILTIN_IS("true?",         trueValue);
 BUILTIN_IS("false?",        falseValue);
 BUILTIN_IS("nil?",          nilValue);
 
-BUILTIN("-")
+BUILTIN_ARITH("-", INT_OP_SUB)
 {
-    int argCount = CHECK_ARGS_BETWEEN(1, 2);
+    CHECK_ARGS_BETWEEN(1, 2);
+    int argCount = ARG_COUNT;
     ARG(malInteger, lhs);
     if (argCount == 1) {
         return mal::integer(- lhs->value());
@@ -91,7 +124,7 @@ BUILTIN("-")
     return mal::integer(lhs->value() - rhs->value());
 }
 
-BUILTIN("<=")
+BUILTIN_ARITH("<=", INT_OP_LE)
 {
     CHECK_ARGS_IS(2);
     ARG(malInteger, lhs);
@@ -100,7 +133,7 @@ BUILTIN("<=")
     return mal::boolean(lhs->value() <= rhs->value());
 }
 
-BUILTIN(">=")
+BUILTIN_ARITH(">=", INT_OP_GE)
 {
     CHECK_ARGS_IS(2);
     ARG(malInteger, lhs);
@@ -109,7 +142,7 @@ BUILTIN(">=")
     return mal::boolean(lhs->value() >= rhs->value());
 }
 
-BUILTIN("<")
+BUILTIN_ARITH("<", INT_OP_LT)
 {
     CHECK_ARGS_IS(2);
     ARG(malInteger, lhs);
@@ -118,7 +151,7 @@ BUILTIN("<")
     return mal::boolean(lhs->value() < rhs->value());
 }
 
-BUILTIN(">")
+BUILTIN_ARITH(">", INT_OP_GT)
 {
     CHECK_ARGS_IS(2);
     ARG(malInteger, lhs);
@@ -127,7 +160,7 @@ BUILTIN(">")
     return mal::boolean(lhs->value() > rhs->value());
 }
 
-BUILTIN("=")
+BUILTIN_ARITH("=", INT_OP_EQ)
 {
     CHECK_ARGS_IS(2);
     const malValue* lhs = (*argsBegin++).ptr();
@@ -136,6 +169,92 @@ BUILTIN("=")
     return mal::boolean(lhs->isEqualTo(rhs));
 }
 
+//  Thread acc through forms, as the macros in lib/threading.mal do:
+//  (-> x (a a1) b) => (b (a x a1)), (->> x (a a1) b) => (b (a a1 x))
+static malValuePtr threadForms(malValueIter argsBegin, malValueIter argsEnd,
+                               bool isLast)
+{
+    malValuePtr acc = *argsBegin++;
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        const malList* form = DYNAMIC_CAST(malList, *it);
+        if (!form) {
+            acc = mal::list(*it, acc);
+            continue;
+        }
+        malValueVec* items = new malValueVec;
+        items->reserve(form->count() + 1);
+        items->push_back(form->first());
+        if (!isLast) {
+            items->push_back(acc);
+        }
+        if (!form->isEmpty()) {
+            items->insert(items->end(), form->begin() + 1, form->end());
+        }
+        if (isLast) {
+            items->push_back(acc);
+        }
+        acc = mal::list(items);
+    }
+    return acc;
+}
+
+BUILTIN_MACRO("->")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    return threadForms(argsBegin, argsEnd, false);
+}
+
+BUILTIN_MACRO("->>")
+{
+    CHECK_ARGS_AT_LEAST(1);
+    return threadForms(argsBegin, argsEnd, true);
+}
+
+BUILTIN("add-method")
+{
+    // Used by defmethod.
+    CHECK_ARGS_IS(3);
+    ARG(malMultiMethod, multi);
+    malValuePtr dispatchValue = *argsBegin++;
+    multi->addMethod(dispatchValue, *argsBegin);
+    return malValuePtr(multi);
+}
+
+//  Expands (and x ...) and (or x ...) as the macros in lib/test_cascade.mal
+//  do, binding each value but the last to a fresh symbol so that it is only
+//  evaluated once. EVAL and the compiled tiers don't use the expansion
+//  while the symbol still finds these, see isBuiltinMacro.
+static malValuePtr expandCascade(const String& name, malValueIter argsBegin,
+                                 malValueIter argsEnd, malValuePtr empty)
+{
+    static int counter = 0;
+
+    if (argsBegin == argsEnd) {
+        return empty;
+    }
+    malValuePtr first = *argsBegin++;
+    if (argsBegin == argsEnd) {
+        return first;
+    }
+    malValuePtr var = mal::symbol(STRF("%s__%d", name.c_str(), ++counter));
+
+    malValueVec* rest = new malValueVec(1, mal::symbol(name));
+    rest->insert(rest->end(), argsBegin, argsEnd);
+
+    malValueVec* items = new malValueVec(4);
+    items->at(0) = mal::symbol("if");
+    items->at(1) = var;
+    items->at(2) = name == "and" ? mal::list(rest) : var;
+    items->at(3) = name == "and" ? var : mal::list(rest);
+    return mal::list(mal::symbol("let*"), mal::list(var, first),
+                     mal::list(items));
+}
+
+BUILTIN_MACRO("and")
+{
+    return expandCascade(name, argsBegin, argsEnd, mal::trueValue());
+}
+
 BUILTIN("apply")
 {
     CHECK_ARGS_AT_LEAST(2);
@@ -146,11 +265,14 @@ BUILTIN("apply")
 
     // Then append the argument as a list.
     const malSequence* lastArg = VALUE_CAST(malSequence, *(argsEnd-1));
+    if (malValuePtr error = malBudget::spend(lastArg->count())) {
+        return error;
+    }
     for (int i = 0; i < lastArg->count(); i++) {
         args.push_back(lastArg->item(i));
     }
 
-    return APPLY(op, args.begin(), args.end());
+    return mal::tailCall(op, args.begin(), args.end());
 }
 
 BUILTIN("assoc")
@@ -187,6 +309,31 @@ BUILTIN("concat")
     return mal::list(items);
 }
 
+BUILTIN_MACRO("cond")
+{
+    // Expands one clause at a time, as the MAL version did:
+    // (cond t1 r1 t2 r2) => (if t1 r1 (cond t2 r2))
+    if (argsBegin == argsEnd) {
+        return mal::nilValue();
+    }
+    malValuePtr test = *argsBegin++;
+    if (argsBegin == argsEnd) {
+        return malError::raise(
+            malException::thrown(mal::string("odd number of forms to cond")));
+    }
+    malValuePtr result = *argsBegin++;
+
+    malValueVec* rest = new malValueVec(1, mal::symbol("cond"));
+    rest->insert(rest->end(), argsBegin, argsEnd);
+
+    malValueVec* items = new malValueVec(4);
+    items->at(0) = mal::symbol("if");
+    items->at(1) = test;
+    items->at(2) = result;
+    items->at(3) = mal::list(rest);
+    return mal::list(items);
+}
+
 BUILTIN("conj")
 {
     CHECK_ARGS_AT_LEAST(1);
@@ -229,6 +376,90 @@ BUILTIN("count")
     return mal::integer(seq->count());
 }
 
+BUILTIN_MACRO("defmethod")
+{
+    // (defmethod name dispatch-value [params] body)
+    //  => (add-method name dispatch-value (fn* [params] body))
+    // Multiple ([params] body) clauses make a multi-arity method.
+    CHECK_ARGS_AT_LEAST(3);
+    malValuePtr multi = *argsBegin++;
+    malValuePtr dispatchValue = *argsBegin++;
+
+    malValueVec* fn = new malValueVec(1, mal::symbol("fn*"));
+    fn->insert(fn->end(), argsBegin, argsEnd);
+
+    malValueVec* items = new malValueVec(4);
+    items->at(0) = mal::symbol("add-method");
+    items->at(1) = multi;
+    items->at(2) = dispatchValue;
+    items->at(3) = mal::list(fn);
+    return mal::list(items);
+}
+
+BUILTIN_MACRO("defmulti")
+{
+    // (defmulti name dispatch-fn)
+    //  => (def! name (multimethod (quote name) dispatch-fn))
+    CHECK_ARGS_IS(2);
+    malValuePtr id = *argsBegin++;
+    VALUE_CAST(malSymbol, id);
+
+    malValuePtr create = mal::list(mal::symbol("multimethod"),
+                                   mal::list(mal::symbol("quote"), id),
+                                   *argsBegin);
+    return mal::list(mal::symbol("def!"), id, create);
+}
+
+BUILTIN_MACRO("defprotocol")
+{
+    // (defprotocol p (m1 [this]) (m2 [this a]))
+    //  => (do (def! p (atom {}))
+    //         (def! m1 (protocol-method p :m1))
+    //         (def! m2 (protocol-method p :m2))
+    //         p)
+    CHECK_ARGS_AT_LEAST(1);
+    malValuePtr id = *argsBegin++;
+    VALUE_CAST(malSymbol, id);
+
+    malValueVec* items = new malValueVec(1, mal::symbol("do"));
+    items->push_back(mal::list(mal::symbol("def!"), id,
+                               mal::list(mal::symbol("atom"),
+                                         mal::hash(malHash::Map()))));
+    for (auto it = argsBegin; it != argsEnd; ++it) {
+        const malSequence* spec = VALUE_CAST(malSequence, *it);
+        MAL_CHECK(spec->count() == 2,
+                  "%s is not a (method [params]) spec",
+                  spec->print(true).c_str());
+        const malSymbol* method = VALUE_CAST(malSymbol, spec->item(0));
+        const malSequence* params = VALUE_CAST(malSequence, spec->item(1));
+        MAL_CHECK(params->count() >= 1,
+                  "%s must take at least one parameter",
+                  method->value().c_str());
+        malValuePtr create = mal::list(mal::symbol("protocol-method"), id,
+                                       mal::keyword(":" + method->value()));
+        items->push_back(mal::list(mal::symbol("def!"), spec->item(0),
+                                   create));
+    }
+    items->push_back(id);
+    return mal::list(items);
+}
+
+BUILTIN_MACRO("defrecord")
+{
+    // (defrecord Point [x y])
+    //  => (def! ->Point (record-type (quote Point) (quote [x y])))
+    CHECK_ARGS_IS(2);
+    ARG(malSymbol, id);
+    malValuePtr fields = *argsBegin;
+
+    malValuePtr create = mal::list(mal::symbol("record-type"),
+                                   mal::list(mal::symbol("quote"),
+                                             mal::symbol(id->value())),
+                                   mal::list(mal::symbol("quote"), fields));
+    return mal::list(mal::symbol("def!"), mal::symbol("->" + id->value()),
+                     create);
+}
+
 BUILTIN("deref")
 {
     CHECK_ARGS_IS(1);
@@ -259,6 +490,31 @@ BUILTIN("eval")
     return EVAL(*argsBegin, NULL);
 }
 
+BUILTIN("extend")
+{
+    // (extend type protocol methods & more), as in lib/protocols.mal.
+    CHECK_ARGS_AT_LEAST(3);
+    malValuePtr type = *argsBegin++;
+    VALUE_CAST(malKeyword, type);
+    while (argsBegin != argsEnd) {
+        ARG(malAtom, protocol);
+        MAL_CHECK(argsBegin != argsEnd, "extend needs a map of methods");
+        malValuePtr methods = *argsBegin++;
+        VALUE_CAST(malHash, methods);
+
+        malValueVec binding { type, methods };
+        const malHash* map = VALUE_CAST(malHash, protocol->deref());
+        protocol->reset(map->assoc(binding.begin(), binding.end()));
+    }
+    return mal::nilValue();
+}
+
+BUILTIN("find-type")
+{
+    CHECK_ARGS_IS(1);
+    return mal::typeOf(*argsBegin);
+}
+
 BUILTIN("first")
 {
     CHECK_ARGS_IS(1);
@@ -274,12 +530,9 @@ BUILTIN("fn?")
     CHECK_ARGS_IS(1);
     malValuePtr arg = *argsBegin++;
 
-    // Lambdas are functions, unless they're macros.
-    if (const malLambda* lambda = DYNAMIC_CAST(malLambda, arg)) {
-        return mal::boolean(!lambda->isMacro());
-    }
-    // Builtins are functions.
-    return mal::boolean(DYNAMIC_CAST(malBuiltIn, arg));
+    // Lambdas and builtins are functions, unless they're macros.
+    const malApplicable* f = DYNAMIC_CAST(malApplicable, arg);
+    return mal::boolean((f != NULL) && !f->isMacro());
 }
 
 BUILTIN("get")
@@ -320,13 +573,21 @@ BUILTIN("list")
     return mal::list(argsBegin, argsEnd);
 }
 
+BUILTIN("load-file")
+{
+    CHECK_ARGS_IS(1);
+    ARG(malString, filename);
+
+    return EVAL(readFileForms(filename->value()), NULL);
+}
+
 BUILTIN("macro?")
 {
     CHECK_ARGS_IS(1);
 
-    // Macros are implemented as lambdas, with a special flag.
-    const malLambda* lambda = DYNAMIC_CAST(malLambda, *argsBegin);
-    return mal::boolean((lambda != NULL) && lambda->isMacro());
+    // Macros are implemented as lambdas or builtins, with a special flag.
+    const malApplicable* f = DYNAMIC_CAST(malApplicable, *argsBegin);
+    return mal::boolean((f != NULL) && f->isMacro());
 }
 
 BUILTIN("map")
@@ -336,6 +597,9 @@ BUILTIN("map")
     ARG(malSequence, source);
 
     const int length = source->count();
+    if (malValuePtr error = malBudget::spend(length)) {
+        return error;
+    }
     malValueVec* items = new malValueVec(length);
     auto it = source->begin();
     for (int i = 0; i < length; i++) {
@@ -345,6 +609,36 @@ BUILTIN("map")
     return  mal::list(items);
 }
 
+BUILTIN("memory-stats")
+{
+    // The live bytes and objects of each class of value, and of the kinds
+    // of storage they own, see malMemory.
+    CHECK_ARGS_IS(0);
+    // Making the first value of a class adds its usage, so this indexes
+    // the usages rather than iterating over them.
+    malValueVec usages;
+    for (size_t i = 0; i < malMemory::usages().size(); i++) {
+        const malMemory::Usage* usage = malMemory::usages()[i];
+        if (usage->count == 0) {
+            continue;
+        }
+        malValueVec items = {
+            mal::keyword(":count"), mal::integer(usage->count),
+            mal::keyword(":bytes"), mal::integer(usage->bytes),
+        };
+        usages.push_back(mal::keyword(":" + usage->name));
+        usages.push_back(mal::hash(items.begin(), items.end(), true));
+    }
+    malValueVec items = {
+        mal::keyword(":bytes"),  mal::integer(malMemory::bytes()),
+        mal::keyword(":peak"),   mal::integer(malMemory::peak()),
+        mal::keyword(":quota"),  mal::integer(malMemory::quota()),
+        mal::keyword(":usage"),
+            mal::hash(usages.begin(), usages.end(), true),
+    };
+    return mal::hash(items.begin(), items.end(), true);
+}
+
 BUILTIN("meta")
 {
     CHECK_ARGS_IS(1);
@@ -353,6 +647,20 @@ BUILTIN("meta")
     return obj->meta();
 }
 
+BUILTIN("multimethod")
+{
+    // Used by defmulti.
+    CHECK_ARGS_IS(2);
+    ARG(malSymbol, id);
+    return mal::multiMethod(id->value(), *argsBegin);
+}
+
+BUILTIN("not")
+{
+    CHECK_ARGS_IS(1);
+    return mal::boolean(!(*argsBegin)->isTrue());
+}
+
 BUILTIN("nth")
 {
     CHECK_ARGS_IS(2);
@@ -365,6 +673,11 @@ BUILTIN("nth")
     return seq->item(i);
 }
 
+BUILTIN_MACRO("or")
+{
+    return expandCascade(name, argsBegin, argsEnd, mal::nilValue());
+}
+
 BUILTIN("pr-str")
 {
     return mal::string(printValues(argsBegin, argsEnd, " ", true));
@@ -382,6 +695,14 @@ BUILTIN("prn")
     return mal::nilValue();
 }
 
+BUILTIN("protocol-method")
+{
+    // Used by defprotocol.
+    CHECK_ARGS_IS(2);
+    malValuePtr protocol = *argsBegin++;
+    return mal::protocolMethod(protocol, *argsBegin);
+}
+
 BUILTIN("read-string")
 {
     CHECK_ARGS_IS(1);
@@ -398,6 +719,21 @@ BUILTIN("readline")
     return readline(str->value());
 }
 
+BUILTIN("record-type")
+{
+    // Used by defrecord.
+    CHECK_ARGS_IS(2);
+    ARG(malSymbol, id);
+    ARG(malSequence, names);
+
+    malValueVec fields;
+    for (auto it = names->begin(), end = names->end(); it != end; ++it) {
+        const malSymbol* field = VALUE_CAST(malSymbol, *it);
+        fields.push_back(mal::keyword(":" + field->value()));
+    }
+    return mal::recordType(id->value(), fields);
+}
+
 BUILTIN("reset!")
 {
     CHECK_ARGS_IS(2);
@@ -415,6 +751,14 @@ BUILTIN("rest")
     return seq->rest();
 }
 
+BUILTIN("satisfies?")
+{
+    CHECK_ARGS_IS(2);
+    ARG(malAtom, protocol);
+    const malHash* map = VALUE_CAST(malHash, protocol->deref());
+    return mal::boolean(map->contains(mal::typeOf(*argsBegin)));
+}
+
 BUILTIN("seq")
 {
     CHECK_ARGS_IS(1);
@@ -447,21 +791,10 @@ BUILTIN("slurp")
     CHECK_ARGS_IS(1);
     ARG(malString, filename);
 
-    std::ios_base::openmode openmode =
-        std::ios::ate | std::ios::in | std::ios::binary;
-    std::ifstream file(filename->value().c_str(), openmode);
-    MAL_CHECK(!file.fail(), "Cannot open %s", filename->value().c_str());
-
-    String data;
-    data.reserve(file.tellg());
-    file.seekg(0, std::ios::beg);
-    data.append(std::istreambuf_iterator<char>(file.rdbuf()),
-                std::istreambuf_iterator<char>());
-
-    return mal::string(data);
+    return mal::string(readFile(filename->value()));
 }
 
-BUILTIN("str")
+BUILTIN_PURE("str")
 {
     return mal::string(printValues(argsBegin, argsEnd, "", false));
 }
@@ -491,7 +824,39 @@ BUILTIN("symbol")
 BUILTIN("throw")
 {
     CHECK_ARGS_IS(1);
-    throw *argsBegin;
+    return malError::raise(malException::thrown(*argsBegin));
+}
+
+BUILTIN("tier-stats")
+{
+    // The fn* and loop* bodies that have been compiled, see
+    // malBindingPlan::enter, with the calls and recur jumps into each, and
+    // the time taken to compile it.
+    CHECK_ARGS_IS(0);
+    unsigned totalTime = 0;
+    malValueVec* bodies = new malValueVec;
+    for (auto& plan : malBindingPlan::tieredPlans()) {
+        if (!plan->tieredBody()) {
+            continue; // it has been given another body since
+        }
+        malValueVec items = {
+            mal::keyword(":body"),          plan->tieredBody(),
+            mal::keyword(":calls"),         mal::integer(plan->callCount()),
+            mal::keyword(":recurs"),        mal::integer(plan->recurCount()),
+            mal::keyword(":compile-usecs"), mal::integer(plan->compileTime()),
+        };
+        bodies->push_back(mal::hash(items.begin(), items.end(), true));
+        totalTime += plan->compileTime();
+    }
+    int count = bodies->size();
+    malValueVec items = {
+        mal::keyword(":threshold"),
+            mal::integer(malBindingPlan::tieringThreshold()),
+        mal::keyword(":compiled"),      mal::integer(count),
+        mal::keyword(":compile-usecs"), mal::integer(totalTime),
+        mal::keyword(":bodies"),        mal::list(bodies),
+    };
+    return mal::hash(items.begin(), items.end(), true);
 }
 
 BUILTIN("time-ms")
@@ -540,6 +905,81 @@ void installCore(malEnvPtr env) {
     }
 }
 
+static bool isEmbedding()
+{
+    static const bool isDisabled = getenv("MAL_NO_EMBED") != NULL;
+    return !isDisabled;
+}
+
+malValuePtr embeddedPrelude()
+{
+    if (!isEmbedding()) {
+        return NULL;
+    }
+    // The prelude is the one entry that wasn't read from a file.
+    for (auto file = embeddedFiles; file->name != NULL; ++file) {
+        if (!file->path) {
+            return imageToValue(file->data, file->size, file->name);
+        }
+    }
+    return NULL;
+}
+
+static malValuePtr embeddedForms(const String& filename)
+{
+    if (!isEmbedding()) {
+        return NULL;
+    }
+
+    // An embedded library file replaces only the file it was read from,
+    // found through its canonical path, so that a file of the user's own,
+    // such as "proj/lib/perf.mal", isn't taken for mal's "lib/perf.mal",
+    // and only while its size and modification time are those it was read
+    // with, so that an edit to it is seen before stepA_mal is rebuilt.
+    char resolved[PATH_MAX];
+    struct stat status;
+    if (realpath(filename.c_str(), resolved) == NULL ||
+            stat(resolved, &status) != 0) {
+        return NULL;
+    }
+    for (auto file = embeddedFiles; file->name != NULL; ++file) {
+        if (file->path && strcmp(resolved, file->path) == 0) {
+            if (status.st_size != file->fileSize ||
+                    status.st_mtime != file->fileTime) {
+                return NULL;
+            }
+            return imageToValue(file->data, file->size, file->name);
+        }
+    }
+    return NULL;
+}
+
+//  The forms of a mal source file, as (do forms... nil), or its embedded
+//  copy.
+malValuePtr readFileForms(const String& filename)
+{
+    if (malValuePtr forms = embeddedForms(filename)) {
+        return forms;
+    }
+    return readStr("(do " + readFile(filename) + "\nnil)");
+}
+
+static String readFile(const String& filename)
+{
+    std::ios_base::openmode openmode =
+        std::ios::ate | std::ios::in | std::ios::binary;
+    std::ifstream file(filename.c_str(), openmode);
+    MAL_CHECK(!file.fail(), "Cannot open %s", filename.c_str());
+
+    String data;
+    data.reserve(file.tellg());
+    file.seekg(0, std::ios::beg);
+    data.append(std::istreambuf_iterator<char>(file.rdbuf()),
+                std::istreambuf_iterator<char>());
+
+    return data;
+}
+
 static String printValues(malValueIter begin, malValueIter end,
                           const String& sep, bool readably)
 {
@@ -2,43 +2,101 @@
 #include "Types.h"
 
 #include <algorithm>
+#include <chrono>
+#include <unordered_map>
 
-malEnv::malEnv(malEnvPtr outer)
-: m_outer(outer)
+unsigned malEnv::s_globalVersion = 1;
+
+// Recycled frames keep the capacity of their slots, so reusing one doesn't
+// allocate at all. The pool only needs to be as deep as the calls that are
+// typically in progress at once.
+static const size_t MAX_POOLED_FRAMES = 256;
+static std::vector<malEnvPtr> s_framePool;
+
+const malName* malName::intern(const String& name)
 {
-    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    // Names live for as long as the interpreter does.
+    static std::unordered_map<String, const malName*> names;
+
+    const malName*& entry = names[name];
+    if (!entry) {
+        entry = new malName(name);
+    }
+    return entry;
 }
 
-malEnv::malEnv(malEnvPtr outer, const StringVec& bindings,
-               malValueIter argsBegin, malValueIter argsEnd)
-: m_outer(outer)
+void malName::markLocalDefs(malValuePtr form, bool isLocalEnv)
 {
-    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
-    int n = bindings.size();
-    auto it = argsBegin;
-    for (int i = 0; i < n; i++) {
-        if (bindings[i] == "&") {
-            MAL_CHECK(i == n - 2, "There must be one parameter after the &");
-
-            set(bindings[n-1], mal::list(it, argsEnd));
+    if (const malCompiled* compiled = DYNAMIC_CAST(malCompiled, form)) {
+        markLocalDefs(compiled->body(), isLocalEnv);
+        return;
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, form)) {
+        if (!hash->isEvaluated()) {
+            markLocalDefs(hash->values(), isLocalEnv);
+        }
+        return;
+    }
+    const malSequence* seq = DYNAMIC_CAST(malSequence, form);
+    if (!seq || seq->isEmpty()) {
+        return;
+    }
+    int start = 0;
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, seq->item(0));
+    if (symbol && DYNAMIC_CAST(malList, form)) {
+        const String& special = symbol->value();
+        if (special == "quote") {
             return;
         }
-        MAL_CHECK(it != argsEnd, "Not enough parameters");
-        set(bindings[i], *it);
-        ++it;
+        if (special == "def!" || special == "defmacro!") {
+            const malSymbol* id = seq->count() > 1
+                ? DYNAMIC_CAST(malSymbol, seq->item(1)) : NULL;
+            if (id && isLocalEnv) {
+                id->name()->markLocal();
+                id->name()->markRebound();
+            }
+            start = 2;
+        }
+        else if (special == "fn*" || special == "let*" || special == "loop*") {
+            isLocalEnv = true;
+        }
+    }
+    for (int i = start, count = seq->count(); i < count; i++) {
+        markLocalDefs(seq->item(i), isLocalEnv);
+    }
+}
+
+malEnv::malEnv(malEnvPtr outer, int slotCount)
+: m_outer(outer)
+, m_isCaptured(false)
+{
+    TRACE_ENV("Creating malEnv %p, outer=%p\n", this, m_outer.ptr());
+    if (!m_outer) {
+        s_globalVersion++;
     }
-    MAL_CHECK(it == argsEnd, "Too many parameters");
+    m_slots.reserve(slotCount);
 }
 
 malEnv::~malEnv()
 {
     TRACE_ENV("Destroying malEnv %p, outer=%p\n", this, m_outer.ptr());
+    if (!m_outer) {
+        s_globalVersion++;
+    }
 }
 
 malEnvPtr malEnv::find(const String& symbol)
 {
+    const malName* name = malName::intern(symbol);
     for (malEnvPtr env = this; env; env = env->m_outer) {
-        if (env->m_map.find(symbol) != env->m_map.end()) {
+        if (env->m_outer) {
+            for (auto& slot : env->m_slots) {
+                if (slot.first == name) {
+                    return env;
+                }
+            }
+        }
+        else if (env->m_map.find(symbol) != env->m_map.end()) {
             return env;
         }
     }
@@ -47,21 +105,189 @@ malEnvPtr malEnv::find(const String& symbol)
 
 malValuePtr malEnv::get(const String& symbol)
 {
-    for (malEnvPtr env = this; env; env = env->m_outer) {
-        auto it = env->m_map.find(symbol);
-        if (it != env->m_map.end()) {
-            return it->second;
+    malValuePtr value = lookup(symbol);
+    MAL_CHECK(value, "'%s' not found", symbol.c_str());
+    return value;
+}
+
+//  Return the value bound to symbol, else NULL.
+malValuePtr malEnv::lookup(const String& symbol)
+{
+    return lookup(malName::intern(symbol));
+}
+
+malValuePtr malEnv::lookup(const malName* name)
+{
+    malEnv* env = this;
+    for (; env->m_outer; env = env->m_outer.ptr()) {
+        // Search backwards, so that later let* bindings hide earlier ones.
+        for (auto it = env->m_slots.rbegin(), end = env->m_slots.rend();
+             it != end; ++it) {
+            if (it->first == name) {
+                return it->second;
+            }
         }
     }
-    MAL_FAIL("'%s' not found", symbol.c_str());
+    auto it = env->m_map.find(name->value());
+    return it == env->m_map.end() ? malValuePtr() : it->second;
+}
+
+static bool isMacro(malValuePtr value)
+{
+    const malApplicable* handler = DYNAMIC_CAST(malApplicable, value);
+    return handler && handler->isMacro();
 }
 
 malValuePtr malEnv::set(const String& symbol, malValuePtr value)
 {
+    if (m_outer) {
+        return set(malName::intern(symbol), value);
+    }
+    if (m_map.find(symbol) == m_map.end() || isMacro(value)) {
+        s_globalVersion++;
+    }
     m_map[symbol] = value;
     return value;
 }
 
+malValuePtr malEnv::set(const malName* name, malValuePtr value)
+{
+    if (!m_outer) {
+        return set(name->value(), value);
+    }
+    name->markLocal();
+    name->markRebound();
+    if (isMacro(value)) {
+        s_globalVersion++;
+    }
+    for (auto& slot : m_slots) {
+        if (slot.first == name) {
+            slot.second = value;
+            return value;
+        }
+    }
+    bind(name, value);
+    return value;
+}
+
+malEnv::Map malEnv::getBindings() const
+{
+    if (!m_outer) {
+        return m_map;
+    }
+    Map bindings;
+    for (auto& slot : m_slots) {
+        bindings[slot.first->value()] = slot.second;
+    }
+    return bindings;
+}
+
+const malValuePtr* malEnv::globalCell(const String& symbol)
+{
+    malEnv* root = this;
+    while (root->m_outer) {
+        root = root->m_outer.ptr();
+    }
+    auto it = root->m_map.find(symbol);
+    return it == root->m_map.end() ? NULL : &it->second;
+}
+
+void malEnv::setRecurTarget(malBindingPlanPtr plan, malValuePtr body)
+{
+    m_recurPlan = plan;
+    m_recurBody = body;
+}
+
+malBindingPlanPtr malEnv::recurPlan() const
+{
+    return m_recurPlan;
+}
+
+void malEnv::markCaptured()
+{
+    // Stop at the first one already captured, since all of its outer
+    // environments will have been marked with it.
+    for (malEnv* env = this; env && !env->m_isCaptured;
+         env = env->m_outer.ptr()) {
+        env->m_isCaptured = true;
+    }
+}
+
+malEnvPtr malEnv::make(malEnvPtr outer, int slotCount)
+{
+    if (s_framePool.empty()) {
+        return malEnvPtr(new malEnv(outer, slotCount));
+    }
+    malEnvPtr env = s_framePool.back();
+    s_framePool.pop_back();
+    env->m_outer = outer;
+    env->m_slots.reserve(slotCount);
+    return env;
+}
+
+void malEnv::recycle(malEnvPtr& env)
+{
+    while (env && env->m_outer && env->refCount() == 1 &&
+           s_framePool.size() < MAX_POOLED_FRAMES) {
+        malEnvPtr outer = env->m_outer;
+        env->m_slots.clear();
+        env->m_outer = NULL;
+        env->m_recurPlan = NULL;
+        env->m_recurBody = NULL;
+        env->m_isCaptured = false;
+        s_framePool.push_back(env);
+        env = outer;
+    }
+    env = NULL;
+}
+
+void malEnv::releasePool()
+{
+    s_framePool.clear();
+}
+
+malEnvPtr malEnv::capture(const malNameVec& names)
+{
+    if (!m_outer) {
+        return this;
+    }
+    malEnvPtr root = getRoot();
+    malValueVec values;
+    values.reserve(names.size());
+    for (const malName* name : names) {
+        if (name->isRebound()) {
+            return this;
+        }
+        malValuePtr value;
+        for (malEnv* env = this; env->m_outer && !value;
+             env = env->m_outer.ptr()) {
+            for (auto it = env->m_slots.rbegin(), end = env->m_slots.rend();
+                 it != end; ++it) {
+                if (it->first == name) {
+                    value = it->second;
+                    break;
+                }
+            }
+        }
+        if (!value && (name->isLocal() ||
+                       root->m_map.find(name->value()) == root->m_map.end())) {
+            return this;
+        }
+        values.push_back(value);
+    }
+
+    malEnvPtr flat;
+    for (size_t i = 0; i < names.size(); i++) {
+        if (values[i]) {
+            if (!flat) {
+                flat = make(root, names.size());
+            }
+            flat->bind(names[i], values[i]);
+        }
+    }
+    return flat ? flat : root;
+}
+
 malEnvPtr malEnv::getRoot()
 {
     // Work our way down the the global environment.
@@ -71,3 +297,372 @@ malEnvPtr malEnv::getRoot()
         }
     }
 }
+
+malBindingPlanPtr malBindingPlan::forParams(malValuePtr params)
+{
+    const malSequence* seq = VALUE_CAST(malSequence, params);
+    malBindingPlanPtr plan = seq->bindingPlan();
+    if (!plan || !plan->isParams()) {
+        plan = new malBindingPlan(seq, true);
+        seq->setBindingPlan(plan);
+    }
+    return plan;
+}
+
+malBindingPlanPtr malBindingPlan::forLet(malValuePtr bindings)
+{
+    const malSequence* seq = VALUE_CAST(malSequence, bindings);
+    malBindingPlanPtr plan = seq->bindingPlan();
+    if (!plan || plan->isParams()) {
+        plan = new malBindingPlan(seq, false);
+        seq->setBindingPlan(plan);
+    }
+    return plan;
+}
+
+malBindingPlan::malBindingPlan(const malSequence* seq, bool isParams)
+: m_isParams(isParams)
+, m_slotCount(0)
+, m_hasFreeNames(false)
+, m_freeVersion(0)
+, m_callCount(0)
+, m_recurCount(0)
+, m_compileTime(0)
+, m_isTiered(false)
+{
+    if (isParams) {
+        m_params = compileSequence(seq);
+        MAL_CHECK(m_params.name == NULL, "fn* parameters cannot use :as");
+        return;
+    }
+
+    int count = checkArgsEven("let*", seq->count());
+    m_let.resize(count / 2);
+    for (int i = 0; i < count; i += 2) {
+        m_let[i / 2].pattern = compile(seq->item(i));
+        m_let[i / 2].value = seq->item(i + 1);
+    }
+
+    // A closure made before a later binding of the same name sees that one,
+    // as it would if this frame were kept, so it can't copy the earlier
+    // value, see malEnv::capture.
+    malNameVec bound;
+    for (auto& binding : m_let) {
+        malNameVec names;
+        malValueVec defaults;
+        collectNames(binding.pattern, names, defaults);
+        for (const malName* name : names) {
+            if (std::find(bound.begin(), bound.end(), name) != bound.end()) {
+                name->markRebound();
+            }
+            bound.push_back(name);
+        }
+    }
+}
+
+void malBindingPlan::paramNames(malNameVec& names, malValueVec& defaults) const
+{
+    collectNames(m_params, names, defaults);
+}
+
+void malBindingPlan::letNames(int index,
+                              malNameVec& names, malValueVec& defaults) const
+{
+    collectNames(m_let[index].pattern, names, defaults);
+}
+
+void malBindingPlan::collectNames(const Pattern& pattern,
+                                  malNameVec& names, malValueVec& defaults)
+{
+    if (pattern.name) {
+        names.push_back(pattern.name);
+    }
+    for (auto& item : pattern.items) {
+        collectNames(item, names, defaults);
+    }
+    for (auto& item : pattern.rest) {
+        collectNames(item, names, defaults);
+    }
+    for (auto& key : pattern.keys) {
+        names.push_back(key.name);
+        if (key.defaultValue) {
+            defaults.push_back(key.defaultValue);
+        }
+    }
+}
+
+void malBindingPlan::setFreeNames(malValuePtr body,
+                                  const malNameVec* names) const
+{
+    m_freeBody = body;
+    m_hasFreeNames = names != NULL;
+    m_freeVersion = malEnv::globalVersion();
+    m_freeNames = names ? *names : malNameVec();
+}
+
+unsigned malBindingPlan::s_tierThreshold = 0;
+malBindingPlan::Compiler* malBindingPlan::s_compile = NULL;
+malBindingPlan::Plans malBindingPlan::s_tieredPlans;
+
+void malBindingPlan::setTiering(unsigned threshold, Compiler* compile)
+{
+    s_tierThreshold = threshold;
+    s_compile = compile;
+}
+
+//  The counts are kept for one body at a time. A plan only sees another
+//  body when a macro has used the same parameters in more than one fn*.
+malValuePtr malBindingPlan::countEntry(malValuePtr body, bool isRecur) const
+{
+    if (m_countedBody.ptr() != body.ptr()) {
+        m_countedBody = body;
+        m_tieredFrom = NULL;
+        m_tieredBody = NULL;
+        m_callCount = m_recurCount = 0;
+    }
+    (isRecur ? m_recurCount : m_callCount)++;
+    if (!s_compile || s_tierThreshold == 0 ||
+        m_callCount + m_recurCount < s_tierThreshold) {
+        return body;
+    }
+
+    using namespace std::chrono;
+    auto start = steady_clock::now();
+    m_tieredBody = s_compile(body);
+    m_tieredFrom = body;
+    m_compileTime = duration_cast<microseconds>(steady_clock::now() - start)
+                        .count();
+    addTiered();
+    return m_tieredBody;
+}
+
+void malBindingPlan::setTieredBody(malValuePtr body, malValuePtr compiled) const
+{
+    m_countedBody = m_tieredFrom = body;
+    m_tieredBody = compiled;
+    m_callCount = m_recurCount = m_compileTime = 0;
+    addTiered();
+}
+
+void malBindingPlan::addTiered() const
+{
+    if (!m_isTiered) {
+        s_tieredPlans.push_back(const_cast<malBindingPlan*>(this));
+        m_isTiered = true;
+    }
+}
+
+malBindingPlan::Pattern malBindingPlan::compile(malValuePtr form)
+{
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, form)) {
+        return compileSequence(seq);
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, form)) {
+        return compileHash(hash);
+    }
+    Pattern pattern;
+    pattern.kind = Pattern::NAME;
+    pattern.name = compileName(form);
+    return pattern;
+}
+
+const malName* malBindingPlan::compileName(malValuePtr form)
+{
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, form);
+    MAL_CHECK(sym && sym->value() != "&",
+              "%s is not a valid binding form", form->print(true).c_str());
+    sym->name()->markLocal();
+    m_slotCount++;
+    return sym->name();
+}
+
+//  [a b & rest :as all]
+malBindingPlan::Pattern malBindingPlan::compileSequence(const malSequence* seq)
+{
+    Pattern pattern;
+    pattern.kind = Pattern::SEQUENCE;
+    pattern.name = NULL;
+
+    int count = seq->count();
+    for (int i = 0; i < count; i++) {
+        malValuePtr item = seq->item(i);
+        if (const malKeyword* k = DYNAMIC_CAST(malKeyword, item)) {
+            MAL_CHECK(k->value() == ":as" && i == count - 2,
+                      "%s must be followed by one name at the end of %s",
+                      k->print(true).c_str(), seq->print(true).c_str());
+            pattern.name = compileName(seq->item(i + 1));
+            break;
+        }
+        const malSymbol* sym = DYNAMIC_CAST(malSymbol, item);
+        if (sym && sym->value() == "&") {
+            bool hasAs = i == count - 4 &&
+                         DYNAMIC_CAST(malKeyword, seq->item(i + 2));
+            MAL_CHECK(i == count - 2 || hasAs,
+                      "There must be one parameter after the &");
+            pattern.rest.push_back(compile(seq->item(i + 1)));
+            i++;
+            continue;
+        }
+        pattern.items.push_back(compile(item));
+    }
+    return pattern;
+}
+
+//  {:keys [a b] :strs [c] :or {:a 1} :as m}
+malBindingPlan::Pattern malBindingPlan::compileHash(const malHash* hash)
+{
+    Pattern pattern;
+    pattern.kind = Pattern::HASH;
+    pattern.name = NULL;
+
+    malValuePtr keyList = hash->keys();
+    const malSequence* keys = STATIC_CAST(malSequence, keyList);
+    malValuePtr defaults;
+    for (auto it = keys->begin(), end = keys->end(); it != end; ++it) {
+        const malKeyword* k = DYNAMIC_CAST(malKeyword, *it);
+        String option = k ? k->value() : "";
+        malValuePtr value = hash->get(*it);
+        if (option == ":as") {
+            pattern.name = compileName(value);
+        }
+        else if (option == ":or") {
+            defaults = value;
+            VALUE_CAST(malHash, defaults);
+        }
+        else if (option == ":keys" || option == ":strs") {
+            const malSequence* names = VALUE_CAST(malSequence, value);
+            for (auto name = names->begin(); name != names->end(); ++name) {
+                Key key;
+                key.name = compileName(*name);
+                key.key = option == ":keys"
+                    ? mal::keyword(":" + key.name->value())
+                    : mal::string(key.name->value());
+                pattern.keys.push_back(key);
+            }
+        }
+        else {
+            MAL_FAIL("%s is not a valid binding form",
+                     hash->print(true).c_str());
+        }
+    }
+
+    if (defaults) {
+        const malHash* d = STATIC_CAST(malHash, defaults);
+        for (auto& key : pattern.keys) {
+            if (d->contains(key.key)) {
+                key.defaultValue = d->get(key.key);
+            }
+        }
+    }
+    return pattern;
+}
+
+malEnvPtr malBindingPlan::bindArgs(malEnvPtr outer,
+                                   malValueIter argsBegin,
+                                   malValueIter argsEnd) const
+{
+    int required = m_params.items.size();
+    int supplied = std::distance(argsBegin, argsEnd);
+    MAL_CHECK(supplied >= required, "Not enough parameters");
+    MAL_CHECK(supplied == required || !m_params.rest.empty(),
+              "Too many parameters");
+
+    malEnvPtr env = malEnv::make(outer, m_slotCount);
+    bindItems(m_params, argsBegin, argsEnd, env.ptr());
+    return env;
+}
+
+void malBindingPlan::rebind(malEnv* env,
+                            malValueIter argsBegin, malValueIter argsEnd) const
+{
+    int supplied = std::distance(argsBegin, argsEnd);
+    if (!m_isParams) {
+        MAL_CHECK(supplied == letCount(),
+                  "recur expects %d arguments, got %d", letCount(), supplied);
+        env->clearSlots();
+        auto it = argsBegin;
+        for (auto& binding : m_let) {
+            bind(binding.pattern, *it++, env);
+        }
+        return;
+    }
+
+    int required = m_params.items.size();
+    int expected = required + (m_params.rest.empty() ? 0 : 1);
+    MAL_CHECK(supplied == expected,
+              "recur expects %d arguments, got %d", expected, supplied);
+    env->clearSlots();
+    auto it = argsBegin;
+    for (auto& item : m_params.items) {
+        bind(item, *it++, env);
+    }
+    if (!m_params.rest.empty()) {
+        bind(m_params.rest[0], *it, env);
+    }
+}
+
+void malBindingPlan::bind(const Pattern& pattern,
+                          malValuePtr value, malEnv* env) const
+{
+    switch (pattern.kind) {
+        case Pattern::NAME:
+            env->bind(pattern.name, value);
+            return;
+
+        case Pattern::SEQUENCE: {
+            if (value == mal::nilValue()) {
+                malValueVec empty;
+                bindItems(pattern, empty.begin(), empty.end(), env);
+            }
+            else {
+                const malSequence* seq = VALUE_CAST(malSequence, value);
+                bindItems(pattern, seq->begin(), seq->end(), env);
+            }
+            if (pattern.name) {
+                env->bind(pattern.name, value);
+            }
+            return;
+        }
+
+        case Pattern::HASH: {
+            const malHash* hash = value == mal::nilValue()
+                ? NULL : VALUE_CAST(malHash, value);
+            for (auto& key : pattern.keys) {
+                if (hash && hash->contains(key.key)) {
+                    env->bind(key.name, hash->get(key.key));
+                }
+                else if (key.defaultValue) {
+                    env->bind(key.name, EVAL(key.defaultValue, env));
+                }
+                else {
+                    env->bind(key.name, mal::nilValue());
+                }
+            }
+            if (pattern.name) {
+                env->bind(pattern.name, value);
+            }
+            return;
+        }
+    }
+}
+
+//  Missing items are bound to nil, and extra ones are ignored, unless they
+//  are taken by the & pattern.
+void malBindingPlan::bindItems(const Pattern& pattern,
+                               malValueIter begin, malValueIter end,
+                               malEnv* env) const
+{
+    auto it = begin;
+    for (auto& item : pattern.items) {
+        if (it != end) {
+            bind(item, *it, env);
+            ++it;
+        }
+        else {
+            bind(item, mal::nilValue(), env);
+        }
+    }
+    if (!pattern.rest.empty()) {
+        bind(pattern.rest[0], mal::list(it, end), env);
+    }
+}
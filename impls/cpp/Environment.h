@@ -2,28 +2,313 @@
 #define INCLUDE_ENVIRONMENT_H
 
 #include "MAL.h"
+#include "Memory.h"
 
 #include <map>
+#include <memory>
+
+// Every distinct symbol name is interned once. Local environments are keyed
+// by these, so their lookups compare pointers rather than strings.
+class malName {
+public:
+    static const malName* intern(const String& name);
+
+    const String& value() const { return m_value; }
+
+    // A name that has never been bound in a local environment can only be
+    // found in the global one, see malSymbol::lookup.
+    bool isLocal() const { return m_isLocal; }
+    void markLocal() const { m_isLocal = true; }
+
+    // Marks the names that a def! or defmacro! in form will bind in a local
+    // environment, as those inside a fn*, let* or loop*, or anywhere in form
+    // if it is to be evaluated in a local environment, before any of them
+    // has run, as local and rebound. A closure made earlier in the same body
+    // then keeps the frames around it, rather than missing the name, or
+    // copying a value that the def! hides, see malEnv::capture.
+    static void markLocalDefs(malValuePtr form, bool isLocalEnv);
+
+    // A name that def! binds in a local environment, or that one let* binds
+    // more than once. Closures share these, see malEnv::capture.
+    bool isRebound() const { return m_isRebound; }
+    void markRebound() const { m_isRebound = true; }
+
+private:
+    malName(const String& value)
+    : m_value(value), m_isLocal(false), m_isRebound(false) { }
+
+    const String m_value;
+    mutable bool m_isLocal;
+    mutable bool m_isRebound;
+};
+
+typedef std::vector<const malName*> malNameVec;
 
 class malEnv : public RefCounted {
 public:
-    malEnv(malEnvPtr outer = NULL);
-    malEnv(malEnvPtr outer,
-           const StringVec& bindings,
-           malValueIter argsBegin,
-           malValueIter argsEnd);
+    typedef std::map<String, malValuePtr> Map;
+
+    malEnv(malEnvPtr outer = NULL, int slotCount = 0);
 
     ~malEnv();
 
     malValuePtr get(const String& symbol);
+    malValuePtr lookup(const String& symbol);
+    malValuePtr lookup(const malName* name);
     malEnvPtr   find(const String& symbol);
     malValuePtr set(const String& symbol, malValuePtr value);
+    malValuePtr set(const malName* name, malValuePtr value);
     malEnvPtr   getRoot();
 
+    // Adds a binding to a local environment, without checking for an
+    // existing one. The name must already be marked as local.
+    void bind(const malName* name, malValuePtr value) {
+        m_slots.push_back(Slot(name, value));
+    }
+
+    malEnvPtr   getOuter() const { return m_outer; }
+    Map         getBindings() const;
+
+    // Support for the global lookup caches in malSymbol.
+    //
+    // The global environment's bindings never move once created, so a
+    // lookup can cache the address of the binding. The global version
+    // changes whenever a global binding is created, or a global environment
+    // is created or destroyed; redefinitions are seen through the cache.
+    // It also changes when any name is bound to a macro, which can change
+    // what the forms calling it refer to, see malBindingPlan::freeNames.
+    static unsigned     globalVersion() { return s_globalVersion; }
+    const malValuePtr*  globalCell(const String& symbol);
+
+    // Support for recur.
+    //
+    // The frame of a fn* call or a loop* remembers the plan which bound it
+    // and the body it runs, so that recur can bind it again and jump back
+    // to the start of the body. The frame is reused unless a closure has
+    // captured it, or any environment inside it.
+    void setRecurTarget(malBindingPlanPtr plan, malValuePtr body);
+    bool isRecurTarget(malValuePtr body) const {
+        return m_recurBody.ptr() == body.ptr();
+    }
+    malBindingPlanPtr recurPlan() const;
+    malValuePtr       recurBody() const { return m_recurBody; }
+
+    void markCaptured();
+    bool isCaptured() const { return m_isCaptured; }
+    void clearSlots() { m_slots.clear(); }
+
+    // Local frames are recycled rather than freed. A frame that nothing but
+    // the caller's pointer refers to can't have escaped into a closure, or
+    // anywhere else, so recycle keeps it in a pool for make to reuse, along
+    // with any outer frames that are then free too. The pointer is cleared
+    // either way. Frames that have escaped are freed as usual, by whatever
+    // drops the last reference to them.
+    static malEnvPtr make(malEnvPtr outer, int slotCount);
+    static void      recycle(malEnvPtr& env);
+
+    // Frees the frames kept for reuse, see malMemory::checkQuota.
+    static void      releasePool();
+
+    WITH_ACCOUNTING(malEnv);
+
+    // Support for flat closures.
+    //
+    // Returns the environment for a closure made here, whose bodies refer
+    // to the given names. That's a new frame holding only the local
+    // bindings of those names, copied, in front of the global environment,
+    // so the closure doesn't keep the rest of this one alive and finds its
+    // free variables one frame away. If one of the names isn't bound yet,
+    // but might be bound here later, as by let* binding a function that
+    // calls itself, or is one that a def! binds locally, which could hide
+    // or change the value copied, the closure has to keep this environment.
+    malEnvPtr capture(const malNameVec& names);
+
 private:
-    typedef std::map<String, malValuePtr> Map;
+    // The global environment is a map, and local ones are a short list of
+    // slots, filled in order by a malBindingPlan.
+    typedef std::pair<const malName*, malValuePtr> Slot;
+    typedef std::vector<Slot> Slots;
+
     Map m_map;
+    Slots m_slots;
     malEnvPtr m_outer;
+    malBindingPlanPtr m_recurPlan;
+    malValuePtr m_recurBody;
+    bool m_isCaptured;
+
+    static unsigned s_globalVersion;
+};
+
+// The compiled form of fn* parameters or let* bindings, built once for each
+// binding form and cached on it. As well as plain symbols, bindings can
+// destructure sequences and hash-maps:
+//
+//  [a [b c & more :as all] {:keys [d e] :strs [f] :or {:d 1} :as m}]
+//
+// Defaults given by :or are keyed by keyword, since hash-map keys can't be
+// symbols, and are evaluated when used.
+class malBindingPlan : public RefCounted {
+public:
+    // Plans are cached on the binding form, so these are cheap after the
+    // first call for each fn* or let*.
+    static malBindingPlanPtr forParams(malValuePtr params);
+    static malBindingPlanPtr forLet(malValuePtr bindings);
+
+    // Binds fn* arguments into a new environment.
+    malEnvPtr bindArgs(malEnvPtr outer,
+                       malValueIter argsBegin, malValueIter argsEnd) const;
+
+    // Binds the arguments of recur into an existing frame. For fn*, the
+    // rest parameter is passed as one argument, as in Clojure.
+    void rebind(malEnv* env, malValueIter argsBegin, malValueIter argsEnd) const;
+
+    // The let* bindings are evaluated one at a time, each in the
+    // environment which holds the previous ones.
+    int         letCount() const { return m_let.size(); }
+    malValuePtr letValue(int index) const { return m_let[index].value; }
+    void        bindLet(int index, malValuePtr value, malEnv* env) const {
+        bind(m_let[index].pattern, value, env);
+    }
+
+    int  slotCount() const { return m_slotCount; }
+
+    // The names bound by the parameters, or by one let* binding, and any
+    // :or default forms they evaluate, for the free variable analysis in
+    // EVAL.
+    void paramNames(malNameVec& names, malValueVec& defaults) const;
+    void letNames(int index, malNameVec& names, malValueVec& defaults) const;
+
+    // For fn* parameters, the free variables of the body they were last
+    // used with, as found by EVAL, or NULL if it couldn't tell. Since the
+    // parameters of a fn* form are cached on it, this is nearly always the
+    // same body. They are found again once the global version changes, in
+    // case a name the body calls has become a macro.
+    bool hasFreeNames(malValuePtr body) const {
+        return m_freeBody && m_freeBody.ptr() == body.ptr() &&
+               m_freeVersion == malEnv::globalVersion();
+    }
+    const malNameVec* freeNames() const {
+        return m_hasFreeNames ? &m_freeNames : NULL;
+    }
+    void setFreeNames(malValuePtr body, const malNameVec* names) const;
+
+    // For fn* parameters, the body they were last used with as rewritten by
+    // the optimiser, or NULL if that was another body.
+    malValuePtr optimizedBody(malValuePtr body) const {
+        return m_optimizedFrom.ptr() == body.ptr() ? m_optimizedBody
+                                                   : malValuePtr();
+    }
+    void setOptimizedBody(malValuePtr body, malValuePtr optimized) const {
+        m_optimizedFrom = body;
+        m_optimizedBody = optimized;
+    }
+
+    // Support for tiered execution.
+    //
+    // Each fn* clause and loop* counts the calls into its body, and the
+    // jumps back to the start of it made by recur. Once there have been as
+    // many as the threshold, the body is compiled by the function given to
+    // setTiering, see Compiler.cpp, and enter returns the compiled body from
+    // then on, to every closure made by the fn*, including those made
+    // before. A threshold of 0 turns this off.
+    typedef malValuePtr (Compiler)(malValuePtr body);
+    typedef std::vector<malBindingPlanPtr> Plans;
+
+    static void setTiering(unsigned threshold, Compiler* compile);
+    static unsigned     tieringThreshold() { return s_tierThreshold; }
+    static const Plans& tieredPlans() { return s_tieredPlans; }
+
+    // Installs a body compiled ahead of time by malc, see Malc.cpp, which
+    // enter returns from the first call.
+    void setTieredBody(malValuePtr body, malValuePtr compiled) const;
+
+    malValuePtr enter(malValuePtr body, bool isRecur = false) const {
+        if (m_tieredFrom.ptr() != body.ptr()) {
+            return countEntry(body, isRecur);
+        }
+        (isRecur ? m_recurCount : m_callCount)++;
+        return m_tieredBody;
+    }
+
+    // For the plans in tieredPlans, the body that was compiled, the counts
+    // so far, and the time taken to compile it, in microseconds.
+    malValuePtr tieredBody() const { return m_tieredFrom; }
+    unsigned    callCount() const { return m_callCount; }
+    unsigned    recurCount() const { return m_recurCount; }
+    unsigned    compileTime() const { return m_compileTime; }
+
+    // For fn* parameters, the number of arguments before any &.
+    int  requiredCount() const { return m_params.items.size(); }
+    bool isVariadic() const { return !m_params.rest.empty(); }
+    bool isParams() const { return m_isParams; }
+
+private:
+    struct Pattern;
+    typedef std::vector<Pattern> Patterns;
+
+    // A destructured hash-map key, with its default from :or, if any.
+    struct Key {
+        const malName* name;
+        malValuePtr    key;
+        malValuePtr    defaultValue;
+    };
+
+    struct Pattern {
+        enum Kind { NAME, SEQUENCE, HASH };
+
+        Kind            kind;
+        const malName*  name;       // for NAME, else the :as name or NULL
+        Patterns        items;      // for SEQUENCE
+        Patterns        rest;       // for SEQUENCE, the pattern after &
+        std::vector<Key> keys;      // for HASH
+    };
+
+    struct LetBinding {
+        Pattern     pattern;
+        malValuePtr value;
+    };
+
+    malBindingPlan(const malSequence* form, bool isParams);
+
+    Pattern compile(malValuePtr form);
+    Pattern compileSequence(const malSequence* seq);
+    Pattern compileHash(const malHash* hash);
+    const malName* compileName(malValuePtr form);
+
+    static void collectNames(const Pattern& pattern,
+                             malNameVec& names, malValueVec& defaults);
+
+    malValuePtr countEntry(malValuePtr body, bool isRecur) const;
+    void addTiered() const;
+
+    void bind(const Pattern& pattern, malValuePtr value, malEnv* env) const;
+    void bindItems(const Pattern& pattern,
+                   malValueIter begin, malValueIter end, malEnv* env) const;
+
+    const bool              m_isParams;
+    int                     m_slotCount;
+    Pattern                 m_params;
+    std::vector<LetBinding> m_let;
+
+    mutable malValuePtr     m_freeBody;
+    mutable malNameVec      m_freeNames;
+    mutable bool            m_hasFreeNames;
+    mutable unsigned        m_freeVersion;
+
+    mutable malValuePtr     m_optimizedFrom;
+    mutable malValuePtr     m_optimizedBody;
+
+    mutable malValuePtr     m_countedBody;
+    mutable malValuePtr     m_tieredFrom;
+    mutable malValuePtr     m_tieredBody;
+    mutable unsigned        m_callCount;
+    mutable unsigned        m_recurCount;
+    mutable unsigned        m_compileTime;
+    mutable bool            m_isTiered;
+
+    static unsigned         s_tierThreshold;
+    static Compiler*        s_compile;
+    static Plans            s_tieredPlans;
 };
 
 #endif // INCLUDE_ENVIRONMENT_H
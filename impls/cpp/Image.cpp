@@ -0,0 +1,650 @@
+#include "MAL.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <sstream>
+#include <unordered_map>
+
+// A heap image is a flat dump of everything reachable from an environment.
+// Each record creates one object and refers to earlier objects by index, so
+// restoring an image is a single linear pass over a buffer, with no reading
+// or evaluation of mal source.
+//
+// Environments, atoms and multimethods are the only mutable objects, and
+// so the only way to build a cycle. They are created empty when first seen,
+// and their contents are filled in by later records once everything they
+// refer to exists. Builtins are saved by name and looked up again on restore.
+//
+// An image either holds an environment (a saved interpreter) or a single
+// value (such as the pre-read forms of a source file, see mkembed.cpp).
+//
+// Integers are stored in host byte order, so an image is only portable
+// between builds for the same platform.
+
+static const char imageMagic[] = "MALIMG05";
+static const uint32_t noIndex = 0xffffffff;
+
+enum ImageTag {
+    TAG_NIL,
+    TAG_TRUE,
+    TAG_FALSE,
+    TAG_INTEGER,    // meta, value
+    TAG_STRING,     // meta, text
+    TAG_KEYWORD,    // meta, text
+    TAG_SYMBOL,     // meta, text
+    TAG_LIST,       // meta, count, items...
+    TAG_VECTOR,     // meta, count, items...
+    TAG_HASH,       // meta, isEvaluated, count, (key value)...
+    TAG_BUILTIN,    // meta, name
+    TAG_LAMBDA,     // meta, isMacro, count, (params body)..., env
+    TAG_ATOM,       // meta
+    TAG_ENV,        // outer
+    TAG_ATOM_SET,   // atom, value
+    TAG_ENV_SET,    // env, count, (name value)...
+    TAG_ROOT,       // env
+    TAG_ROOT_VALUE, // value
+    TAG_PROTOCOL_METHOD,    // meta, protocol, method
+    TAG_MULTI,              // meta, name, dispatch
+    TAG_MULTI_SET,          // multi, count, (dispatch method)...
+    TAG_RECORD_TYPE,        // meta, name, count, fields...
+    TAG_RECORD,             // meta, type, count, slots...
+};
+
+class ImageWriter {
+public:
+    ImageWriter(std::ostream& out) : m_out(out) { }
+
+    void writeEnv(malEnvPtr root);
+    void writeValue(malValuePtr root);
+
+private:
+    void writeHeader();
+    void writePending();
+
+    uint32_t addValue(malValuePtr value);
+    uint32_t addEnv(malEnvPtr env);
+    void addSequence(ImageTag tag, const malSequence* seq, uint32_t meta);
+    uint32_t addMeta(malValuePtr value);
+
+    void putByte(uint8_t byte)      { m_out.put(byte); }
+    void putIndex(uint32_t index)   { putRaw(&index, sizeof(index)); }
+    void putInteger(int64_t value)  { putRaw(&value, sizeof(value)); }
+    void putString(const String& s) {
+        putIndex(s.size());
+        putRaw(s.data(), s.size());
+    }
+    void putRaw(const void* data, size_t size) {
+        m_out.write(static_cast<const char*>(data), size);
+    }
+
+    uint32_t newValue(malValuePtr value) {
+        // Hold on to everything we've written, so that temporaries (such
+        // as hash keys) can't be freed and their addresses reused.
+        m_written.push_back(value);
+        return m_values[value.ptr()] = m_written.size() - 1;
+    }
+
+    typedef std::unordered_map<const malValue*, uint32_t> ValueMap;
+    typedef std::unordered_map<const malEnv*, uint32_t>   EnvMap;
+
+    std::ostream&           m_out;
+    ValueMap                m_values;
+    EnvMap                  m_envs;
+    malValueVec             m_written;
+    uint32_t                m_envCount = 0;
+    malValueVec             m_pendingAtoms;
+    malValueVec             m_pendingMultis;
+    std::vector<malEnvPtr>  m_pendingEnvs;
+};
+
+void ImageWriter::writeEnv(malEnvPtr root)
+{
+    writeHeader();
+    uint32_t rootIndex = addEnv(root);
+    writePending();
+    putByte(TAG_ROOT);
+    putIndex(rootIndex);
+}
+
+void ImageWriter::writeValue(malValuePtr root)
+{
+    writeHeader();
+    uint32_t rootIndex = addValue(root);
+    writePending();
+    putByte(TAG_ROOT_VALUE);
+    putIndex(rootIndex);
+}
+
+void ImageWriter::writeHeader()
+{
+    putRaw(imageMagic, sizeof(imageMagic) - 1);
+}
+
+void ImageWriter::writePending()
+{
+    // Filling in an environment, atom or multimethod can discover more of
+    // them, so keep going until there's nothing left.
+    while (!m_pendingEnvs.empty() || !m_pendingAtoms.empty() ||
+           !m_pendingMultis.empty()) {
+        if (!m_pendingAtoms.empty()) {
+            malValuePtr atom = m_pendingAtoms.back();
+            m_pendingAtoms.pop_back();
+            uint32_t value = addValue(STATIC_CAST(malAtom, atom)->deref());
+            putByte(TAG_ATOM_SET);
+            putIndex(m_values[atom.ptr()]);
+            putIndex(value);
+            continue;
+        }
+
+        if (!m_pendingMultis.empty()) {
+            malValuePtr multi = m_pendingMultis.back();
+            m_pendingMultis.pop_back();
+            const malMultiMethod::Methods& methods =
+                STATIC_CAST(malMultiMethod, multi)->getMethods();
+            std::vector<uint32_t> items;
+            for (auto& method : methods) {
+                items.push_back(addValue(method.second.first));
+                items.push_back(addValue(method.second.second));
+            }
+            putByte(TAG_MULTI_SET);
+            putIndex(m_values[multi.ptr()]);
+            putIndex(methods.size());
+            for (auto index : items) {
+                putIndex(index);
+            }
+            continue;
+        }
+
+        malEnvPtr env = m_pendingEnvs.back();
+        m_pendingEnvs.pop_back();
+        const malEnv::Map& bindings = env->getBindings();
+        std::vector<uint32_t> values;
+        values.reserve(bindings.size());
+        for (auto it = bindings.begin(), end = bindings.end(); it != end; ++it) {
+            values.push_back(addValue(it->second));
+        }
+        putByte(TAG_ENV_SET);
+        putIndex(m_envs[env.ptr()]);
+        putIndex(bindings.size());
+        auto value = values.begin();
+        for (auto it = bindings.begin(), end = bindings.end(); it != end; ++it) {
+            putString(it->first);
+            putIndex(*value++);
+        }
+    }
+}
+
+uint32_t ImageWriter::addEnv(malEnvPtr env)
+{
+    if (!env) {
+        return noIndex;
+    }
+    auto it = m_envs.find(env.ptr());
+    if (it != m_envs.end()) {
+        return it->second;
+    }
+
+    uint32_t outer = addEnv(env->getOuter());
+    putByte(TAG_ENV);
+    putIndex(outer);
+    m_pendingEnvs.push_back(env);
+    return m_envs[env.ptr()] = m_envCount++;
+}
+
+uint32_t ImageWriter::addMeta(malValuePtr value)
+{
+    malValuePtr meta = value->meta();
+    return meta == mal::nilValue() ? noIndex : addValue(meta);
+}
+
+void ImageWriter::addSequence(ImageTag tag, const malSequence* seq,
+                              uint32_t meta)
+{
+    std::vector<uint32_t> items;
+    items.reserve(seq->count());
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        items.push_back(addValue(*it));
+    }
+    putByte(tag);
+    putIndex(meta);
+    putIndex(items.size());
+    for (auto index : items) {
+        putIndex(index);
+    }
+}
+
+uint32_t ImageWriter::addValue(malValuePtr value)
+{
+    auto it = m_values.find(value.ptr());
+    if (it != m_values.end()) {
+        return it->second;
+    }
+
+    if (value == mal::nilValue()) {
+        putByte(TAG_NIL);
+        return newValue(value);
+    }
+    if (value == mal::trueValue()) {
+        putByte(TAG_TRUE);
+        return newValue(value);
+    }
+    if (value == mal::falseValue()) {
+        putByte(TAG_FALSE);
+        return newValue(value);
+    }
+
+    uint32_t meta = addMeta(value);
+
+    if (const malInteger* i = DYNAMIC_CAST(malInteger, value)) {
+        putByte(TAG_INTEGER);
+        putIndex(meta);
+        putInteger(i->value());
+    }
+    else if (const malString* s = DYNAMIC_CAST(malString, value)) {
+        putByte(TAG_STRING);
+        putIndex(meta);
+        putString(s->value());
+    }
+    else if (const malKeyword* k = DYNAMIC_CAST(malKeyword, value)) {
+        putByte(TAG_KEYWORD);
+        putIndex(meta);
+        putString(k->value());
+    }
+    else if (const malSymbol* s = DYNAMIC_CAST(malSymbol, value)) {
+        putByte(TAG_SYMBOL);
+        putIndex(meta);
+        putString(s->value());
+    }
+    else if (const malList* l = DYNAMIC_CAST(malList, value)) {
+        addSequence(TAG_LIST, l, meta);
+    }
+    else if (const malVector* v = DYNAMIC_CAST(malVector, value)) {
+        addSequence(TAG_VECTOR, v, meta);
+    }
+    else if (const malRecord* r = DYNAMIC_CAST(malRecord, value)) {
+        uint32_t type = addValue(r->getType());
+        std::vector<uint32_t> slots;
+        for (auto& slot : r->getSlots()) {
+            slots.push_back(addValue(slot));
+        }
+        putByte(TAG_RECORD);
+        putIndex(meta);
+        putIndex(type);
+        putIndex(slots.size());
+        for (auto index : slots) {
+            putIndex(index);
+        }
+    }
+    else if (const malHash* h = DYNAMIC_CAST(malHash, value)) {
+        malValuePtr keyList = h->keys();
+        const malSequence* keys = STATIC_CAST(malSequence, keyList);
+        std::vector<uint32_t> items;
+        items.reserve(2 * keys->count());
+        for (auto it = keys->begin(), end = keys->end(); it != end; ++it) {
+            items.push_back(addValue(*it));
+            items.push_back(addValue(h->get(*it)));
+        }
+        putByte(TAG_HASH);
+        putIndex(meta);
+        putByte(h->isEvaluated());
+        putIndex(items.size());
+        for (auto index : items) {
+            putIndex(index);
+        }
+    }
+    else if (const malBuiltIn* b = DYNAMIC_CAST(malBuiltIn, value)) {
+        putByte(TAG_BUILTIN);
+        putIndex(meta);
+        putString(b->name());
+    }
+    else if (const malRecordType* t = DYNAMIC_CAST(malRecordType, value)) {
+        std::vector<uint32_t> fields;
+        for (auto& field : t->getFields()) {
+            fields.push_back(addValue(field));
+        }
+        putByte(TAG_RECORD_TYPE);
+        putIndex(meta);
+        putString(t->getName());
+        putIndex(fields.size());
+        for (auto index : fields) {
+            putIndex(index);
+        }
+    }
+    else if (const malLambda* l = DYNAMIC_CAST(malLambda, value)) {
+        std::vector<uint32_t> clauses;
+        for (auto& arity : l->getArities()) {
+            clauses.push_back(addValue(arity.params));
+            clauses.push_back(addValue(unoptimizedBody(arity.body)));
+        }
+        uint32_t env = addEnv(l->getEnv());
+        putByte(TAG_LAMBDA);
+        putIndex(meta);
+        putByte(l->isMacro());
+        putIndex(clauses.size() / 2);
+        for (auto index : clauses) {
+            putIndex(index);
+        }
+        putIndex(env);
+    }
+    else if (DYNAMIC_CAST(malAtom, value)) {
+        putByte(TAG_ATOM);
+        putIndex(meta);
+        m_pendingAtoms.push_back(value);
+    }
+    else if (const malProtocolMethod* p = DYNAMIC_CAST(malProtocolMethod,
+                                                       value)) {
+        uint32_t protocol = addValue(p->getProtocol());
+        uint32_t method = addValue(p->getMethod());
+        putByte(TAG_PROTOCOL_METHOD);
+        putIndex(meta);
+        putIndex(protocol);
+        putIndex(method);
+    }
+    else if (const malMultiMethod* m = DYNAMIC_CAST(malMultiMethod, value)) {
+        uint32_t dispatch = addValue(m->getDispatchFn());
+        putByte(TAG_MULTI);
+        putIndex(meta);
+        putString(m->getName());
+        putIndex(dispatch);
+        m_pendingMultis.push_back(value);
+    }
+    else {
+        MAL_FAIL("Cannot save %s in an image", value->print(true).c_str());
+    }
+
+    return newValue(value);
+}
+
+void saveImage(malEnvPtr env, const String& filename)
+{
+    std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary);
+    MAL_CHECK(!file.fail(), "Cannot create %s", filename.c_str());
+
+    ImageWriter(file).writeEnv(env);
+
+    file.close();
+    MAL_CHECK(!file.fail(), "Error writing %s", filename.c_str());
+}
+
+class ImageReader {
+public:
+    ImageReader(const char* data, size_t size, const String& filename,
+                malEnvPtr builtins)
+    : m_pos(data)
+    , m_end(data + size)
+    , m_filename(filename)
+    , m_builtins(builtins) { }
+
+    malEnvPtr readEnv();
+    malValuePtr readValue();
+
+private:
+    uint8_t read();
+    malValuePtr readRecord(uint8_t tag);
+    malValuePtr withMeta(malValuePtr value, uint32_t meta);
+    malValueVec* getItems();
+    malValuePtr getBuiltIn(const String& name);
+
+    uint8_t getByte() {
+        uint8_t byte;
+        getRaw(&byte, sizeof(byte));
+        return byte;
+    }
+    uint32_t getIndex() {
+        uint32_t index;
+        getRaw(&index, sizeof(index));
+        return index;
+    }
+    int64_t getInteger() {
+        int64_t value;
+        getRaw(&value, sizeof(value));
+        return value;
+    }
+    // A count of the records which follow, each taking at least itemSize
+    // bytes, checked before anything is allocated for them.
+    uint32_t getCount(size_t itemSize) {
+        uint32_t count = getIndex();
+        MAL_CHECK(count <= size_t(m_end - m_pos) / itemSize,
+                  "%s: unexpected end of image", m_filename.c_str());
+        return count;
+    }
+    String getString() {
+        uint32_t size = getIndex();
+        checkAvailable(size);
+        String s(m_pos, size);
+        m_pos += size;
+        return s;
+    }
+    void getRaw(void* dest, size_t size) {
+        checkAvailable(size);
+        memcpy(dest, m_pos, size);
+        m_pos += size;
+    }
+    void checkAvailable(size_t size) {
+        MAL_CHECK(size <= size_t(m_end - m_pos),
+                  "%s: unexpected end of image", m_filename.c_str());
+    }
+
+    malValuePtr value(uint32_t index) {
+        MAL_CHECK(index < m_values.size(),
+                  "%s: bad value index %u", m_filename.c_str(), index);
+        return m_values[index];
+    }
+    malEnvPtr env(uint32_t index) {
+        MAL_CHECK(index < m_envs.size(),
+                  "%s: bad environment index %u", m_filename.c_str(), index);
+        return m_envs[index];
+    }
+
+    const char*             m_pos;
+    const char*             m_end;
+    const String            m_filename;
+    malValueVec             m_values;
+    std::vector<malEnvPtr>  m_envs;
+    malEnvPtr               m_builtins;
+};
+
+malEnvPtr ImageReader::readEnv()
+{
+    MAL_CHECK(read() == TAG_ROOT,
+              "%s does not hold an environment", m_filename.c_str());
+    return env(getIndex());
+}
+
+malValuePtr ImageReader::readValue()
+{
+    MAL_CHECK(read() == TAG_ROOT_VALUE,
+              "%s does not hold a value", m_filename.c_str());
+    return value(getIndex());
+}
+
+uint8_t ImageReader::read()
+{
+    // Returns the root tag, leaving its index to be read by the caller.
+    const size_t magicSize = sizeof(imageMagic) - 1;
+    checkAvailable(magicSize);
+    MAL_CHECK(memcmp(m_pos, imageMagic, magicSize) == 0,
+              "%s is not a mal image", m_filename.c_str());
+    m_pos += magicSize;
+
+    while (1) {
+        uint8_t tag = getByte();
+        switch (tag) {
+            case TAG_ENV: {
+                uint32_t outer = getIndex();
+                m_envs.push_back(
+                    new malEnv(outer == noIndex ? malEnvPtr() : env(outer)));
+                break;
+            }
+            case TAG_ENV_SET: {
+                malEnvPtr target = env(getIndex());
+                uint32_t count = getCount(2 * sizeof(uint32_t));
+                for (uint32_t i = 0; i < count; i++) {
+                    String name = getString();
+                    target->set(name, value(getIndex()));
+                }
+                break;
+            }
+            case TAG_ATOM_SET: {
+                malAtom* atom = VALUE_CAST(malAtom, value(getIndex()));
+                atom->reset(value(getIndex()));
+                break;
+            }
+            case TAG_MULTI_SET: {
+                malMultiMethod* multi =
+                    VALUE_CAST(malMultiMethod, value(getIndex()));
+                uint32_t count = getCount(2 * sizeof(uint32_t));
+                for (uint32_t i = 0; i < count; i++) {
+                    malValuePtr dispatchValue = value(getIndex());
+                    multi->addMethod(dispatchValue, value(getIndex()));
+                }
+                break;
+            }
+            case TAG_ROOT:
+            case TAG_ROOT_VALUE:
+                return tag;
+
+            default:
+                m_values.push_back(readRecord(tag));
+                break;
+        }
+    }
+}
+
+malValuePtr ImageReader::readRecord(uint8_t tag)
+{
+    switch (tag) {
+        case TAG_NIL:       return mal::nilValue();
+        case TAG_TRUE:      return mal::trueValue();
+        case TAG_FALSE:     return mal::falseValue();
+    }
+
+    uint32_t meta = getIndex();
+    switch (tag) {
+        case TAG_INTEGER:
+            return withMeta(mal::integer(getInteger()), meta);
+
+        case TAG_STRING:
+            return withMeta(mal::string(getString()), meta);
+
+        case TAG_KEYWORD:
+            return withMeta(mal::keyword(getString()), meta);
+
+        case TAG_SYMBOL:
+            return withMeta(mal::symbol(getString()), meta);
+
+        case TAG_LIST:
+            return withMeta(mal::list(getItems()), meta);
+
+        case TAG_VECTOR:
+            return withMeta(mal::vector(getItems()), meta);
+
+        case TAG_HASH: {
+            bool isEvaluated = getByte();
+            std::unique_ptr<malValueVec> items(getItems());
+            return withMeta(mal::hash(items->begin(), items->end(),
+                                      isEvaluated), meta);
+        }
+
+        case TAG_BUILTIN:
+            return withMeta(getBuiltIn(getString()), meta);
+
+        case TAG_LAMBDA: {
+            bool isMacro = getByte();
+            malLambda::Arities arities(getCount(2 * sizeof(uint32_t)));
+            for (auto& arity : arities) {
+                arity.params = value(getIndex());
+                arity.body = value(getIndex());
+                malName::markLocalDefs(arity.body, true);
+            }
+            malValuePtr lambda = mal::lambda(arities, env(getIndex()));
+            if (isMacro) {
+                lambda = mal::macro(*STATIC_CAST(malLambda, lambda));
+            }
+            return withMeta(lambda, meta);
+        }
+
+        case TAG_ATOM:
+            return withMeta(mal::atom(mal::nilValue()), meta);
+
+        case TAG_RECORD_TYPE: {
+            String name = getString();
+            std::unique_ptr<malValueVec> fields(getItems());
+            return withMeta(mal::recordType(name, *fields), meta);
+        }
+
+        case TAG_RECORD: {
+            malValuePtr type = value(getIndex());
+            const malRecordType* t = VALUE_CAST(malRecordType, type);
+            malValueVec* slots = getItems();
+            MAL_CHECK((int)slots->size() == t->fieldCount(),
+                      "%s: bad record of %s", m_filename.c_str(),
+                      t->getName().c_str());
+            return withMeta(mal::record(type, slots), meta);
+        }
+
+        case TAG_PROTOCOL_METHOD: {
+            malValuePtr protocol = value(getIndex());
+            malValuePtr method = value(getIndex());
+            return withMeta(mal::protocolMethod(protocol, method), meta);
+        }
+
+        case TAG_MULTI: {
+            String name = getString();
+            malValuePtr dispatch = value(getIndex());
+            return withMeta(mal::multiMethod(name, dispatch), meta);
+        }
+    }
+
+    MAL_FAIL("%s: unknown record type %d", m_filename.c_str(), tag);
+}
+
+malValuePtr ImageReader::withMeta(malValuePtr value, uint32_t meta)
+{
+    return meta == noIndex ? value : value->withMeta(this->value(meta));
+}
+
+malValueVec* ImageReader::getItems()
+{
+    uint32_t count = getCount(sizeof(uint32_t));
+    std::unique_ptr<malValueVec> items(new malValueVec);
+    items->reserve(count);
+    for (uint32_t i = 0; i < count; i++) {
+        items->push_back(value(getIndex()));
+    }
+    return items.release();
+}
+
+malValuePtr ImageReader::getBuiltIn(const String& name)
+{
+    MAL_CHECK(m_builtins && m_builtins->find(name),
+              "%s: unknown builtin %s", m_filename.c_str(), name.c_str());
+    return m_builtins->get(name);
+}
+
+malEnvPtr loadImage(const String& filename, malEnvPtr builtins)
+{
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+    MAL_CHECK(!file.fail(), "Cannot open %s", filename.c_str());
+
+    String data((std::istreambuf_iterator<char>(file)),
+                std::istreambuf_iterator<char>());
+
+    return ImageReader(data.data(), data.size(), filename, builtins).readEnv();
+}
+
+String valueToImage(malValuePtr value)
+{
+    std::ostringstream out;
+    ImageWriter(out).writeValue(value);
+    return out.str();
+}
+
+malValuePtr imageToValue(const char* data, size_t size, const String& name)
+{
+    return ImageReader(data, size, name, NULL).readValue();
+}
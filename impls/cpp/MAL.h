@@ -16,6 +16,13 @@ typedef malValueVec::iterator    malValueIter;
 class malEnv;
 typedef RefCountedPtr<malEnv>     malEnvPtr;
 
+class malBindingPlan;
+typedef RefCountedPtr<malBindingPlan> malBindingPlanPtr;
+
+class malName;
+class malSequence;
+class malHash;
+
 // step*.cpp
 extern malValuePtr APPLY(malValuePtr op,
                          malValueIter argsBegin, malValueIter argsEnd);
@@ -23,8 +30,50 @@ extern malValuePtr EVAL(malValuePtr ast, malEnvPtr env);
 extern malValuePtr readline(const String& prompt);
 extern String rep(const String& input, malEnvPtr env);
 
+// stepA_mal.cpp, for Compiler.cpp and Malc.cpp
+extern malValuePtr evalRaising(malValuePtr ast, malEnvPtr env);
+extern malValuePtr evalCall(malValuePtr form, malValuePtr op,
+                            malValueVec& args);
+extern malValuePtr recur(malEnvPtr& recurEnv, malValueVec& args);
+extern bool isSpecialForm(const String& name);
+extern bool isBuiltinMacro(malValuePtr op, const char* name);
+
+// Compiler.cpp
+extern malValuePtr compileBody(malValuePtr body);
+
 // Core.cpp
 extern void installCore(malEnvPtr env);
+extern malValuePtr embeddedPrelude();
+extern malValuePtr readFileForms(const String& filename);
+
+// Embedded.cpp, generated by mkembed
+struct malEmbeddedFile {
+    const char* name;
+    const char* path;   // where it was read from, or NULL for the prelude
+    const char* data;
+    size_t      size;
+    long long   fileSize;   // of the file when it was read, to tell if it
+    long long   fileTime;   // has changed since, see embeddedForms
+};
+extern const malEmbeddedFile embeddedFiles[];
+
+// Image.cpp
+extern void saveImage(malEnvPtr env, const String& filename);
+extern malEnvPtr loadImage(const String& filename, malEnvPtr builtins);
+extern String valueToImage(malValuePtr value);
+extern malValuePtr imageToValue(const char* data, size_t size,
+                                const String& name);
+
+// Malc.cpp
+extern void compileProgram(const String& filename, const String& output,
+                           malEnvPtr env);
+
+// Optimizer.cpp
+extern bool setOptimizerPasses(const String& passes);
+extern bool isOptimizing();
+extern malValuePtr optimizeBody(malValuePtr params, malValuePtr body,
+                                malEnvPtr env);
+extern malValuePtr unoptimizedBody(malValuePtr body);
 
 // Reader.cpp
 extern malValuePtr readStr(const String& input);
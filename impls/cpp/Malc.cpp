@@ -0,0 +1,950 @@
+#include "Malc.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <set>
+#include <sstream>
+
+//  malc, the ahead-of-time compiler. "stepA_mal --compile OUTPUT.cpp
+//  PROGRAM.mal" reads the program, expands its macros, and writes it out as
+//  C++, which the malc script builds into an executable, along with
+//  stepA_mal.o and libmal.a. The executable's main is stepA's, which finds
+//  the program linked in, and runs it rather than starting the REPL.
+//
+//  Macros are expanded all the way down, with the macros defined so far.
+//  Each top-level defmacro! is evaluated as it is reached, and each
+//  top-level (load-file "literal") is replaced by the forms of the file, so
+//  that those are compiled too. The forms themselves are left as they are:
+//  the code for a macro call runs its expansion only while the symbol still
+//  finds the macro it was expanded with, and otherwise EVALs the call, so
+//  redefining a macro is seen. A macro call which fails, or expands into
+//  something that isn't plain data, is left for EVAL to expand at runtime.
+//
+//  Each top-level form, fn* clause and loop* body becomes a malCompiled
+//  class, whose run does what the nodes in Compiler.cpp would: calls,
+//  symbols, constants, if, do, and, or, let*, quote, def!, try* and recur
+//  are written out as C++, and a call to an arithmetic builtin with two
+//  integers does the operation inline, as long as the symbol still finds
+//  that builtin. The fn* and loop* bodies are installed in their binding
+//  plans when the program starts, so that every closure and loop* runs the
+//  compiled code from its first call, see malBindingPlan::setTieredBody.
+//  Tail calls, and whatever the C++ doesn't do itself, such as fn*, loop*
+//  and quasiquote, are handed back to EVAL, as for the tiered bodies.
+//
+//  The constants the code refers to, including the program's forms, are
+//  written as an image, see Image.cpp, so they are restored without reading
+//  them.
+
+malcProgram* malcProgram::s_linked = NULL;
+
+void malcProgram::load(malEnvPtr env)
+{
+    // The image holds the list of constants.
+    malValuePtr root = imageToValue(m_image, m_size, m_name);
+    const malList* constants = STATIC_CAST(malList, root);
+
+    m_init(malValueVec(constants->begin(), constants->end()), env, m_forms);
+}
+
+static bool isCall(malValuePtr form, const char* name)
+{
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (!list || list->isEmpty()) {
+        return false;
+    }
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0));
+    return symbol && symbol->value() == name;
+}
+
+//  As in stepA_mal.cpp.
+static bool isArityClause(const malValuePtr& form)
+{
+    const malList* list = DYNAMIC_CAST(malList, form);
+    return list && list->count() == 2 &&
+           DYNAMIC_CAST(malVector, list->item(0));
+}
+
+//  Whether fn is a multi-arity fn* that EVAL accepts.
+static bool isMultiArity(const malList* fn)
+{
+    int argCount = fn->count() - 1;
+    return argCount >= 1 && std::all_of(fn->begin() + 1, fn->end(),
+                                        isArityClause);
+}
+
+//  Whether a macro's expansion can be written into an image, and evaluated
+//  in place of the call.
+static bool isData(const malValuePtr& value)
+{
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, value)) {
+        return std::all_of(seq->begin(), seq->end(), isData);
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, value)) {
+        return !DYNAMIC_CAST(malRecord, value) && isData(hash->values());
+    }
+    return DYNAMIC_CAST(malConstant, value) ||
+           DYNAMIC_CAST(malInteger, value) ||
+           DYNAMIC_CAST(malStringBase, value);
+}
+
+//  Adds every symbol in a binding form to bound, including any in :or
+//  defaults, which can only stop a macro from being expanded.
+static void addBound(malValuePtr pattern, malNameVec& bound)
+{
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, pattern)) {
+        bound.push_back(symbol->name());
+    }
+    else if (const malSequence* seq = DYNAMIC_CAST(malSequence, pattern)) {
+        for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+            addBound(*it, bound);
+        }
+    }
+    else if (const malHash* hash = DYNAMIC_CAST(malHash, pattern)) {
+        addBound(hash->values(), bound);
+    }
+}
+
+//  What identifies a macro to malcIsExpansionOf.
+static malValuePtr macroKey(malValuePtr macro)
+{
+    if (const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn, macro)) {
+        return mal::string(builtin->name());
+    }
+    return STATIC_CAST(malLambda, macro)->getBody();
+}
+
+//  A comment for the code written for form.
+static String summary(malValuePtr form)
+{
+    String text = form->print(true);
+    if (text.size() > 64) {
+        text = text.substr(0, 60) + " ...";
+    }
+    for (auto& c : text) {
+        if (c == '\n' || c == '\r' || c == '\t' || c == '\\' || c == '?') {
+            c = ' ';
+        }
+    }
+    return text;
+}
+
+static const struct {
+    malIntOp    op;
+    const char* cppOp;
+    bool        isArith;
+} intOps[] = {
+    { INT_OP_ADD, "+",  true },
+    { INT_OP_SUB, "-",  true },
+    { INT_OP_MUL, "*",  true },
+    { INT_OP_DIV, "/",  true },
+    { INT_OP_MOD, "%",  true },
+    { INT_OP_LT,  "<",  false },
+    { INT_OP_LE,  "<=", false },
+    { INT_OP_GT,  ">",  false },
+    { INT_OP_GE,  ">=", false },
+    { INT_OP_EQ,  "==", false },
+};
+
+class malcWriter {
+public:
+    malcWriter(malEnvPtr env)
+    : m_env(env), m_depth(0), m_tempCount(0)
+    , m_canRecur(false), m_isRecurTarget(false), m_hasRecur(false)
+    , m_inTry(false) { }
+
+    void addForm(malValuePtr form);
+    void write(std::ostream& out, const String& name);
+
+private:
+    // A compiled body. The form is the fn* parameters or loop* bindings it
+    // is installed with, or NULL for a top-level form.
+    struct Body {
+        malValuePtr form;
+        malValuePtr body;
+        bool        isParams;
+    };
+
+    // A macro call's expansion, and the key of the macro, see
+    // malcIsExpansionOf.
+    struct Expansion {
+        malValuePtr form;
+        malValuePtr macro;
+    };
+
+    malValuePtr expandTopLevel(malValuePtr form);
+    void expand(malValuePtr form, malNameVec& bound);
+    void expandItems(const malSequence* seq, int start, malNameVec& bound);
+    void expandFn(malValuePtr params, malValuePtr body, malNameVec& bound);
+
+    void findBodies(malValuePtr form);
+    void addBody(malValuePtr form, malValuePtr body, bool isParams);
+
+    void writeBody(const Body& body, int index);
+    void emit(malValuePtr form, const String& env, const String& var,
+              bool isTail);
+    bool emitSpecial(const malList* list, const String& special,
+                     const String& env, const String& var, bool isTail);
+    bool emitLet(const malList* list, const String& env, const String& var,
+                 bool isTail);
+    bool emitTry(const malList* list, const String& env, const String& var,
+                 bool isTail);
+    void emitCascade(const malList* list, bool isAnd, const String& env,
+                     const String& var, bool isTail);
+    void emitCall(const malList* list, const String& env, const String& var,
+                  bool isTail);
+    void emitForm(malValuePtr form, const String& env, const String& var,
+                  bool isTail);
+
+    String constant(malValuePtr value);
+    String plan(malValuePtr bindings);
+    String global(malValuePtr symbol);
+    String temp();
+    String declare();
+
+    void line(const String& text);
+    void open(const String& text)  { line(text); m_depth++; }
+    void close(const String& text = "}") { m_depth--; line(text); }
+    void orElse() { close(); open("else {"); }
+    void done(bool isTail) { if (isTail) line("return VALUE;"); }
+    void checkRaised(const String& var);
+
+    malEnvPtr           m_env;
+    std::vector<int>    m_tops;
+    std::vector<Body>   m_bodies;
+    std::set<std::pair<const malValue*, const malValue*> > m_bodySet;
+    std::map<const malValue*, Expansion> m_expansions;
+
+    malValueVec                     m_constants;
+    std::map<const malValue*, int>  m_constantIndex;
+    StringVec                       m_plans;
+    std::map<const malValue*, int>  m_planIndex;
+    StringVec                       m_globals;
+    std::map<String, int>           m_globalIndex;
+
+    std::ostringstream  m_code;
+    std::ostringstream  m_body;
+    int                 m_depth;
+    int                 m_tempCount;
+    bool                m_canRecur;
+    bool                m_isRecurTarget;
+    bool                m_hasRecur;
+    bool                m_inTry;
+};
+
+void malcWriter::addForm(malValuePtr form)
+{
+    malValuePtr expanded = expandTopLevel(form);
+    findBodies(expanded);
+    m_tops.push_back(m_bodies.size());
+    m_bodies.push_back(Body { NULL, expanded, false });
+}
+
+malValuePtr malcWriter::expandTopLevel(malValuePtr form)
+{
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (isCall(form, "load-file") && list->count() == 2 &&
+        DYNAMIC_CAST(malString, list->item(1))) {
+        // This gives (do forms... nil), as load-file evaluates.
+        malValuePtr file;
+        try {
+            file = readFileForms(STATIC_CAST(malString,
+                                             list->item(1))->value());
+        }
+        catch (malException&) {
+        }
+        catch (String&) {
+        }
+        if (const malList* forms = DYNAMIC_CAST(malList, file)) {
+            malValueVec* items = new malValueVec;
+            for (auto it = forms->begin(), end = forms->end(); it != end;
+                 ++it) {
+                items->push_back(it == forms->begin() ? *it
+                                                      : expandTopLevel(*it));
+            }
+            return mal::list(items);
+        }
+    }
+
+    malNameVec bound;
+    expand(form, bound);
+    if (isCall(form, "defmacro!")) {
+        // Later forms can use the macro. Any error is left for runtime.
+        try {
+            EVAL(form, m_env);
+        }
+        catch (malException&) {
+        }
+        catch (String&) {
+        }
+    }
+    return form;
+}
+
+//  Expands the macro calls in form, as EVAL would find them, other than
+//  those whose names are bound locally, and keeps each expansion with the
+//  macro it came from. The forms themselves are left as they are, for EVAL.
+void malcWriter::expand(malValuePtr form, malNameVec& bound)
+{
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (!list || list->isEmpty()) {
+        if (const malVector* vector = DYNAMIC_CAST(malVector, form)) {
+            expandItems(vector, 0, bound);
+        }
+        return;
+    }
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0));
+    if (!symbol) {
+        expandItems(list, 0, bound);
+        return;
+    }
+
+    // The special forms, which EVAL finds by name.
+    const String& special = symbol->value();
+    int argCount = list->count() - 1;
+    if (special == "quote" || special == "quasiquote" ||
+        special == "macroexpand") {
+        return;
+    }
+    if (special == "fn*") {
+        if (isMultiArity(list)) {
+            for (int i = 1; i <= argCount; i++) {
+                const malList* clause = STATIC_CAST(malList, list->item(i));
+                expandFn(clause->item(0), clause->item(1), bound);
+            }
+        }
+        else if (argCount == 2) {
+            expandFn(list->item(1), list->item(2), bound);
+        }
+        return;
+    }
+    if ((special == "let*" || special == "loop*") && argCount == 2) {
+        const malSequence* bindings = DYNAMIC_CAST(malSequence,
+                                                   list->item(1));
+        if (!bindings || bindings->count() % 2 != 0) {
+            return;
+        }
+        size_t boundCount = bound.size();
+        for (int i = 0; i < bindings->count(); i += 2) {
+            expand(bindings->item(i + 1), bound);
+            addBound(bindings->item(i), bound);
+        }
+        expand(list->item(2), bound);
+        bound.resize(boundCount);
+        return;
+    }
+    if (special == "try*" && argCount == 2 &&
+        isCall(list->item(2), "catch*") &&
+        STATIC_CAST(malList, list->item(2))->count() == 3) {
+        const malList* catchBlock = STATIC_CAST(malList, list->item(2));
+        expand(list->item(1), bound);
+        size_t boundCount = bound.size();
+        addBound(catchBlock->item(1), bound);
+        expand(catchBlock->item(2), bound);
+        bound.resize(boundCount);
+        return;
+    }
+    if (isSpecialForm(special)) {
+        expandItems(list, 1, bound);
+        return;
+    }
+
+    if (std::find(bound.begin(), bound.end(), symbol->name()) == bound.end()) {
+        malValuePtr op = m_env->lookup(symbol->name());
+        const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
+        if (handler && handler->isMacro()) {
+            malValuePtr expanded;
+            try {
+                expanded = list->expandMacro(op);
+            }
+            catch (malException&) {
+                return;
+            }
+            catch (String&) {
+                return;
+            }
+            if (isData(expanded)) {
+                m_expansions[list] = Expansion { expanded, macroKey(op) };
+                expand(expanded, bound);
+            }
+            return;
+        }
+    }
+    expandItems(list, 1, bound);
+}
+
+void malcWriter::expandItems(const malSequence* seq, int start,
+                             malNameVec& bound)
+{
+    for (int i = start; i < seq->count(); i++) {
+        expand(seq->item(i), bound);
+    }
+}
+
+void malcWriter::expandFn(malValuePtr params, malValuePtr body,
+                          malNameVec& bound)
+{
+    size_t boundCount = bound.size();
+    addBound(params, bound);
+    expand(body, bound);
+    bound.resize(boundCount);
+}
+
+//  Finds the fn* and loop* bodies in form that EVAL would run.
+void malcWriter::findBodies(malValuePtr form)
+{
+    if (const malHash* hash = DYNAMIC_CAST(malHash, form)) {
+        findBodies(hash->values());
+        return;
+    }
+    const malSequence* seq = DYNAMIC_CAST(malSequence, form);
+    if (!seq) {
+        return;
+    }
+    if (isCall(form, "quote") || isCall(form, "quasiquote")) {
+        return;
+    }
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (isCall(form, "fn*")) {
+        if (isMultiArity(list)) {
+            for (int i = 1; i < list->count(); i++) {
+                const malList* clause = STATIC_CAST(malList, list->item(i));
+                addBody(clause->item(0), clause->item(1), true);
+            }
+        }
+        else if (list->count() == 3) {
+            addBody(list->item(1), list->item(2), true);
+        }
+    }
+    else if (isCall(form, "loop*") && list->count() == 3) {
+        addBody(list->item(1), list->item(2), false);
+    }
+    auto it = m_expansions.find(seq);
+    if (it != m_expansions.end()) {
+        findBodies(it->second.form);
+    }
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        findBodies(*it);
+    }
+}
+
+void malcWriter::addBody(malValuePtr form, malValuePtr body, bool isParams)
+{
+    // Parameters or bindings that EVAL would reject are left to it.
+    try {
+        if (isParams) {
+            malBindingPlan::forParams(form);
+        }
+        else {
+            malBindingPlan::forLet(form);
+        }
+    }
+    catch (malException&) {
+        return;
+    }
+    catch (String&) {
+        return;
+    }
+    if (m_bodySet.insert(std::make_pair(form.ptr(), body.ptr())).second) {
+        m_bodies.push_back(Body { form, body, isParams });
+    }
+}
+
+static void writeImage(std::ostream& out, const String& image)
+{
+    // As in mkembed.cpp.
+    out << "static const char image[] =";
+    for (size_t i = 0; i < image.size(); i++) {
+        if (i % 16 == 0) {
+            out << "\n    \"";
+        }
+        out << STRF("\\%03o", (unsigned char)image[i]);
+        if (i % 16 == 15 || i == image.size() - 1) {
+            out << "\"";
+        }
+    }
+    out << ";\n\n";
+}
+
+void malcWriter::write(std::ostream& out, const String& name)
+{
+    // The code comes first, since it finds the constants.
+    for (size_t i = 0; i < m_bodies.size(); i++) {
+        writeBody(m_bodies[i], i);
+    }
+
+    out << "// Generated by malc from " << summary(mal::string(name))
+        << ", do not edit.\n\n"
+        << "#include \"Malc.h\"\n\n"
+        << "static malValueVec k;\n"
+        << "static std::vector<malBindingPlanPtr> p;\n"
+        << "static malValueVec g;\n\n"
+        << m_code.str();
+
+    out << "static void init(const malValueVec& constants, malEnvPtr env,\n"
+        << "                 malValueVec& forms)\n"
+        << "{\n"
+        << "    k = constants;\n";
+    for (auto& bindings : m_plans) {
+        out << "    p.push_back(malBindingPlan::forLet(" << bindings
+            << "));\n";
+    }
+    for (auto& symbol : m_globals) {
+        out << "    g.push_back(env->lookup(STATIC_CAST(malSymbol, "
+            << symbol << ")->value()));\n";
+    }
+    for (size_t i = 0; i < m_bodies.size(); i++) {
+        const Body& body = m_bodies[i];
+        if (body.form) {
+            String form = constant(body.form), code = constant(body.body);
+            out << STRF("    malBindingPlan::%s(%s)->setTieredBody(%s,\n"
+                        "        mal::list(new malcBody%d(%s)));\n",
+                        body.isParams ? "forParams" : "forLet",
+                        form.c_str(), code.c_str(), (int)i, code.c_str());
+        }
+    }
+    for (auto index : m_tops) {
+        out << STRF("    forms.push_back(mal::list(new malcBody%d(%s)));\n",
+                    index, constant(m_bodies[index].body).c_str());
+    }
+    out << "}\n\n";
+
+    writeImage(out, valueToImage(mal::list(new malValueVec(m_constants))));
+    out << "static malcProgram program(" << escape(name)
+        << ", image, sizeof(image) - 1, init);\n";
+}
+
+//  A fn* or loop* body that recurs binds its frame again and jumps back to
+//  the start itself, as long as it was entered as the body of that frame.
+//  Otherwise EVAL is left to raise the error.
+void malcWriter::writeBody(const Body& body, int index)
+{
+    m_body.str("");
+    m_depth = 1;
+    m_tempCount = 0;
+    m_canRecur = true;
+    m_isRecurTarget = body.form.ptr() != NULL;
+    m_hasRecur = false;
+    m_inTry = false;
+    emit(body.body, "env", "value", true);
+
+    m_code << "// " << summary(body.body) << "\n"
+           << "MALC_BODY(malcBody" << index << ")\n"
+           << "{\n";
+    if (m_hasRecur) {
+        m_code << "    malEnvPtr frame = env->isRecurTarget(body()) ? env\n"
+               << "                                                : malEnvPtr();\n"
+               << "start:\n"
+               << "    if ((value = malMemory::checkQuota())) return VALUE;\n"
+               << "    if ((value = malBudget::spend())) return VALUE;\n";
+    }
+    m_code << m_body.str() << "}\n\n";
+}
+
+//  Writes the code to evaluate form in env into var. In tail position, env
+//  and var are run's, and the code returns how the body ended.
+void malcWriter::emit(malValuePtr form, const String& env, const String& var,
+                      bool isTail)
+{
+    if (DYNAMIC_CAST(malSymbol, form)) {
+        line(var + " = malcLookup(" + constant(form) + ", " + env + ");");
+        if (!isTail) {
+            checkRaised(var);
+        }
+        done(isTail);
+        return;
+    }
+    if (evaluatesToItself(form)) {
+        line(var + " = " + constant(form) + ";");
+        done(isTail);
+        return;
+    }
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (list && !list->isEmpty()) {
+        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
+            if (emitSpecial(list, symbol->value(), env, var, isTail)) {
+                return;
+            }
+            if (!isSpecialForm(symbol->value())) {
+                emitCall(list, env, var, isTail);
+                return;
+            }
+        }
+    }
+    emitForm(form, env, var, isTail);
+}
+
+//  Writes the special forms the C++ does itself, as EVAL does them, with
+//  the number of arguments they take. Returns false for the rest.
+bool malcWriter::emitSpecial(const malList* list, const String& special,
+                             const String& env, const String& var,
+                             bool isTail)
+{
+    int argCount = list->count() - 1;
+    if (special == "if" && (argCount == 2 || argCount == 3)) {
+        String test = declare();
+        emit(list->item(1), env, test, false);
+        open("if (" + test + "->isTrue()) {");
+        emit(list->item(2), env, var, isTail);
+        orElse();
+        if (argCount == 3) {
+            emit(list->item(3), env, var, isTail);
+        }
+        else {
+            line(var + " = mal::nilValue();");
+            done(isTail);
+        }
+        close();
+        return true;
+    }
+    if (special == "do" && argCount >= 1) {
+        for (int i = 1; i < argCount; i++) {
+            emit(list->item(i), env, declare(), false);
+        }
+        emit(list->item(argCount), env, var, isTail);
+        return true;
+    }
+    if (special == "let*" && argCount == 2) {
+        return emitLet(list, env, var, isTail);
+    }
+    if (special == "quote" && argCount == 1) {
+        line(var + " = " + constant(list->item(1)) + ";");
+        done(isTail);
+        return true;
+    }
+    if (special == "def!" && argCount == 2 &&
+        DYNAMIC_CAST(malSymbol, list->item(1))) {
+        String value = declare();
+        emit(list->item(2), env, value, false);
+        line(STRF("%s = %s->set(STATIC_CAST(malSymbol, %s)->value(), %s);",
+                  var.c_str(), env.c_str(), constant(list->item(1)).c_str(),
+                  value.c_str()));
+        done(isTail);
+        return true;
+    }
+    if (special == "try*") {
+        return emitTry(list, env, var, isTail);
+    }
+    if (special == "recur" && isTail && m_canRecur) {
+        StringVec args;
+        for (int i = 1; i <= argCount; i++) {
+            args.push_back(declare());
+            emit(list->item(i), env, args.back(), false);
+        }
+        line("args.clear();");
+        for (auto& arg : args) {
+            line("args.push_back(" + arg + ");");
+        }
+        if (m_isRecurTarget) {
+            line("if (!frame) return RECUR;");
+            line("recur(frame, args);");
+            line("env = frame;");
+            line("goto start;");
+            m_hasRecur = true;
+        }
+        else {
+            line("return RECUR;");
+        }
+        return true;
+    }
+    return false;
+}
+
+bool malcWriter::emitLet(const malList* list, const String& env,
+                         const String& var, bool isTail)
+{
+    malBindingPlanPtr letPlan;
+    try {
+        letPlan = malBindingPlan::forLet(list->item(1));
+    }
+    catch (malException&) {
+        return false; // for EVAL to raise the error
+    }
+    catch (String&) {
+        return false;
+    }
+
+    String p = plan(list->item(1)), inner = env;
+    if (isTail) {
+        line(STRF("env = malEnv::make(env, %s->slotCount());", p.c_str()));
+    }
+    else {
+        inner = STRF("e%d", m_tempCount++);
+        line(STRF("malEnvPtr %s = malEnv::make(%s, %s->slotCount());",
+                  inner.c_str(), env.c_str(), p.c_str()));
+    }
+    for (int i = 0; i < letPlan->letCount(); i++) {
+        String value = declare();
+        emit(letPlan->letValue(i), inner, value, false);
+        line(STRF("%s->bindLet(%d, %s, %s.ptr());",
+                  p.c_str(), i, value.c_str(), inner.c_str()));
+    }
+    emit(list->item(2), inner, var, isTail);
+    if (!isTail) {
+        line("malEnv::recycle(" + inner + ");");
+    }
+    return true;
+}
+
+//  The body of a try* is run by a lambda, which returns any error raised,
+//  or thrown, in it, and can't recur.
+bool malcWriter::emitTry(const malList* list, const String& env,
+                         const String& var, bool isTail)
+{
+    int argCount = list->count() - 1;
+    if (argCount == 1) {
+        emit(list->item(1), env, var, isTail);
+        return true;
+    }
+    if (argCount != 2 || !isCall(list->item(2), "catch*")) {
+        return false;
+    }
+    const malList* catchBlock = STATIC_CAST(malList, list->item(2));
+    if (catchBlock->count() != 3 ||
+        !DYNAMIC_CAST(malSymbol, catchBlock->item(1))) {
+        return false;
+    }
+
+    bool canRecur = m_canRecur, inTry = m_inTry;
+    m_canRecur = false;
+    m_inTry = true;
+    open(var + " = malcTry([&]() -> malValuePtr {");
+    String value = declare();
+    emit(list->item(1), env, value, false);
+    line("return " + value + ";");
+    close("});");
+    m_inTry = inTry;
+
+    String name = constant(catchBlock->item(1));
+    String bind = STRF("->set(STATIC_CAST(malSymbol, %s)->value(), "
+                       "malError::take());", name.c_str());
+    if (isTail) {
+        line("if (!malError::isRaised(value)) return VALUE;");
+        line("env = malEnv::make(env, 1);");
+        line("env" + bind);
+        emit(catchBlock->item(2), env, var, true);
+    }
+    else {
+        open("if (malError::isRaised(" + var + ")) {");
+        String inner = STRF("e%d", m_tempCount++);
+        line(STRF("malEnvPtr %s = malEnv::make(%s, 1);",
+                  inner.c_str(), env.c_str()));
+        line(inner + bind);
+        emit(catchBlock->item(2), inner, var, false);
+        close();
+    }
+    m_canRecur = canRecur;
+    return true;
+}
+
+//  A call to and or or with at least one argument, which stops at the
+//  first value that is false, or true. In tail position that returns it,
+//  else the rest are nested inside the test.
+void malcWriter::emitCascade(const malList* list, bool isAnd,
+                             const String& env, const String& var,
+                             bool isTail)
+{
+    int argCount = list->count() - 1;
+    for (int i = 1; i < argCount; i++) {
+        emit(list->item(i), env, var, false);
+        if (isTail) {
+            line(STRF("if (%s%s->isTrue()) return VALUE;",
+                      isAnd ? "!" : "", var.c_str()));
+        }
+        else {
+            open(STRF("if (%s%s->isTrue()) {",
+                      isAnd ? "" : "!", var.c_str()));
+        }
+    }
+    emit(list->item(argCount), env, var, isTail);
+    for (int i = 1; !isTail && i < argCount; i++) {
+        close();
+    }
+}
+
+//  A call through a symbol, which is looked up each time, so that it can be
+//  redefined, or turn out to be a macro, which is left to EVAL.
+void malcWriter::emitCall(const malList* list, const String& env,
+                          const String& var, bool isTail)
+{
+    malValuePtr form(const_cast<malList*>(list));
+    String op = declare();
+    line(op + " = malcLookup(" + constant(list->item(0)) + ", " + env + ");");
+    checkRaised(op);
+    open("if (malcIsMacro(" + op + ")) {");
+    auto it = m_expansions.find(list);
+    if (it != m_expansions.end()) {
+        // Run the expansion, unless the macro has been redefined. Calls
+        // to the builtin and and or are run as EVAL runs them.
+        open(STRF("if (malcIsExpansionOf(%s, %s)) {", op.c_str(),
+                  constant(it->second.macro).c_str()));
+        const malString* key = DYNAMIC_CAST(malString, it->second.macro);
+        if (key && (key->value() == "and" || key->value() == "or") &&
+            list->count() > 1) {
+            emitCascade(list, key->value() == "and", env, var, isTail);
+        }
+        else {
+            emit(it->second.form, env, var, isTail);
+        }
+        orElse();
+        emitForm(form, env, var, isTail);
+        close();
+    }
+    else {
+        emitForm(form, env, var, isTail);
+    }
+    orElse();
+
+    StringVec args;
+    String argList;
+    for (int i = 1; i < list->count(); i++) {
+        args.push_back(declare());
+        emit(list->item(i), env, args.back(), false);
+        argList += (i > 1 ? ", " : "") + args.back();
+    }
+
+    // A call to an arithmetic builtin, as the symbol finds it now.
+    const malSymbol* symbol = STATIC_CAST(malSymbol, list->item(0));
+    const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn,
+                                             m_env->lookup(symbol->name()));
+    bool isIntCall = false;
+    for (auto& intOp : intOps) {
+        if (!builtin || builtin->intOp() != intOp.op || args.size() != 2) {
+            continue;
+        }
+        String lhs = "malcInteger(" + args[0] + ")";
+        String rhs = "malcInteger(" + args[1] + ")";
+        bool isDivision = intOp.op == INT_OP_DIV || intOp.op == INT_OP_MOD;
+        open(STRF("if (%s.ptr() == %s.ptr() &&", op.c_str(),
+                  global(list->item(0)).c_str()));
+        line(STRF("    malcIsInteger(%s) && malcIsInteger(%s)%s) {",
+                  args[0].c_str(), args[1].c_str(),
+                  isDivision ? (" && " + rhs + " != 0").c_str() : ""));
+        line(STRF("%s = mal::%s(%s %s %s);", var.c_str(),
+                  intOp.isArith ? "integer" : "boolean",
+                  lhs.c_str(), intOp.cppOp, rhs.c_str()));
+        done(isTail);
+        orElse();
+        isIntCall = true;
+    }
+
+    if (isTail) {
+        line(args.empty() ? "args.clear();" : "args = { " + argList + " };");
+        line("value = " + op + ";");
+        line("ast = " + constant(form) + ";");
+        line("return CALL;");
+    }
+    else {
+        String vec = STRF("v%d", m_tempCount++);
+        line("malValueVec " + vec +
+             (args.empty() ? ";" : " { " + argList + " };"));
+        line(STRF("%s = evalCall(%s, %s, %s);", var.c_str(),
+                  constant(form).c_str(), op.c_str(), vec.c_str()));
+        checkRaised(var);
+    }
+    if (isIntCall) {
+        close();
+    }
+    close();
+}
+
+//  Anything left to EVAL.
+void malcWriter::emitForm(malValuePtr form, const String& env,
+                          const String& var, bool isTail)
+{
+    // A recur that can't be made from here is left for EVAL to raise.
+    if (isTail && (m_canRecur || !isCall(form, "recur"))) {
+        line("ast = " + constant(form) + ";");
+        line("return FORM;");
+        return;
+    }
+    line(STRF("%s = evalRaising(%s, %s);", var.c_str(),
+              constant(form).c_str(), env.c_str()));
+    if (!isTail) {
+        checkRaised(var);
+    }
+    done(isTail);
+}
+
+String malcWriter::constant(malValuePtr value)
+{
+    auto it = m_constantIndex.find(value.ptr());
+    if (it == m_constantIndex.end()) {
+        it = m_constantIndex.insert(
+                std::make_pair(value.ptr(), m_constants.size())).first;
+        m_constants.push_back(value);
+    }
+    return STRF("k[%d]", it->second);
+}
+
+String malcWriter::plan(malValuePtr bindings)
+{
+    auto it = m_planIndex.find(bindings.ptr());
+    if (it == m_planIndex.end()) {
+        it = m_planIndex.insert(
+                std::make_pair(bindings.ptr(), m_plans.size())).first;
+        m_plans.push_back(constant(bindings));
+    }
+    return STRF("p[%d]", it->second);
+}
+
+String malcWriter::global(malValuePtr symbol)
+{
+    const String& name = STATIC_CAST(malSymbol, symbol)->value();
+    auto it = m_globalIndex.find(name);
+    if (it == m_globalIndex.end()) {
+        it = m_globalIndex.insert(
+                std::make_pair(name, m_globals.size())).first;
+        m_globals.push_back(constant(symbol));
+    }
+    return STRF("g[%d]", it->second);
+}
+
+String malcWriter::temp()
+{
+    return STRF("t%d", m_tempCount++);
+}
+
+String malcWriter::declare()
+{
+    String name = temp();
+    line("malValuePtr " + name + ";");
+    return name;
+}
+
+void malcWriter::line(const String& text)
+{
+    m_body << String(m_depth * 4, ' ') << text << "\n";
+}
+
+void malcWriter::checkRaised(const String& var)
+{
+    String test = "if (malError::isRaised(" + var + ")) ";
+    if (m_inTry) {
+        line(test + "return " + var + ";");
+    }
+    else if (var == "value") {
+        line(test + "return VALUE;");
+    }
+    else {
+        line(test + "{ value = " + var + "; return VALUE; }");
+    }
+}
+
+void compileProgram(const String& filename, const String& output,
+                    malEnvPtr env)
+{
+    // This gives (do forms... nil).
+    malValuePtr file = readFileForms(filename);
+    const malList* forms = VALUE_CAST(malList, file);
+    malcWriter writer(env);
+    for (int i = 1; i < forms->count() - 1; i++) {
+        writer.addForm(forms->item(i));
+    }
+
+    std::ofstream out(output.c_str());
+    writer.write(out, filename);
+    out.close();
+    MAL_CHECK(!out.fail(), "Cannot write %s", output.c_str());
+}
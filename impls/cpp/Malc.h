@@ -0,0 +1,116 @@
+#ifndef INCLUDE_MALC_H
+#define INCLUDE_MALC_H
+
+#include "MAL.h"
+#include "Budget.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <typeinfo>
+
+//  Support for the programs that malc compiles ahead of time, see Malc.cpp.
+//  The C++ it writes includes this, and is linked with stepA_mal.o and
+//  libmal.a, whose main runs the program.
+
+class malcProgram {
+public:
+    // Sets up the program's tables from its constants, restored from its
+    // image, installs its compiled bodies, and adds the compiled form of
+    // each top-level form to forms.
+    typedef void (Init)(const malValueVec& constants, malEnvPtr env,
+                        malValueVec& forms);
+
+    malcProgram(const char* name, const char* image, size_t size, Init* init)
+    : m_name(name), m_image(image), m_size(size), m_init(init) {
+        s_linked = this;
+    }
+
+    // The program linked into this executable, if any.
+    static malcProgram* linked() { return s_linked; }
+
+    void load(malEnvPtr env);
+
+    const malValueVec& forms() const { return m_forms; }
+
+private:
+    const char* const m_name;
+    const char* const m_image;
+    const size_t      m_size;
+    Init* const       m_init;
+    malValueVec       m_forms;
+
+    static malcProgram* s_linked;
+};
+
+//  A body compiled by malc. The code written for it is the body of run.
+#define MALC_BODY(Name) \
+    class Name : public malCompiled { \
+    public: \
+        Name(malValuePtr body) : malCompiled(body) { } \
+        Name(const Name& that, malValuePtr meta) \
+        : malCompiled(that, meta) { } \
+        virtual Tail run(malValuePtr& ast, malEnvPtr& env, \
+                         malValuePtr& value, malValueVec& args) const; \
+        WITH_META(Name); \
+    }; \
+    malCompiled::Tail Name::run(malValuePtr& ast, malEnvPtr& env, \
+                                malValuePtr& value, malValueVec& args) const
+
+inline malValuePtr malcLookup(const malValuePtr& symbol, const malEnvPtr& env)
+{
+    if (malValuePtr value = STATIC_CAST(malSymbol, symbol)->lookup(env)) {
+        return value;
+    }
+    return evalRaising(symbol, env); // to raise the error
+}
+
+inline bool malcIsMacro(const malValuePtr& op)
+{
+    const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
+    return handler && handler->isMacro();
+}
+
+//  Whether op is the macro that malc expanded a call with, and found by its
+//  key: the body of a macro written in mal, which is one of the program's
+//  forms, or the name of a builtin.
+inline bool malcIsExpansionOf(const malValuePtr& op, const malValuePtr& key)
+{
+    if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
+        return lambda->getBody().ptr() == key.ptr();
+    }
+    const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn, op);
+    const malString* name = DYNAMIC_CAST(malString, key);
+    return builtin && name && builtin->name() == name->value();
+}
+
+inline bool malcIsInteger(const malValuePtr& value)
+{
+    // Cheaper than a dynamic_cast, since nothing derives from malInteger.
+    return typeid(*value.ptr()) == typeid(malInteger);
+}
+
+inline int64_t malcInteger(const malValuePtr& value)
+{
+    return STATIC_CAST(malInteger, value)->value();
+}
+
+//  Runs the body of a try*, and returns its value, or the error it raised,
+//  as EVAL does for try*.
+template <typename Body>
+malValuePtr malcTry(Body body)
+{
+    try {
+        return body();
+    }
+    catch (malEmptyInputException&) {
+        return mal::nilValue();
+    }
+    catch (malException& e) {
+        return malError::raise(e);
+    }
+    catch (String& s) {
+        return malError::raise(malException::message(s));
+    }
+}
+
+#endif // INCLUDE_MALC_H
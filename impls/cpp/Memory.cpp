@@ -0,0 +1,80 @@
+#include "Memory.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+
+size_t malMemory::s_bytes = 0;
+size_t malMemory::s_peak  = 0;
+size_t malMemory::s_quota = 0;
+size_t malMemory::s_limit = SIZE_MAX;
+
+//  The classes are named as they are in C++, and shown without the "mal",
+//  and in lower case, as "tail-call" for malTailCall.
+malMemory::Usage::Usage(const char* name)
+: count(0)
+, bytes(0)
+{
+    String text = name;
+    if (text.compare(0, 3, "mal") == 0) {
+        text.erase(0, 3);
+    }
+    for (size_t i = 0; i < text.size(); i++) {
+        if (isupper(text[i])) {
+            if (i > 0) {
+                this->name += '-';
+            }
+            this->name += tolower(text[i]);
+        }
+        else {
+            this->name += text[i];
+        }
+    }
+    allUsages().push_back(this);
+}
+
+malMemory::Usages& malMemory::allUsages()
+{
+    static Usages usages;
+    return usages;
+}
+
+malMemory::Usage& malMemory::sequenceItems()
+{
+    static Usage usage("sequence-items");
+    return usage;
+}
+
+malMemory::Usage& malMemory::strings()
+{
+    static Usage usage("strings");
+    return usage;
+}
+
+malMemory::Usage& malMemory::hashEntries()
+{
+    static Usage usage("hash-entries");
+    return usage;
+}
+
+void malMemory::setQuota(size_t bytes)
+{
+    s_quota = bytes;
+    s_limit = bytes ? bytes : SIZE_MAX;
+}
+
+malValuePtr malMemory::overQuota()
+{
+    malEnv::releasePool();
+    if (s_bytes <= s_quota) {
+        s_limit = s_quota;
+        return NULL;
+    }
+    // Leave some room for the code that handles the error.
+    s_limit = std::max(s_limit, s_quota + s_quota / 16);
+    return malError::raise(malException::message(
+        STRF("Memory quota of %zu bytes exceeded, with %zu bytes in use",
+             s_quota, s_bytes)));
+}
@@ -0,0 +1,105 @@
+#ifndef INCLUDE_MEMORY_H
+#define INCLUDE_MEMORY_H
+
+#include "MAL.h"
+
+#include <cstddef>
+#include <vector>
+
+// Allocation accounting for the interpreter's values and environments,
+// with an optional quota. Each class of value, and malEnv, counts its live
+// objects and their bytes, see WITH_ACCOUNTING, as do the item arrays of
+// sequences and records, the text of strings, and the entries of hash-maps,
+// which are most of the rest.
+//
+// The quota isn't enforced by the allocator, which can't raise an error
+// without leaking whatever is being built, but by EVAL, which checks it at
+// each step, see checkQuota.
+class malMemory {
+public:
+    // The live objects of one class, or blocks of one kind of storage,
+    // and their size in bytes.
+    struct Usage {
+        Usage(const char* name);
+
+        String name;
+        size_t count;
+        size_t bytes;
+    };
+    typedef std::vector<Usage*> Usages;
+
+    static void* allocate(size_t size, Usage& usage) {
+        add(size, usage);
+        return ::operator new(size);
+    }
+
+    static void release(void* object, size_t size, Usage& usage) {
+        remove(size, usage);
+        ::operator delete(object);
+    }
+
+    static void add(size_t size, Usage& usage) {
+        usage.count++;
+        usage.bytes += size;
+        if ((s_bytes += size) > s_peak) {
+            s_peak = s_bytes;
+        }
+    }
+
+    static void remove(size_t size, Usage& usage) {
+        usage.count--;
+        usage.bytes -= size;
+        s_bytes -= size;
+        if (s_bytes < s_quota) {
+            s_limit = s_quota; // the error's grace is over
+        }
+    }
+
+    // The kinds of storage values own. Like the usages of classes, these
+    // are made on first use, since values are made during static
+    // initialisation.
+    static Usage& sequenceItems();
+    static Usage& strings();
+    static Usage& hashEntries();
+
+    static const Usages& usages() { return allUsages(); }
+    static size_t bytes() { return s_bytes; }
+    static size_t peak() { return s_peak; }
+
+    // A quota of 0 bytes is none.
+    static void   setQuota(size_t bytes);
+    static size_t quota() { return s_quota; }
+
+    // Returns NULL while the live bytes are within the quota. Once they
+    // aren't, frees what it can, such as the frames kept for reuse, and if
+    // that isn't enough, raises an error, see malError. The code that
+    // handles it can use another sixteenth of the quota, until the live
+    // bytes are back under it; past that, each check raises the error.
+    static malValuePtr checkQuota() {
+        return s_bytes > s_limit ? overQuota() : malValuePtr();
+    }
+
+private:
+    static Usages& allUsages();
+    static malValuePtr overQuota();
+
+    static size_t s_bytes;
+    static size_t s_peak;
+    static size_t s_quota;
+    static size_t s_limit;
+};
+
+// Counts the objects of a class, in a usage of its own named after it.
+#define WITH_ACCOUNTING(Type) \
+    static void* operator new(size_t size) { \
+        return malMemory::allocate(size, memoryUsage()); \
+    } \
+    static void operator delete(void* object, size_t size) { \
+        malMemory::release(object, size, memoryUsage()); \
+    } \
+    static malMemory::Usage& memoryUsage() { \
+        static malMemory::Usage usage(#Type); \
+        return usage; \
+    }
+
+#endif // INCLUDE_MEMORY_H
@@ -0,0 +1,742 @@
+#include "MAL.h"
+#include "Environment.h"
+#include "Types.h"
+
+#include <algorithm>
+#include <memory>
+
+//  The optional middle end of stepA, enabled by --optimize. Each fn* body is
+//  rewritten once, when the fn* is first evaluated, by these passes:
+//
+//  constants   let* bindings of constants, or of other locals, are
+//              substituted into the body and dropped, as are globals bound
+//              to numbers, strings, keywords, nil, true or false, and calls
+//              to pure builtins with constant arguments are replaced by
+//              their value.
+//  branches    an if with a constant test is replaced by the branch taken.
+//  do          nested do forms are flattened, constants other than the last
+//              form dropped, and (do x) replaced by x.
+//  inline      calls to small global functions that aren't recursive and
+//              don't close over any locals are replaced by a let* of their
+//              body, which the other passes then work on.
+//
+//  The rewritten body is still made of ordinary forms. A rewrite which
+//  depends on the value of a global, such as inlining it, or which could
+//  change the forms a macro is given, is guarded by that value, see
+//  malGuard. The guard is checked on entry to the body, so these are only
+//  made in a body whose rewritten form calls nothing but pure builtins,
+//  since any other call, or a macro expansion, could bind the global again
+//  part way through it, or between the iterations of a loop*. Calls to
+//  macros, and the forms that aren't evaluated, such as quote and
+//  quasiquote, are left alone, as are nested fn* forms, which are rewritten
+//  when they are evaluated.
+
+enum {
+    PASS_CONSTANTS  = 1 << 0,
+    PASS_BRANCHES   = 1 << 1,
+    PASS_DO         = 1 << 2,
+    PASS_INLINE     = 1 << 3,
+    PASS_ALL        = (1 << 4) - 1,
+};
+
+static const struct {
+    const char* name;
+    unsigned    passes;
+} passNames[] = {
+    { "all",        PASS_ALL },
+    { "none",       0 },
+    { "constants",  PASS_CONSTANTS },
+    { "branches",   PASS_BRANCHES },
+    { "do",         PASS_DO },
+    { "inline",     PASS_INLINE },
+};
+
+static unsigned s_passes = 0;
+
+// The most forms in the body of a function that is inlined, and the most
+// inlined calls nested inside each other.
+static const int INLINE_SIZE = 24;
+static const int INLINE_DEPTH = 4;
+
+class malOptimizer {
+public:
+    malOptimizer(malEnvPtr env)
+    : m_root(env->getRoot()), m_isLocalOnly(false) { }
+
+    malValuePtr optimizeBody(malValuePtr params, malValuePtr body);
+
+private:
+    // A local name, and the constant or other local symbol it stands for,
+    // or NULL if it isn't known.
+    struct Binding {
+        const malName* name;
+        malValuePtr    value;
+    };
+
+    malValuePtr optimize(malValuePtr form);
+    malValuePtr optimizeCall(malValuePtr form);
+    malValuePtr optimizeDo(malValuePtr form);
+    malValuePtr optimizeIf(malValuePtr form);
+    malValuePtr optimizeLet(malValuePtr form, bool isLoop);
+    malValuePtr optimizeTry(malValuePtr form);
+    malValuePtr inlineCall(const malValueVec& call, const malLambda* lambda);
+    bool callsOut(const malValuePtr& form) const;
+    malValueVec* optimizeItems(const malSequence* seq, int start);
+
+    void bind(const malName* name, malValuePtr value = NULL);
+    const Binding* find(const malName* name) const;
+    const malValuePtr* globalCell(const malSymbol* symbol) const;
+    void assume(const malName* name, const malValuePtr* cell);
+
+    malEnvPtr               m_root;
+    std::vector<Binding>    m_scope;
+    malNameVec              m_rebound;
+    std::vector<const malLambda*> m_inlining;
+    malGuard::Assumptions   m_assumptions;
+    bool                    m_isLocalOnly;  // rewrite without any globals
+};
+
+bool setOptimizerPasses(const String& names)
+{
+    unsigned passes = 0;
+    size_t start = 0;
+    while (start <= names.length()) {
+        size_t end = std::min(names.find(',', start), names.length());
+        String name = names.substr(start, end - start);
+        auto it = std::find_if(std::begin(passNames), std::end(passNames),
+            [&name](decltype(passNames[0])& pass) {
+                return name == pass.name;
+            });
+        if (it == std::end(passNames)) {
+            return false;
+        }
+        passes |= it->passes;
+        start = end + 1;
+    }
+    s_passes = passes;
+    return true;
+}
+
+bool isOptimizing()
+{
+    return s_passes != 0;
+}
+
+static bool isSymbol(const malValuePtr& form, const char* text)
+{
+    const malSymbol* symbol = DYNAMIC_CAST(malSymbol, form);
+    return symbol && symbol->value() == text;
+}
+
+static bool isLiteral(const malValuePtr& value)
+{
+    return DYNAMIC_CAST(malConstant, value) ||
+           DYNAMIC_CAST(malInteger, value) ||
+           DYNAMIC_CAST(malString, value) ||
+           DYNAMIC_CAST(malKeyword, value);
+}
+
+static bool isSpecialForm(const malList* list, const char* name)
+{
+    return !list->isEmpty() && isSymbol(list->item(0), name);
+}
+
+//  Call f on each symbol anywhere in form, quoted or not, until it returns
+//  true. Returns whether it did.
+template <typename F>
+static bool anySymbol(const malValuePtr& form, F f)
+{
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, form)) {
+        return f(symbol);
+    }
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, form)) {
+        return std::any_of(seq->begin(), seq->end(),
+            [&f](const malValuePtr& item) { return anySymbol(item, f); });
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, form)) {
+        return !hash->isEvaluated() && anySymbol(hash->values(), f);
+    }
+    return false;
+}
+
+static bool mentions(const malValuePtr& form, const malName* name)
+{
+    return anySymbol(form, [name](const malSymbol* symbol) {
+        return symbol->name() == name;
+    });
+}
+
+//  The number of forms in form, counting up to limit.
+static int formSize(const malValuePtr& form, int limit)
+{
+    int size = 1;
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, form)) {
+        for (auto it = seq->begin(); it != seq->end() && size <= limit; ++it) {
+            size += formSize(*it, limit - size);
+        }
+    }
+    return size;
+}
+
+//  Add the names that def! or defmacro! bind anywhere in form to names.
+static void collectRebound(const malValuePtr& form, malNameVec& names)
+{
+    const malSequence* seq = DYNAMIC_CAST(malSequence, form);
+    if (!seq) {
+        return;
+    }
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (list && list->count() > 1 && (isSpecialForm(list, "def!") ||
+                                      isSpecialForm(list, "defmacro!"))) {
+        if (const malSymbol* id = DYNAMIC_CAST(malSymbol, list->item(1))) {
+            names.push_back(id->name());
+        }
+    }
+    for (auto it = seq->begin(), end = seq->end(); it != end; ++it) {
+        collectRebound(*it, names);
+    }
+}
+
+malValuePtr optimizeBody(malValuePtr params, malValuePtr body, malEnvPtr env)
+{
+    malBindingPlanPtr plan;
+    try {
+        plan = malBindingPlan::forParams(params);
+    }
+    catch (malException&) {
+        return body;
+    }
+    catch (String&) {
+        return body;
+    }
+
+    // Rewrite the body again if a global it depended on has changed.
+    malValuePtr optimized = plan->optimizedBody(body);
+    const malList* guarded = DYNAMIC_CAST(malList, optimized);
+    const malGuard* guard = guarded && !guarded->isEmpty()
+        ? DYNAMIC_CAST(malGuard, guarded->item(0)) : NULL;
+    if (optimized && (!guard || guard->holds())) {
+        return optimized;
+    }
+
+    try {
+        optimized = malOptimizer(env).optimizeBody(params, body);
+    }
+    catch (malException&) {
+        optimized = body;
+    }
+    catch (String&) {
+        optimized = body;
+    }
+    plan->setOptimizedBody(body, optimized);
+    return optimized;
+}
+
+malValuePtr unoptimizedBody(malValuePtr body)
+{
+    const malList* list = DYNAMIC_CAST(malList, body);
+    if (list && list->count() == 3 && DYNAMIC_CAST(malGuard, list->item(0))) {
+        return list->item(2);
+    }
+    return body;
+}
+
+malValuePtr malOptimizer::optimizeBody(malValuePtr params, malValuePtr body)
+{
+    // Names bound by def! in the body could be bound again at any time.
+    collectRebound(body, m_rebound);
+
+    malNameVec names;
+    malValueVec defaults;
+    malBindingPlan::forParams(params)->paramNames(names, defaults);
+    for (auto name : names) {
+        bind(name);
+    }
+
+    malValuePtr optimized = optimize(body);
+    if (!m_assumptions.empty() && callsOut(optimized)) {
+        // The guard wouldn't see a global change after the body started.
+        m_assumptions.clear();
+        m_isLocalOnly = true;
+        optimized = optimize(body);
+    }
+    if (m_assumptions.empty()) {
+        return optimized;
+    }
+    return mal::list(new malGuard(m_assumptions), optimized, body);
+}
+
+malValuePtr malOptimizer::optimize(malValuePtr form)
+{
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, form)) {
+        if (const Binding* binding = find(symbol->name())) {
+            return binding->value ? binding->value : form;
+        }
+        const malValuePtr* cell = globalCell(symbol);
+        if ((s_passes & PASS_CONSTANTS) && cell && isLiteral(*cell)) {
+            assume(symbol->name(), cell);
+            return *cell;
+        }
+        return form;
+    }
+    if (const malVector* vector = DYNAMIC_CAST(malVector, form)) {
+        malValueVec* items = optimizeItems(vector, 0);
+        return items ? mal::vector(items) : form;
+    }
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (!list || list->isEmpty()) {
+        return form;
+    }
+
+    // The special forms, as handled by EVAL. Those that aren't here, other
+    // than def!, don't evaluate their arguments as they are.
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        const String& special = symbol->value();
+        if (special == "recur") {
+            malValueVec* items = optimizeItems(list, 1);
+            return items ? mal::list(items) : form;
+        }
+        if (special == "def!" || special == "defmacro!") {
+            if (list->count() != 3) {
+                return form;
+            }
+            malValuePtr value = optimize(list->item(2));
+            return value == list->item(2) ? form
+                : mal::list(list->item(0), list->item(1), value);
+        }
+        if (special == "do") {
+            return optimizeDo(form);
+        }
+        if (special == "if") {
+            return optimizeIf(form);
+        }
+        if (special == "let*" || special == "loop*") {
+            return optimizeLet(form, special == "loop*");
+        }
+        if (special == "try*") {
+            return optimizeTry(form);
+        }
+        if (special == "fn*" || special == "macroexpand" ||
+            special == "quasiquote" || special == "quote") {
+            return form;
+        }
+    }
+    return optimizeCall(form);
+}
+
+malValuePtr malOptimizer::optimizeCall(malValuePtr form)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    const malSymbol* head = DYNAMIC_CAST(malSymbol, list->item(0));
+    const malValuePtr* cell = head ? globalCell(head) : NULL;
+    malValuePtr op = cell ? *cell : malValuePtr();
+    const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
+    if (handler && handler->isMacro()) {
+        return form;
+    }
+
+    if (m_isLocalOnly && head && !find(head->name())) {
+        // It could be a macro by the time it's called.
+        return form;
+    }
+
+    malValueVec* items = optimizeItems(list, 0);
+    if (!cell) {
+        return items ? mal::list(items) : form;
+    }
+    std::unique_ptr<malValueVec> owner(items);
+    if (!items) {
+        items = new malValueVec(list->begin(), list->end());
+        owner.reset(items);
+    }
+
+    const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn, op);
+    if ((s_passes & PASS_CONSTANTS) && builtin && builtin->isPure() &&
+        std::all_of(items->begin() + 1, items->end(), evaluatesToItself)) {
+        malValuePtr value;
+        try {
+            value = builtin->call(items->begin() + 1, items->end());
+        }
+        catch (malException&) {
+        }
+        catch (String&) {
+        }
+        if (malError::isRaised(value)) {
+            // Leave the error to be raised when the call is made.
+            malError::take();
+        }
+        else if (value && evaluatesToItself(value)) {
+            assume(head->name(), cell);
+            return value;
+        }
+    }
+
+    if (s_passes & PASS_INLINE) {
+        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
+            if (malValuePtr inlined = inlineCall(*items, lambda)) {
+                assume(head->name(), cell);
+                return inlined;
+            }
+        }
+    }
+
+    if (!std::equal(items->begin(), items->end(), list->begin())) {
+        // The arguments were rewritten, so the call mustn't become a call
+        // to a macro.
+        assume(head->name(), cell);
+        return mal::list(owner.release());
+    }
+    return form;
+}
+
+//  Return the body of lambda, bound to the arguments of call by a let*, if
+//  it can be inlined there, else NULL.
+malValuePtr malOptimizer::inlineCall(const malValueVec& call,
+                                     const malLambda* lambda)
+{
+    if (lambda->isMacro() || lambda->getEnv()->getOuter() ||
+        lambda->getArities().size() != 1 ||
+        (int)m_inlining.size() >= INLINE_DEPTH ||
+        std::count(m_inlining.begin(), m_inlining.end(), lambda)) {
+        return NULL;
+    }
+    const malLambda::Arity& arity = lambda->getArities()[0];
+    const malSequence* params = DYNAMIC_CAST(malSequence, arity.params);
+    malValuePtr body = unoptimizedBody(arity.body);
+    if (!params || params->count() != (int)call.size() - 1 ||
+        formSize(body, INLINE_SIZE) > INLINE_SIZE) {
+        return NULL;
+    }
+    malNameVec names;
+    for (auto it = params->begin(), end = params->end(); it != end; ++it) {
+        const malSymbol* param = DYNAMIC_CAST(malSymbol, *it);
+        if (!param || param->value() == "&") {
+            return NULL;
+        }
+        names.push_back(param->name());
+    }
+
+    // Every other name in the body must be global here, as it is where the
+    // function was made, and not a macro, whose expansion could refer to
+    // anything. Otherwise, an argument mustn't refer to a parameter, which
+    // the let* would bind before evaluating it.
+    malNameVec globals;
+    bool isUnsafe = anySymbol(body, [&](const malSymbol* symbol) {
+        const malName* name = symbol->name();
+        if (std::count(names.begin(), names.end(), name)) {
+            return false;
+        }
+        const String& text = symbol->value();
+        if (text == "recur" || text == "def!" || text == "defmacro!" ||
+            name->isLocal() || find(name)) {
+            return true;
+        }
+        if (const malValuePtr* cell = m_root->globalCell(text)) {
+            const malApplicable* handler = DYNAMIC_CAST(malApplicable, *cell);
+            if (handler && handler->isMacro()) {
+                return true;
+            }
+            globals.push_back(name);
+        }
+        return false;
+    });
+    if (isUnsafe) {
+        return NULL;
+    }
+    for (size_t i = 1; i < call.size(); i++) {
+        for (auto name : names) {
+            if (mentions(call[i], name)) {
+                return NULL;
+            }
+        }
+    }
+
+    for (auto name : globals) {
+        assume(name, m_root->globalCell(name->value()));
+    }
+    malValueVec* bindings = new malValueVec;
+    for (int i = 0; i < params->count(); i++) {
+        bindings->push_back(params->item(i));
+        bindings->push_back(call[i + 1]);
+    }
+    malValuePtr let = mal::list(mal::symbol("let*"), mal::vector(bindings),
+                                body);
+    m_inlining.push_back(lambda);
+    malValuePtr inlined = optimize(let);
+    m_inlining.pop_back();
+    return inlined;
+}
+
+//  Whether evaluating form could run mal code, or a builtin which isn't
+//  pure, either of which could bind a global again.
+bool malOptimizer::callsOut(const malValuePtr& form) const
+{
+    if (const malVector* vector = DYNAMIC_CAST(malVector, form)) {
+        return std::any_of(vector->begin(), vector->end(),
+            [this](const malValuePtr& item) { return callsOut(item); });
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, form)) {
+        return !hash->isEvaluated() && callsOut(hash->values());
+    }
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (!list || list->isEmpty()) {
+        return false;
+    }
+    const malSymbol* head = DYNAMIC_CAST(malSymbol, list->item(0));
+    if (!head) {
+        return true;
+    }
+    const String& special = head->value();
+    if (special == "quote" || special == "fn*") {
+        return false;
+    }
+    if (special == "macroexpand") {
+        return true;
+    }
+    if (special != "catch*" && special != "def!" &&
+        special != "defmacro!" && special != "do" && special != "if" &&
+        special != "let*" && special != "loop*" &&
+        special != "quasiquote" && special != "recur" &&
+        special != "splice-unquote" && special != "try*" &&
+        special != "unquote") {
+        const malValuePtr* cell = globalCell(head);
+        const malBuiltIn* builtin =
+            cell ? DYNAMIC_CAST(malBuiltIn, *cell) : NULL;
+        if (!builtin || !builtin->isPure()) {
+            return true;
+        }
+    }
+    return std::any_of(list->begin() + 1, list->end(),
+        [this](const malValuePtr& item) { return callsOut(item); });
+}
+
+malValuePtr malOptimizer::optimizeDo(malValuePtr form)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    if (list->count() < 2) {
+        return form;
+    }
+    malValueVec* items = optimizeItems(list, 1);
+    if (!(s_passes & PASS_DO)) {
+        return items ? mal::list(items) : form;
+    }
+    std::unique_ptr<malValueVec> owner(items);
+    if (!items) {
+        items = new malValueVec(list->begin(), list->end());
+        owner.reset(items);
+    }
+
+    // The forms of nested do forms have been flattened already.
+    malValueVec* forms = new malValueVec;
+    std::unique_ptr<malValueVec> formsOwner(forms);
+    for (auto it = items->begin(), end = items->end(); it != end; ++it) {
+        const malList* inner = DYNAMIC_CAST(malList, *it);
+        if (it != items->begin() && inner && inner->count() > 1 &&
+            isSpecialForm(inner, "do")) {
+            forms->insert(forms->end(), inner->begin() + 1, inner->end());
+        }
+        else if (it == items->begin() || it + 1 == end ||
+                 !evaluatesToItself(*it)) {
+            forms->push_back(*it);
+        }
+    }
+    if (forms->size() == 2) {
+        return (*forms)[1];
+    }
+    if (forms->size() == (size_t)list->count() &&
+        std::equal(forms->begin(), forms->end(), list->begin())) {
+        return form;
+    }
+    return mal::list(formsOwner.release());
+}
+
+malValuePtr malOptimizer::optimizeIf(malValuePtr form)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    int argCount = list->count() - 1;
+    if (argCount != 2 && argCount != 3) {
+        return form;
+    }
+    malValuePtr test = optimize(list->item(1));
+    if ((s_passes & PASS_BRANCHES) && evaluatesToItself(test)) {
+        if (test->isTrue()) {
+            return optimize(list->item(2));
+        }
+        return argCount == 3 ? optimize(list->item(3)) : mal::nilValue();
+    }
+    malValueVec* items = new malValueVec(list->begin(), list->end());
+    (*items)[1] = test;
+    for (int i = 2; i <= argCount; i++) {
+        (*items)[i] = optimize(list->item(i));
+    }
+    if (std::equal(items->begin(), items->end(), list->begin())) {
+        delete items;
+        return form;
+    }
+    return mal::list(items);
+}
+
+malValuePtr malOptimizer::optimizeLet(malValuePtr form, bool isLoop)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    if (list->count() != 3) {
+        return form;
+    }
+    malBindingPlanPtr plan = malBindingPlan::forLet(list->item(1));
+    const malSequence* bindings = STATIC_CAST(malSequence, list->item(1));
+    size_t scopeSize = m_scope.size();
+
+    // Each binding, optimised, and whether it can be substituted.
+    malValueVec* items = new malValueVec(bindings->begin(), bindings->end());
+    std::unique_ptr<malValueVec> owner(items);
+    std::vector<bool> isSubstituted(plan->letCount());
+    for (int i = 0; i < plan->letCount(); i++) {
+        malValuePtr value = optimize((*items)[2 * i + 1]);
+        (*items)[2 * i + 1] = value;
+
+        // A constant, or another local which the body doesn't bind again,
+        // can be substituted for a name bound by let*.
+        const malSymbol* name = DYNAMIC_CAST(malSymbol, (*items)[2 * i]);
+        const malSymbol* local = DYNAMIC_CAST(malSymbol, value);
+        bool isKnown = !isLoop && name && (s_passes & PASS_CONSTANTS) &&
+            !std::count(m_rebound.begin(), m_rebound.end(), name->name()) &&
+            (local ? find(local->name()) &&
+                     !std::count(m_rebound.begin(), m_rebound.end(),
+                                 local->name()) &&
+                     !mentions(list->item(2), local->name()) &&
+                     !std::any_of(items->begin() + 2 * i + 2, items->end(),
+                        [local](const malValuePtr& form) {
+                            return mentions(form, local->name());
+                        })
+                   : evaluatesToItself(value));
+        if (isKnown) {
+            bind(name->name(), value);
+            isSubstituted[i] = true;
+            continue;
+        }
+        malNameVec names;
+        malValueVec defaults;
+        plan->letNames(i, names, defaults);
+        for (auto name : names) {
+            bind(name);
+        }
+    }
+    malValuePtr body = optimize(list->item(2));
+    m_scope.resize(scopeSize);
+
+    // Drop the bindings that were substituted everywhere.
+    malValueVec* kept = new malValueVec;
+    std::unique_ptr<malValueVec> keptOwner(kept);
+    for (int i = 0; i < plan->letCount(); i++) {
+        const malSymbol* name = DYNAMIC_CAST(malSymbol, (*items)[2 * i]);
+        if (isSubstituted[i] && !mentions(body, name->name()) &&
+            !std::any_of(items->begin() + 2 * i + 2, items->end(),
+                [name](const malValuePtr& form) {
+                    return mentions(form, name->name());
+                })) {
+            continue;
+        }
+        kept->push_back((*items)[2 * i]);
+        kept->push_back((*items)[2 * i + 1]);
+    }
+    if (kept->empty() && !isLoop && !mentions(body, malName::intern("def!"))
+        && !mentions(body, malName::intern("defmacro!"))) {
+        return body;
+    }
+    if (body == list->item(2) && kept->size() == (size_t)bindings->count()
+        && std::equal(kept->begin(), kept->end(), bindings->begin())) {
+        return form;
+    }
+    malValuePtr newBindings = DYNAMIC_CAST(malVector, list->item(1))
+        ? mal::vector(keptOwner.release()) : mal::list(keptOwner.release());
+    return mal::list(list->item(0), newBindings, body);
+}
+
+malValuePtr malOptimizer::optimizeTry(malValuePtr form)
+{
+    const malList* list = STATIC_CAST(malList, form);
+    int argCount = list->count() - 1;
+    if (argCount != 1 && argCount != 2) {
+        return form;
+    }
+    malValuePtr body = optimize(list->item(1));
+    if (argCount == 1) {
+        return body == list->item(1) ? form : mal::list(list->item(0), body);
+    }
+    malValuePtr catchForm = list->item(2);
+    const malList* catchBlock = DYNAMIC_CAST(malList, catchForm);
+    const malSymbol* excSym = catchBlock && catchBlock->count() == 3
+        ? DYNAMIC_CAST(malSymbol, catchBlock->item(1)) : NULL;
+    if (excSym && isSpecialForm(catchBlock, "catch*")) {
+        size_t scopeSize = m_scope.size();
+        bind(excSym->name());
+        malValuePtr handler = optimize(catchBlock->item(2));
+        m_scope.resize(scopeSize);
+        if (handler != catchBlock->item(2)) {
+            catchForm = mal::list(catchBlock->item(0), catchBlock->item(1),
+                                  handler);
+        }
+    }
+    if (body == list->item(1) && catchForm == list->item(2)) {
+        return form;
+    }
+    return mal::list(list->item(0), body, catchForm);
+}
+
+//  Optimise the items of seq from start on, returning all of its items, or
+//  NULL if none of them changed.
+malValueVec* malOptimizer::optimizeItems(const malSequence* seq, int start)
+{
+    malValueVec* items = NULL;
+    for (int i = start, count = seq->count(); i < count; i++) {
+        malValuePtr item = optimize(seq->item(i));
+        if (item != seq->item(i) && !items) {
+            items = new malValueVec(seq->begin(), seq->end());
+        }
+        if (items) {
+            (*items)[i] = item;
+        }
+    }
+    return items;
+}
+
+void malOptimizer::bind(const malName* name, malValuePtr value)
+{
+    m_scope.push_back(Binding { name, value });
+}
+
+const malOptimizer::Binding* malOptimizer::find(const malName* name) const
+{
+    for (auto it = m_scope.rbegin(), end = m_scope.rend(); it != end; ++it) {
+        if (it->name == name) {
+            return &*it;
+        }
+    }
+    return NULL;
+}
+
+//  The global binding of symbol, if it has one, and is neither bound here
+//  nor anywhere else in a local environment, and globals may be used.
+const malValuePtr* malOptimizer::globalCell(const malSymbol* symbol) const
+{
+    const malName* name = symbol->name();
+    if (m_isLocalOnly || name->isLocal() || find(name) ||
+        std::count(m_rebound.begin(), m_rebound.end(), name)) {
+        return NULL;
+    }
+    return m_root->globalCell(symbol->value());
+}
+
+void malOptimizer::assume(const malName* name, const malValuePtr* cell)
+{
+    for (auto& assumption : m_assumptions) {
+        if (assumption.name == name) {
+            if (cell && !assumption.cell) {
+                assumption.cell = cell;
+                assumption.value = *cell;
+            }
+            return;
+        }
+    }
+    m_assumptions.push_back({ name, cell, cell ? *cell : malValuePtr() });
+}
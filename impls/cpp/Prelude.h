@@ -0,0 +1,11 @@
+#ifndef INCLUDE_PRELUDE_H
+#define INCLUDE_PRELUDE_H
+
+//  Functions, macros and constants implemented in MAL, which stepA_mal
+//  installs at startup. These are also pre-read into Embedded.cpp by mkembed.
+
+static const char* malFunctionTable[] = {
+    "(def! *host-language* \"C++\")",
+};
+
+#endif // INCLUDE_PRELUDE_H
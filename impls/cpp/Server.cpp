@@ -0,0 +1,122 @@
+#include "Server.h"
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+bool malServer::serve(const String& path, Handler handler)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Error: the socket path " << path << " is too long\n";
+        return false;
+    }
+    strcpy(address.sun_path, path.c_str());
+
+    // A socket left by a daemon that was killed is replaced.
+    struct stat status;
+    if (stat(path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode)) {
+        unlink(path.c_str());
+    }
+    // Each request runs with the daemon's rights, so only its owner may
+    // connect: the socket is made 0600 as it is bound, rather than changed
+    // afterwards, when another user could already have connected.
+    mode_t mask = umask(0177);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool isListening = listener >= 0
+        && bind(listener, (sockaddr*)&address, sizeof(address)) == 0
+        && listen(listener, SOMAXCONN) == 0;
+    umask(mask);
+    if (!isListening) {
+        std::cerr << "Error: can't listen on " << path << ", "
+                  << strerror(errno) << "\n";
+        return false;
+    }
+
+    // The children are reaped as they exit.
+    signal(SIGCHLD, SIG_IGN);
+    while (true) {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            std::cerr << "Error: can't accept on " << path << ", "
+                      << strerror(errno) << "\n";
+            return false;
+        }
+        // Anything still buffered would be written again by the child.
+        std::cout.flush();
+        fflush(stdout);
+        pid_t child = fork();
+        if (child == 0) {
+            close(listener);
+            serveChild(connection, handler);
+        }
+        if (child < 0) {
+            std::cerr << "Error: can't fork for a request, "
+                      << strerror(errno) << "\n";
+        }
+        close(connection);
+    }
+}
+
+void malServer::serveChild(int connection, Handler handler)
+{
+    String text;
+    char buffer[4096];
+    ssize_t got;
+    while ((got = read(connection, buffer, sizeof(buffer))) > 0) {
+        text.append(buffer, got);
+    }
+
+    Request request;
+    size_t start = 0, end;
+    bool isArg = false;
+    while ((end = text.find('\0', start)) != String::npos) {
+        String field = text.substr(start, end - start);
+        start = end + 1;
+        if (!isArg) {
+            request.directory = field;
+            isArg = true;
+        }
+        else if (field.empty()) {
+            break;
+        }
+        else {
+            request.args.push_back(field);
+        }
+    }
+    if (end == String::npos) {
+        // The client went away, or isn't malclient.
+        _exit(1);
+    }
+    request.input = text.substr(start);
+
+    dup2(connection, STDIN_FILENO);
+    dup2(connection, STDOUT_FILENO);
+    dup2(connection, STDERR_FILENO);
+    close(connection);
+    if (chdir(request.directory.c_str()) < 0) {
+        std::cerr << "Error: can't change to " << request.directory << ", "
+                  << strerror(errno) << "\n";
+        _exit(1);
+    }
+
+    handler(request);
+
+    // Nothing the daemon would do at exit is wanted here.
+    std::cout.flush();
+    std::cerr.flush();
+    fflush(stdout);
+    _exit(0);
+}
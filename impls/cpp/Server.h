@@ -0,0 +1,35 @@
+#ifndef INCLUDE_SERVER_H
+#define INCLUDE_SERVER_H
+
+#include "String.h"
+
+// The daemon run by stepA_mal --serve, which keeps a warm interpreter and
+// serves each request in a child forked from it, so that one request sees
+// nothing another did. malclient sends the requests.
+//
+// A request is the client's working directory, then the script to run and
+// its arguments, each ended by a NUL, then an empty field. If there is no
+// script, the rest of the request is mal source to run in its place. The
+// client then shuts down its side of the connection, and reads what the
+// request writes to stdout and stderr until the child closes it.
+class malServer {
+public:
+    struct Request {
+        String    directory;
+        StringVec args;
+        String    input;
+    };
+
+    // Runs in the child, with the connection as its stdin, stdout and
+    // stderr, and in the client's directory.
+    typedef void (*Handler)(const Request& request);
+
+    // Listens on the Unix socket at path, until the daemon is killed.
+    // Returns false, having said why, if it can't.
+    static bool serve(const String& path, Handler handler);
+
+private:
+    [[noreturn]] static void serveChild(int connection, Handler handler);
+};
+
+#endif // INCLUDE_SERVER_H
@@ -6,6 +6,12 @@
 #include <memory>
 #include <typeinfo>
 
+//  The item array of a sequence or record, for malMemory.
+static size_t itemBytes(const malValueVec* items)
+{
+    return sizeof(malValueVec) + items->capacity() * sizeof(malValuePtr);
+}
+
 namespace mal {
     malValuePtr atom(malValuePtr value) {
         return malValuePtr(new malAtom(value));
@@ -48,7 +54,19 @@ namespace mal {
 
     malValuePtr lambda(const StringVec& bindings,
                        malValuePtr body, malEnvPtr env) {
-        return malValuePtr(new malLambda(bindings, body, env));
+        malValueVec* params = new malValueVec;
+        for (auto& binding : bindings) {
+            params->push_back(symbol(binding));
+        }
+        return lambda(vector(params), body, env);
+    }
+
+    malValuePtr lambda(malValuePtr params, malValuePtr body, malEnvPtr env) {
+        return malValuePtr(new malLambda(params, body, env));
+    }
+
+    malValuePtr lambda(const malLambda::Arities& arities, malEnvPtr env) {
+        return malValuePtr(new malLambda(arities, env));
     }
 
     malValuePtr list(malValueVec* items) {
@@ -84,11 +102,27 @@ namespace mal {
         return malValuePtr(new malLambda(lambda, true));
     };
 
+    malValuePtr multiMethod(const String& name, malValuePtr dispatchFn) {
+        return malValuePtr(new malMultiMethod(name, dispatchFn));
+    }
+
     malValuePtr nilValue() {
         static malValuePtr c(new malConstant("nil"));
         return malValuePtr(c);
     };
 
+    malValuePtr protocolMethod(malValuePtr protocol, malValuePtr method) {
+        return malValuePtr(new malProtocolMethod(protocol, method));
+    }
+
+    malValuePtr record(malValuePtr type, malValueVec* slots) {
+        return malValuePtr(new malRecord(type, slots));
+    }
+
+    malValuePtr recordType(const String& name, const malValueVec& fields) {
+        return malValuePtr(new malRecordType(name, fields));
+    }
+
     malValuePtr string(const String& token) {
         return malValuePtr(new malString(token));
     }
@@ -97,11 +131,65 @@ namespace mal {
         return malValuePtr(new malSymbol(token));
     };
 
+    malValuePtr tailCall(malValuePtr op,
+                         malValueIter argsBegin, malValueIter argsEnd) {
+        return malValuePtr(new malTailCall(op, argsBegin, argsEnd));
+    }
+
     malValuePtr trueValue() {
         static malValuePtr c(new malConstant("true"));
         return malValuePtr(c);
     };
 
+    //  The same as find-type in lib/protocols.mal, but without creating a
+    //  new keyword each time. Records are typed by their defrecord name.
+    malValuePtr typeOf(malValuePtr obj) {
+        static malValuePtr symbolType(keyword(":mal/symbol"));
+        static malValuePtr keywordType(keyword(":mal/keyword"));
+        static malValuePtr atomType(keyword(":mal/atom"));
+        static malValuePtr nilType(keyword(":mal/nil"));
+        static malValuePtr booleanType(keyword(":mal/boolean"));
+        static malValuePtr numberType(keyword(":mal/number"));
+        static malValuePtr stringType(keyword(":mal/string"));
+        static malValuePtr macroType(keyword(":mal/macro"));
+        static malValuePtr listType(keyword(":mal/list"));
+        static malValuePtr vectorType(keyword(":mal/vector"));
+        static malValuePtr mapType(keyword(":mal/map"));
+        static malValuePtr functionType(keyword(":mal/function"));
+        static malValuePtr typeKey(keyword(":type"));
+
+        if (DYNAMIC_CAST(malSymbol, obj))   { return symbolType; }
+        if (DYNAMIC_CAST(malKeyword, obj))  { return keywordType; }
+        if (DYNAMIC_CAST(malAtom, obj))     { return atomType; }
+        if (obj == nilValue())              { return nilType; }
+        if (obj == trueValue() || obj == falseValue()) {
+            return booleanType;
+        }
+        if (DYNAMIC_CAST(malInteger, obj))  { return numberType; }
+        if (DYNAMIC_CAST(malString, obj))   { return stringType; }
+
+        const malApplicable* f = DYNAMIC_CAST(malApplicable, obj);
+        if (f && f->isMacro()) {
+            return macroType;
+        }
+
+        malValuePtr meta = obj->meta();
+        if (const malHash* hash = DYNAMIC_CAST(malHash, meta)) {
+            malValuePtr type = hash->get(typeKey);
+            if (DYNAMIC_CAST(malKeyword, type)) {
+                return type;
+            }
+        }
+        if (const malRecord* r = DYNAMIC_CAST(malRecord, obj)) {
+            return STATIC_CAST(malRecordType, r->getType())->getType();
+        }
+        if (DYNAMIC_CAST(malList, obj))     { return listType; }
+        if (DYNAMIC_CAST(malVector, obj))   { return vectorType; }
+        if (DYNAMIC_CAST(malHash, obj))     { return mapType; }
+        if (f)                              { return functionType; }
+        MAL_FAIL("unknown MAL value in protocols");
+    }
+
     malValuePtr vector(malValueVec* items) {
         return malValuePtr(new malVector(items));
     };
@@ -114,7 +202,184 @@ namespace mal {
 malValuePtr malBuiltIn::apply(malValueIter argsBegin,
                               malValueIter argsEnd) const
 {
-    return m_handler(m_name, argsBegin, argsEnd);
+    malValuePtr result = call(argsBegin, argsEnd);
+    if (malError::isRaised(result)) {
+        malError::rethrow();
+    }
+    if (const malTailCall* tail = DYNAMIC_CAST(malTailCall, result)) {
+        malValueVec args(tail->args());
+        return APPLY(tail->op(), args.begin(), args.end());
+    }
+    return result;
+}
+
+const malValuePtr malError::s_raised(new malError);
+malException malError::s_pending(malException::message(String()));
+
+malValuePtr malError::raise(const malException& error)
+{
+    s_pending = error;
+    s_pending.captureBacktrace();
+    return s_raised;
+}
+
+malValuePtr malError::take()
+{
+    malValuePtr value = s_pending.value();
+    s_pending = malException::message(String());
+    return value;
+}
+
+void malError::rethrow()
+{
+    malException error(s_pending);
+    s_pending = malException::message(String());
+    throw error;
+}
+
+// Only the innermost frames are kept, so that deep recursion stays cheap
+// to report.
+static const int MAX_BACKTRACE = 16;
+
+malCallFrame* malCallFrame::s_top = NULL;
+
+malException malException::thrown(malValuePtr value)
+{
+    malException error(THROWN);
+    error.m_value = value;
+    return error;
+}
+
+malException malException::message(const String& text)
+{
+    malException error(MESSAGE);
+    error.m_text = text;
+    return error;
+}
+
+malException malException::wrongType(malValuePtr value, const char* typeName)
+{
+    malException error(WRONG_TYPE);
+    error.m_value = value;
+    error.m_text = typeName;
+    return error;
+}
+
+malException malException::argCount(const char* name,
+                                    int min, int max, int got)
+{
+    malException error(ARG_COUNT);
+    error.m_text = name;
+    error.m_min = min;
+    error.m_max = max;
+    error.m_got = got;
+    return error;
+}
+
+malException malException::exhausted(const char* limit, const String& text)
+{
+    malException error(EXHAUSTED);
+    error.m_value = mal::keyword(STRF(":%s", limit));
+    error.m_text = text;
+    return error;
+}
+
+malValuePtr malException::value() const
+{
+    if (m_kind == EXHAUSTED) {
+        malValueVec items = {
+            mal::keyword(":exhausted"), m_value,
+            mal::keyword(":message"),   mal::string(m_text),
+        };
+        return mal::hash(items.begin(), items.end(), true);
+    }
+    return m_kind == THROWN ? m_value : mal::string(message());
+}
+
+String malException::message() const
+{
+    switch (m_kind) {
+        case THROWN:
+            return m_value->print(true);
+        case WRONG_TYPE:
+            return STRF("%s is not a %s",
+                        m_value->print(true).c_str(), m_text.c_str());
+        case ARG_COUNT:
+            if (m_min == m_max) {
+                return STRF("\"%s\" expects %d arg%s, %d supplied",
+                            m_text.c_str(), m_min, PLURAL(m_min), m_got);
+            }
+            if (m_max < 0) {
+                return STRF("\"%s\" expects at least %d arg%s, %d supplied",
+                            m_text.c_str(), m_min, PLURAL(m_min), m_got);
+            }
+            return STRF("\"%s\" expects between %d and %d arg%s, "
+                        "%d supplied",
+                        m_text.c_str(), m_min, m_max, PLURAL(m_max), m_got);
+        default:
+            return m_text;
+    }
+}
+
+void malException::captureBacktrace()
+{
+    const malCallFrame* frame = malCallFrame::top();
+    if (!m_backtrace.empty() || frame == NULL) {
+        return;
+    }
+    const malList* form = DYNAMIC_CAST(malList, frame->form());
+    if (form && !form->isEmpty() && frame->form() != frame->callSite()) {
+        m_backtrace.push_back(frame->form());
+    }
+    for ( ; frame != NULL; frame = frame->caller()) {
+        if (!frame->callSite()) {
+            continue;
+        }
+        if (m_backtrace.size() == MAX_BACKTRACE) {
+            m_isTruncated = true;
+            break;
+        }
+        m_backtrace.push_back(frame->callSite());
+    }
+}
+
+String malException::backtrace() const
+{
+    String out;
+    for (auto& callSite : m_backtrace) {
+        // Name the function by the symbol it was called through, if any.
+        const malList* form = DYNAMIC_CAST(malList, callSite);
+        const malSymbol* name = form && !form->isEmpty()
+                              ? DYNAMIC_CAST(malSymbol, form->item(0)) : NULL;
+        out += STRF("\n  in %s: %s",
+                    name ? name->value().c_str() : "fn*",
+                    callSite->print(true).c_str());
+    }
+    if (m_isTruncated) {
+        out += "\n  ...";
+    }
+    return out;
+}
+
+//  Return true when form is a literal that evaluates to itself, so that it
+//  can be evaluated without allocating anything, and folded into a call.
+//  Only literal types count: an atom or a function that a macro put into
+//  code evaluates to itself too, but what it holds can change.
+bool evaluatesToItself(const malValuePtr& form)
+{
+    if (const malSequence* seq = DYNAMIC_CAST(malSequence, form)) {
+        const malVector* vector = DYNAMIC_CAST(malVector, form);
+        return vector ? vector->isConstant() : seq->isEmpty();
+    }
+    if (const malRecord* record = DYNAMIC_CAST(malRecord, form)) {
+        const malValueVec& slots = record->getSlots();
+        return std::all_of(slots.begin(), slots.end(), evaluatesToItself);
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, form)) {
+        return hash->isConstant();
+    }
+    return DYNAMIC_CAST(malInteger, form) || DYNAMIC_CAST(malString, form) ||
+           DYNAMIC_CAST(malKeyword, form) || DYNAMIC_CAST(malConstant, form);
 }
 
 static String makeHashKey(malValuePtr key)
@@ -149,18 +414,41 @@ static malHash::Map createMap(malValueIter argsBegin, malValueIter argsEnd)
     return addToMap(map, argsBegin, argsEnd);
 }
 
+//  The entries of a hash-map, each a node of a tree holding a key and a
+//  value, for malMemory.
+static size_t entryBytes(const malHash::Map& map)
+{
+    return map.size() * (sizeof(malHash::Map::value_type) + 4 * sizeof(void*));
+}
+
 malHash::malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated)
 : m_map(createMap(argsBegin, argsEnd))
 , m_isEvaluated(isEvaluated)
+, m_constness(isEvaluated ? CONSTANT : UNKNOWN)
 {
-
+    malMemory::add(entryBytes(m_map), malMemory::hashEntries());
 }
 
 malHash::malHash(const malHash::Map& map)
 : m_map(map)
 , m_isEvaluated(true)
+, m_constness(CONSTANT)
 {
+    malMemory::add(entryBytes(m_map), malMemory::hashEntries());
+}
 
+malHash::malHash(const malHash& that, malValuePtr meta)
+: malValue(meta)
+, m_map(that.m_map)
+, m_isEvaluated(that.m_isEvaluated)
+, m_constness(that.m_constness)
+{
+    malMemory::add(entryBytes(m_map), malMemory::hashEntries());
+}
+
+malHash::~malHash()
+{
+    malMemory::remove(entryBytes(m_map), malMemory::hashEntries());
 }
 
 malValuePtr
@@ -192,7 +480,7 @@ malHash::dissoc(malValueIter argsBegin, malValueIter argsEnd) const
 
 malValuePtr malHash::eval(malEnvPtr env)
 {
-    if (m_isEvaluated) {
+    if (isConstant()) {
         return malValuePtr(this);
     }
 
@@ -203,6 +491,20 @@ malValuePtr malHash::eval(malEnvPtr env)
     return mal::hash(map);
 }
 
+bool malHash::isConstant() const
+{
+    if (m_constness == UNKNOWN) {
+        m_constness = CONSTANT;
+        for (auto it = m_map.begin(), end = m_map.end(); it != end; ++it) {
+            if (!evaluatesToItself(it->second)) {
+                m_constness = NOT_CONSTANT;
+                break;
+            }
+        }
+    }
+    return m_constness == CONSTANT;
+}
+
 malValuePtr malHash::get(malValuePtr key) const
 {
     auto it = m_map.find(makeHashKey(key));
@@ -270,20 +572,189 @@ bool malHash::doIsEqualTo(const malValue* rhs) const
     return true;
 }
 
-malLambda::malLambda(const StringVec& bindings,
+malRecordType::malRecordType(const String& name, const malValueVec& fields)
+: m_name(name)
+, m_type(mal::keyword(":" + name))
+, m_fields(fields)
+{
+    for (int i = 0, count = m_fields.size(); i < count; i++) {
+        const malKeyword* field = VALUE_CAST(malKeyword, m_fields[i]);
+        MAL_CHECK(m_slots.insert(std::make_pair(field->value(), i)).second,
+                  "Duplicate field %s in record %s",
+                  field->value().c_str(), name.c_str());
+    }
+}
+
+malRecordType::malRecordType(const malRecordType& that, malValuePtr meta)
+: malApplicable(meta)
+, m_name(that.m_name)
+, m_type(that.m_type)
+, m_fields(that.m_fields)
+, m_slots(that.m_slots)
+{
+
+}
+
+malValuePtr malRecordType::apply(malValueIter argsBegin,
+                                 malValueIter argsEnd) const
+{
+    checkArgsIs(("->" + m_name).c_str(), fieldCount(),
+                std::distance(argsBegin, argsEnd));
+    return mal::record(malValuePtr(const_cast<malRecordType*>(this)),
+                       new malValueVec(argsBegin, argsEnd));
+}
+
+malRecord::malRecord(malValuePtr type, malValueVec* slots)
+: m_type(type)
+, m_slots(slots)
+{
+    malMemory::add(itemBytes(m_slots), malMemory::sequenceItems());
+}
+
+malRecord::malRecord(const malRecord& that, malValuePtr meta)
+: malHash(meta)
+, m_type(that.m_type)
+, m_slots(new malValueVec(*(that.m_slots)))
+{
+    malMemory::add(itemBytes(m_slots), malMemory::sequenceItems());
+}
+
+malRecord::~malRecord()
+{
+    malMemory::remove(itemBytes(m_slots), malMemory::sequenceItems());
+    delete m_slots;
+}
+
+//  The keyword remembers the slot it found for the last record type it
+//  was looked up in, so repeated (get r :field) at one site skip the
+//  search.
+int malRecord::slotOf(malValuePtr key) const
+{
+    const malKeyword* k = DYNAMIC_CAST(malKeyword, key);
+    if (!k) {
+        return -1;
+    }
+    if (k->m_recordType != m_type) {
+        k->m_recordType = m_type;
+        k->m_slot = type()->slotOf(k->value());
+    }
+    return k->m_slot;
+}
+
+malValuePtr malRecord::assoc(malValueIter argsBegin,
+                             malValueIter argsEnd) const
+{
+    MAL_CHECK(std::distance(argsBegin, argsEnd) % 2 == 0,
+            "assoc requires an even-sized list");
+
+    std::unique_ptr<malValueVec> slots(new malValueVec(*m_slots));
+    for (auto it = argsBegin; it != argsEnd; it += 2) {
+        int slot = slotOf(*it);
+        if (slot < 0) {
+            return malHash(toMap()).assoc(argsBegin, argsEnd);
+        }
+        (*slots)[slot] = *(it + 1);
+    }
+    return mal::record(m_type, slots.release());
+}
+
+malValuePtr malRecord::dissoc(malValueIter argsBegin,
+                              malValueIter argsEnd) const
+{
+    return malHash(toMap()).dissoc(argsBegin, argsEnd);
+}
+
+bool malRecord::contains(malValuePtr key) const
+{
+    return slotOf(key) >= 0;
+}
+
+malValuePtr malRecord::get(malValuePtr key) const
+{
+    int slot = slotOf(key);
+    return slot < 0 ? mal::nilValue() : (*m_slots)[slot];
+}
+
+malValuePtr malRecord::keys() const
+{
+    return mal::list(new malValueVec(type()->getFields()));
+}
+
+malValuePtr malRecord::values() const
+{
+    return mal::list(new malValueVec(*m_slots));
+}
+
+malHash::Map malRecord::toMap() const
+{
+    malHash::Map map;
+    const malValueVec& fields = type()->getFields();
+    for (int i = 0, count = fields.size(); i < count; i++) {
+        map[STATIC_CAST(malKeyword, fields[i])->value()] = (*m_slots)[i];
+    }
+    return map;
+}
+
+String malRecord::print(bool readably) const
+{
+    // Printed like a hash-map, but in field order.
+    String s = "{";
+    const malValueVec& fields = type()->getFields();
+    for (int i = 0, count = fields.size(); i < count; i++) {
+        if (i > 0) {
+            s += " ";
+        }
+        s += fields[i]->print(readably) + " " +
+             (*m_slots)[i]->print(readably);
+    }
+    return s + "}";
+}
+
+bool malRecord::doIsEqualTo(const malValue* rhs) const
+{
+    // As in Clojure, records are only equal to records of the same type.
+    const malRecord* r = static_cast<const malRecord*>(rhs);
+    if (r->m_type != m_type) {
+        return false;
+    }
+    for (int i = 0, count = m_slots->size(); i < count; i++) {
+        if (!(*m_slots)[i]->isEqualTo((*r->m_slots)[i].ptr())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+malLambda::malLambda(malValuePtr params,
                      malValuePtr body, malEnvPtr env)
-: m_bindings(bindings)
-, m_body(body)
+: m_arities(1)
 , m_env(env)
 , m_isMacro(false)
 {
+    m_arities[0].params = params;
+    m_arities[0].body = body;
+    buildDispatch();
+    if (m_env) {
+        m_env->markCaptured();
+    }
+}
 
+malLambda::malLambda(const Arities& arities, malEnvPtr env)
+: m_arities(arities)
+, m_env(env)
+, m_isMacro(false)
+{
+    buildDispatch();
+    if (m_env) {
+        m_env->markCaptured();
+    }
 }
 
 malLambda::malLambda(const malLambda& that, malValuePtr meta)
 : malApplicable(meta)
-, m_bindings(that.m_bindings)
-, m_body(that.m_body)
+, m_arities(that.m_arities)
+, m_byCount(that.m_byCount)
+, m_variadic(that.m_variadic)
 , m_env(that.m_env)
 , m_isMacro(that.m_isMacro)
 {
@@ -292,18 +763,63 @@ malLambda::malLambda(const malLambda& that, malValuePtr meta)
 
 malLambda::malLambda(const malLambda& that, bool isMacro)
 : malApplicable(that.m_meta)
-, m_bindings(that.m_bindings)
-, m_body(that.m_body)
+, m_arities(that.m_arities)
+, m_byCount(that.m_byCount)
+, m_variadic(that.m_variadic)
 , m_env(that.m_env)
 , m_isMacro(isMacro)
 {
 
 }
 
+//  Index the fixed arities by argument count, so that getArity doesn't
+//  have to search. As in Clojure, there can be at most one variadic
+//  clause, which must take at least as many arguments as any fixed one.
+void malLambda::buildDispatch()
+{
+    m_variadic = -1;
+    int count = m_arities.size();
+    for (int i = 0; i < count; i++) {
+        Arity& arity = m_arities[i];
+        arity.plan = malBindingPlan::forParams(arity.params);
+        int required = arity.plan->requiredCount();
+        if (arity.plan->isVariadic()) {
+            MAL_CHECK(m_variadic < 0,
+                      "fn* can't have more than one variadic overload");
+            m_variadic = i;
+            continue;
+        }
+        if (required >= (int)m_byCount.size()) {
+            m_byCount.resize(required + 1, -1);
+        }
+        MAL_CHECK(m_byCount[required] < 0,
+                  "fn* can't have two overloads with the same arity");
+        m_byCount[required] = i;
+    }
+    if (m_variadic >= 0) {
+        int required = m_arities[m_variadic].plan->requiredCount();
+        MAL_CHECK(required + 1 >= (int)m_byCount.size(),
+                  "fn* can't have a fixed arity overload with more "
+                  "parameters than the variadic one");
+    }
+}
+
+const malLambda::Arity& malLambda::getVariadic(int argCount) const
+{
+    MAL_CHECK(m_variadic >= 0 &&
+              argCount >= m_arities[m_variadic].plan->requiredCount(),
+              "Wrong number of args (%d) passed to function", argCount);
+    return m_arities[m_variadic];
+}
+
 malValuePtr malLambda::apply(malValueIter argsBegin,
                              malValueIter argsEnd) const
 {
-    return EVAL(m_body, makeEnv(argsBegin, argsEnd));
+    const Arity& arity = getArity(std::distance(argsBegin, argsEnd));
+    malEnvPtr env = makeEnv(arity, argsBegin, argsEnd);
+    malValuePtr result = EVAL(arity.plan->enter(arity.body), env);
+    malEnv::recycle(env);
+    return result;
 }
 
 malValuePtr malLambda::doWithMeta(malValuePtr meta) const
@@ -311,9 +827,162 @@ malValuePtr malLambda::doWithMeta(malValuePtr meta) const
     return new malLambda(*this, meta);
 }
 
+malEnvPtr malLambda::getEnv() const
+{
+    return m_env;
+}
+
 malEnvPtr malLambda::makeEnv(malValueIter argsBegin, malValueIter argsEnd) const
 {
-    return malEnvPtr(new malEnv(m_env, m_bindings, argsBegin, argsEnd));
+    return makeEnv(m_arities[0], argsBegin, argsEnd);
+}
+
+malEnvPtr malLambda::makeEnv(const Arity& arity,
+                             malValueIter argsBegin, malValueIter argsEnd) const
+{
+    malEnvPtr env = arity.plan->bindArgs(m_env, argsBegin, argsEnd);
+    env->setRecurTarget(arity.plan, arity.body);
+    return env;
+}
+
+malValuePtr malDispatcher::apply(malValueIter argsBegin,
+                                 malValueIter argsEnd) const
+{
+    return APPLY(dispatch(argsBegin, argsEnd), argsBegin, argsEnd);
+}
+
+malProtocolMethod::malProtocolMethod(malValuePtr protocol, malValuePtr method)
+: m_protocol(protocol)
+, m_method(method)
+, m_cacheCount(0)
+, m_cacheNext(0)
+{
+    VALUE_CAST(malAtom, protocol);
+    VALUE_CAST(malKeyword, method);
+}
+
+malProtocolMethod::malProtocolMethod(const malProtocolMethod& that,
+                                     malValuePtr meta)
+: malDispatcher(meta)
+, m_protocol(that.m_protocol)
+, m_method(that.m_method)
+, m_cacheCount(0)
+, m_cacheNext(0)
+{
+
+}
+
+malValuePtr malProtocolMethod::dispatch(malValueIter argsBegin,
+                                        malValueIter argsEnd) const
+{
+    MAL_CHECK(argsBegin != argsEnd, "%s needs at least one argument",
+              print(true).c_str());
+
+    malValuePtr map = STATIC_CAST(malAtom, m_protocol)->deref();
+    if (map != m_cachedMap) {
+        m_cachedMap = map;
+        m_cacheCount = 0;
+        m_cacheNext = 0;
+    }
+
+    malValuePtr type = mal::typeOf(*argsBegin);
+    const String& typeName = STATIC_CAST(malKeyword, type)->value();
+    for (int i = 0; i < m_cacheCount; i++) {
+        if (m_cache[i].type == typeName) {
+            return m_cache[i].impl;
+        }
+    }
+
+    malValuePtr impl;
+    if (const malHash* types = DYNAMIC_CAST(malHash, map)) {
+        if (const malHash* methods = DYNAMIC_CAST(malHash, types->get(type))) {
+            impl = methods->get(m_method);
+        }
+    }
+    MAL_CHECK(impl && impl != mal::nilValue(),
+              "No implementation of %s for type %s",
+              m_method->print(true).c_str(), typeName.c_str());
+
+    // Replace the entries round-robin once the cache is full.
+    CacheEntry& entry = m_cache[m_cacheNext];
+    entry.type = typeName;
+    entry.impl = impl;
+    m_cacheNext = (m_cacheNext + 1) % CACHE_SIZE;
+    if (m_cacheCount < CACHE_SIZE) {
+        m_cacheCount++;
+    }
+    return impl;
+}
+
+malMultiMethod::malMultiMethod(const String& name, malValuePtr dispatchFn)
+: m_name(name)
+, m_dispatchFn(dispatchFn)
+, m_cacheCount(0)
+, m_cacheNext(0)
+{
+
+}
+
+malMultiMethod::malMultiMethod(const malMultiMethod& that, malValuePtr meta)
+: malDispatcher(meta)
+, m_name(that.m_name)
+, m_dispatchFn(that.m_dispatchFn)
+, m_methods(that.m_methods)
+, m_cacheCount(0)
+, m_cacheNext(0)
+{
+
+}
+
+void malMultiMethod::addMethod(malValuePtr dispatchValue, malValuePtr method)
+{
+    m_methods[dispatchValue->print(true)] = std::make_pair(dispatchValue,
+                                                           method);
+    m_cacheCount = 0;
+    m_cacheNext = 0;
+}
+
+malValuePtr malMultiMethod::dispatch(malValueIter argsBegin,
+                                     malValueIter argsEnd) const
+{
+    malValuePtr value;
+    if (DYNAMIC_CAST(malKeyword, m_dispatchFn)) {
+        MAL_CHECK(argsBegin != argsEnd, "%s needs at least one argument",
+                  print(true).c_str());
+        const malHash* hash = DYNAMIC_CAST(malHash, *argsBegin);
+        value = hash ? hash->get(m_dispatchFn) : mal::nilValue();
+    }
+    else {
+        value = APPLY(m_dispatchFn, argsBegin, argsEnd);
+    }
+
+    for (int i = 0; i < m_cacheCount; i++) {
+        if (m_cache[i].value->isEqualTo(value.ptr())) {
+            return m_cache[i].method;
+        }
+    }
+
+    malValuePtr method = findMethod(value);
+    CacheEntry& entry = m_cache[m_cacheNext];
+    entry.value = value;
+    entry.method = method;
+    m_cacheNext = (m_cacheNext + 1) % CACHE_SIZE;
+    if (m_cacheCount < CACHE_SIZE) {
+        m_cacheCount++;
+    }
+    return method;
+}
+
+malValuePtr malMultiMethod::findMethod(malValuePtr dispatchValue) const
+{
+    auto it = m_methods.find(dispatchValue->print(true));
+    if (it == m_methods.end()) {
+        it = m_methods.find(":default");
+    }
+    MAL_CHECK(it != m_methods.end(),
+              "No method in multimethod %s for dispatch value %s",
+              m_name.c_str(), dispatchValue->print(true).c_str());
+    return it->second.second;
 }
 
 malValuePtr malList::conj(malValueIter argsBegin,
@@ -329,6 +998,102 @@ malValuePtr malList::conj(malValueIter argsBegin,
     return mal::list(items);
 }
 
+malValuePtr malList::expandMacro(malValuePtr macro) const
+{
+    if (macro != m_op) {
+        const malApplicable* expander = STATIC_CAST(malApplicable, macro);
+        m_value = expander->apply(begin() + 1, end());
+        m_op = macro;
+    }
+    return m_value;
+}
+
+malValuePtr malList::foldCall(malValuePtr op) const
+{
+    // Only pure builtins are remembered, whether or not the call folds,
+    // so that later evaluations of the call don't look again.
+    const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
+    if (!handler || !handler->isPure()) {
+        return NULL;
+    }
+    m_op = op;
+    m_value = NULL;
+    m_intOp = INT_OP_NONE;
+    m_isGeneric = false;
+    if (std::all_of(begin() + 1, end(), evaluatesToItself)) {
+        try {
+            m_value = STATIC_CAST(malBuiltIn, op)->call(begin() + 1, end());
+        }
+        catch (malException&) {
+        }
+        catch (String&) {
+        }
+        if (malError::isRaised(m_value)) {
+            // Leave the error to be raised each time the call is made.
+            malError::take();
+            m_value = NULL;
+        }
+    }
+    return m_value;
+}
+
+static bool isInteger(const malValuePtr& value)
+{
+    // Cheaper than a dynamic_cast, since nothing derives from malInteger.
+    return typeid(*value.ptr()) == typeid(malInteger);
+}
+
+void malList::recordFirstCall(malValuePtr op, const malValueVec& args) const
+{
+    const malBuiltIn* builtin = op == m_op ? DYNAMIC_CAST(malBuiltIn, op)
+                                           : NULL;
+    if (builtin && builtin->intOp() != INT_OP_NONE && args.size() == 2 &&
+        DYNAMIC_CAST(malSymbol, item(0)) &&
+        isInteger(args[0]) && isInteger(args[1])) {
+        m_intOp = builtin->intOp();
+    }
+    else {
+        m_isGeneric = true;
+    }
+}
+
+malValuePtr malList::callIntegers(const malValueVec& args) const
+{
+    if (!isInteger(args[0]) || !isInteger(args[1])) {
+        m_intOp = INT_OP_NONE;
+        m_isGeneric = true;
+        return NULL;
+    }
+    int64_t lhs = STATIC_CAST(malInteger, args[0])->value();
+    int64_t rhs = STATIC_CAST(malInteger, args[1])->value();
+    switch (m_intOp) {
+        case INT_OP_ADD:    return mal::integer(lhs + rhs);
+        case INT_OP_SUB:    return mal::integer(lhs - rhs);
+        case INT_OP_MUL:    return mal::integer(lhs * rhs);
+        // Leave division by zero for the builtin to raise.
+        case INT_OP_DIV:    if (rhs) return mal::integer(lhs / rhs); break;
+        case INT_OP_MOD:    if (rhs) return mal::integer(lhs % rhs); break;
+        case INT_OP_LT:     return mal::boolean(lhs < rhs);
+        case INT_OP_LE:     return mal::boolean(lhs <= rhs);
+        case INT_OP_GT:     return mal::boolean(lhs > rhs);
+        case INT_OP_GE:     return mal::boolean(lhs >= rhs);
+        case INT_OP_EQ:     return mal::boolean(lhs == rhs);
+        case INT_OP_NONE:   break;
+    }
+    return NULL;
+}
+
+bool malGuard::holds() const
+{
+    for (auto& assumption : m_assumptions) {
+        if (assumption.name->isLocal() ||
+            (assumption.cell && *assumption.cell != assumption.value)) {
+            return false;
+        }
+    }
+    return true;
+}
+
 malValuePtr malList::eval(malEnvPtr env)
 {
     // Note, this isn't actually called since the TCO updates, but
@@ -383,27 +1148,38 @@ malValuePtr malValue::withMeta(malValuePtr meta) const
 malSequence::malSequence(malValueVec* items)
 : m_items(items)
 {
-
+    malMemory::add(itemBytes(m_items), malMemory::sequenceItems());
 }
 
 malSequence::malSequence(malValueIter begin, malValueIter end)
 : m_items(new malValueVec(begin, end))
 {
-
+    malMemory::add(itemBytes(m_items), malMemory::sequenceItems());
 }
 
 malSequence::malSequence(const malSequence& that, malValuePtr meta)
 : malValue(meta)
 , m_items(new malValueVec(*(that.m_items)))
 {
-
+    malMemory::add(itemBytes(m_items), malMemory::sequenceItems());
 }
 
 malSequence::~malSequence()
 {
+    malMemory::remove(itemBytes(m_items), malMemory::sequenceItems());
     delete m_items;
 }
 
+malBindingPlanPtr malSequence::bindingPlan() const
+{
+    return m_plan;
+}
+
+void malSequence::setBindingPlan(malBindingPlanPtr plan) const
+{
+    m_plan = plan;
+}
+
 bool malSequence::doIsEqualTo(const malValue* rhs) const
 {
     const malSequence* rhsSeq = static_cast<const malSequence*>(rhs);
@@ -469,9 +1245,42 @@ String malString::print(bool readably) const
     return readably ? escapedValue() : value();
 }
 
+malSymbol::malSymbol(const String& token)
+: malStringBase(token)
+, m_name(malName::intern(token))
+, m_cell(NULL)
+, m_cellVersion(0)
+{
+
+}
+
+malSymbol::malSymbol(const malSymbol& that, malValuePtr meta)
+: malStringBase(that, meta)
+, m_name(that.m_name)
+, m_cell(NULL)
+, m_cellVersion(0)
+{
+
+}
+
 malValuePtr malSymbol::eval(malEnvPtr env)
 {
-    return env->get(value());
+    malValuePtr value = lookup(env);
+    MAL_CHECK(value, "'%s' not found", this->value().c_str());
+    return value;
+}
+
+//  Return the value bound to this symbol, else NULL.
+malValuePtr malSymbol::lookup(malEnvPtr env) const
+{
+    if (m_name->isLocal()) {
+        return env->lookup(m_name);
+    }
+    if (m_cellVersion != malEnv::globalVersion()) {
+        m_cell = env->globalCell(value());
+        m_cellVersion = malEnv::globalVersion();
+    }
+    return m_cell ? *m_cell : malValuePtr();
 }
 
 malValuePtr malVector::conj(malValueIter argsBegin,
@@ -489,9 +1298,21 @@ malValuePtr malVector::conj(malValueIter argsBegin,
 
 malValuePtr malVector::eval(malEnvPtr env)
 {
+    if (isConstant()) {
+        return malValuePtr(this);
+    }
     return mal::vector(evalItems(env));
 }
 
+bool malVector::isConstant() const
+{
+    if (m_constness == UNKNOWN) {
+        m_constness = std::all_of(begin(), end(), evaluatesToItself)
+                    ? CONSTANT : NOT_CONSTANT;
+    }
+    return m_constness == CONSTANT;
+}
+
 String malVector::print(bool readably) const
 {
     return '[' + malSequence::print(readably) + ']';
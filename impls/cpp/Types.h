@@ -2,9 +2,11 @@
 #define INCLUDE_TYPES_H
 
 #include "MAL.h"
+#include "Memory.h"
 
 #include <exception>
 #include <map>
+#include <unordered_map>
 
 class malEmptyInputException : public std::exception { };
 
@@ -35,14 +37,88 @@ public:
 protected:
     virtual bool doIsEqualTo(const malValue* rhs) const = 0;
 
+    // Whether a vector or hash-map literal evaluates to itself.
+    enum Constness { UNKNOWN, CONSTANT, NOT_CONSTANT };
+
     malValuePtr m_meta;
 };
 
+// An error from mal code or from the interpreter. It is raised through
+// EVAL as a malError, and thrown as a C++ exception where that can't be
+// done. Type and argument count errors keep their operands, and format a
+// message only when asked for one, so a failed cast of a large value costs
+// nothing unless it is printed. The backtrace holds the call sites of the
+// mal calls the error was raised in, innermost first.
+class malException {
+public:
+    enum Kind { THROWN, MESSAGE, WRONG_TYPE, ARG_COUNT, EXHAUSTED };
+
+    static malException thrown(malValuePtr value);
+    static malException message(const String& text);
+    static malException wrongType(malValuePtr value, const char* typeName);
+    // For "at least min" arguments, max is -1.
+    static malException argCount(const char* name, int min, int max, int got);
+    // A limit of malBudget, "fuel" or "deadline", has run out.
+    static malException exhausted(const char* limit, const String& text);
+
+    Kind kind() const { return m_kind; }
+
+    // The value try* binds: the thrown value, a map of :exhausted, the
+    // limit, and :message for EXHAUSTED, or else the message.
+    malValuePtr value() const;
+
+    // The text that follows "Error: " at the REPL.
+    String message() const;
+
+    // One line for each frame, or nothing if there are none.
+    String backtrace() const;
+    void   captureBacktrace();
+
+private:
+    malException(Kind kind)
+    : m_kind(kind), m_min(0), m_max(0), m_got(0), m_isTruncated(false) { }
+
+    Kind        m_kind;
+    malValuePtr m_value;    // for THROWN, WRONG_TYPE and EXHAUSTED
+    String      m_text;     // the message, type name or function name
+    int         m_min, m_max, m_got;
+    malValueVec m_backtrace;
+    bool        m_isTruncated;
+};
+
+// The mal call in progress in one of EVAL's C++ frames. Each frame links
+// itself on to a stack as EVAL starts and off as it returns, and records
+// the form which called the function whose body it is running, so that an
+// error can capture a backtrace without any searching. The frame also sees
+// EVAL's current form, which is where an error in the innermost frame was
+// raised.
+class malCallFrame {
+public:
+    malCallFrame(const malValuePtr& form)
+    : m_caller(s_top), m_form(form) { s_top = this; }
+    ~malCallFrame() { s_top = m_caller; }
+
+    void setCallSite(malValuePtr form) { m_callSite = form; }
+
+    static const malCallFrame* top() { return s_top; }
+    const malCallFrame* caller() const { return m_caller; }
+    malValuePtr         callSite() const { return m_callSite; }
+    malValuePtr         form() const { return m_form; }
+
+private:
+    malCallFrame* const m_caller;
+    const malValuePtr&  m_form;
+    malValuePtr m_callSite;
+
+    static malCallFrame* s_top;
+};
+
 template<class T>
 T* value_cast(malValuePtr obj, const char* typeName) {
     T* dest = dynamic_cast<T*>(obj.ptr());
-    MAL_CHECK(dest != NULL, "%s is not a %s",
-              obj->print(true).c_str(), typeName);
+    if (dest == NULL) {
+        throw malException::wrongType(obj, typeName);
+    }
     return dest;
 }
 
@@ -54,6 +130,7 @@ T* value_cast(malValuePtr obj, const char* typeName) {
     virtual malValuePtr doWithMeta(malValuePtr meta) const { \
         return new Type(*this, meta); \
     } \
+    WITH_ACCOUNTING(Type)
 
 class malConstant : public malValue {
 public:
@@ -98,13 +175,20 @@ private:
 class malStringBase : public malValue {
 public:
     malStringBase(const String& token)
-        : m_value(token) { }
+        : m_value(token) {
+        malMemory::add(m_value.size(), malMemory::strings());
+    }
     malStringBase(const malStringBase& that, malValuePtr meta)
-        : malValue(meta), m_value(that.value()) { }
+        : malValue(meta), m_value(that.value()) {
+        malMemory::add(m_value.size(), malMemory::strings());
+    }
+    ~malStringBase() {
+        malMemory::remove(m_value.size(), malMemory::strings());
+    }
 
     virtual String print(bool readably) const { return m_value; }
 
-    String value() const { return m_value; }
+    const String& value() const { return m_value; }
 
 private:
     const String m_value;
@@ -131,31 +215,46 @@ public:
 class malKeyword : public malStringBase {
 public:
     malKeyword(const String& token)
-        : malStringBase(token) { }
+        : malStringBase(token), m_slot(-1) { }
     malKeyword(const malKeyword& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+        : malStringBase(that, meta), m_slot(-1) { }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malKeyword*>(rhs)->value();
     }
 
     WITH_META(malKeyword);
+
+private:
+    friend class malRecord;
+
+    // Inline cache for record field lookups, see malRecord::get. Each
+    // keyword in the source is its own object, so this caches per site.
+    mutable malValuePtr m_recordType;
+    mutable int         m_slot;
 };
 
 class malSymbol : public malStringBase {
 public:
-    malSymbol(const String& token)
-        : malStringBase(token) { }
-    malSymbol(const malSymbol& that, malValuePtr meta)
-        : malStringBase(that, meta) { }
+    malSymbol(const String& token);
+    malSymbol(const malSymbol& that, malValuePtr meta);
 
     virtual malValuePtr eval(malEnvPtr env);
+    malValuePtr lookup(malEnvPtr env) const;
+
+    const malName* name() const { return m_name; }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return value() == static_cast<const malSymbol*>(rhs)->value();
     }
 
     WITH_META(malSymbol);
+
+private:
+    // Inline cache for lookups of global names, see malName::isLocal.
+    const malName*              m_name;
+    mutable const malValuePtr*  m_cell;
+    mutable unsigned            m_cellVersion;
 };
 
 class malSequence : public malValue {
@@ -183,17 +282,49 @@ public:
     malValuePtr first() const;
     virtual malValuePtr rest() const;
 
+    // Set by malBindingPlan, when this is a fn* or let* binding form.
+    malBindingPlanPtr bindingPlan() const;
+    void setBindingPlan(malBindingPlanPtr plan) const;
+
 private:
     malValueVec* const m_items;
+    mutable malBindingPlanPtr m_plan;
+};
+
+// The builtins which a call site can specialise for two integers, see
+// malList::callIntegers.
+enum malIntOp {
+    INT_OP_NONE,
+    INT_OP_ADD, INT_OP_SUB, INT_OP_MUL, INT_OP_DIV, INT_OP_MOD,
+    INT_OP_LT, INT_OP_LE, INT_OP_GT, INT_OP_GE, INT_OP_EQ,
+};
+
+// What kind of form a list is, which EVAL works out the first time it
+// evaluates it, see malList::nodeKind.
+enum malNodeKind {
+    NODE_UNKNOWN,
+    NODE_DEF, NODE_DEFMACRO, NODE_DO, NODE_FN, NODE_IF, NODE_LET, NODE_LOOP,
+    NODE_MACROEXPAND, NODE_QUASIQUOTE, NODE_QUOTE, NODE_RECUR, NODE_TRY,
+    NODE_AND,           // a call through a symbol that finds the builtin and
+    NODE_OR,            // or or, see isBuiltinMacro
+    NODE_GUARD,         // (guard optimised original)
+    NODE_COMPILED,      // (compiled)
+    NODE_CALL,          // a call through anything but a symbol
+    NODE_SYMBOL_CALL,   // a call through a symbol
+    NODE_BUILTIN_CALL,  // a call through a symbol that finds a builtin
 };
 
 class malList : public malSequence {
 public:
-    malList(malValueVec* items) : malSequence(items) { }
+    malList(malValueVec* items)
+        : malSequence(items), m_intOp(INT_OP_NONE), m_isGeneric(false)
+        , m_kind(NODE_UNKNOWN) { }
     malList(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(begin, end),
+          m_intOp(INT_OP_NONE), m_isGeneric(false), m_kind(NODE_UNKNOWN) { }
     malList(const malList& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+        : malSequence(that, meta),
+          m_intOp(INT_OP_NONE), m_isGeneric(false), m_kind(NODE_UNKNOWN) { }
 
     virtual String print(bool readably) const;
     virtual malValuePtr eval(malEnvPtr env);
@@ -201,24 +332,102 @@ public:
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
+    // The expansion is made once, and kept for as long as macro is the
+    // operator.
+    malValuePtr expandMacro(malValuePtr macro) const;
+    bool isExpandedBy(const malValuePtr& macro) const {
+        return macro.ptr() == m_op.ptr();
+    }
+
+    // Returns the value of this call to a pure builtin, if its arguments
+    // are all constants, else NULL. The value is computed once, and kept
+    // for as long as op is the operator, so redefining or shadowing the
+    // builtin's name is seen.
+    malValuePtr fold(malValuePtr op) const {
+        return op == m_op ? m_value : foldCall(op);
+    }
+
+    // Type feedback for calls to the arithmetic and comparison builtins.
+    // A call through a symbol records the arguments it first passes to its
+    // pure builtin, and if they were two integers, and the builtin has an
+    // integer operation, it becomes an integer call, which EVAL spots
+    // before the special forms. While the symbol still finds the same
+    // builtin, callIntegers does the operation itself, skipping the
+    // builtin's type and argument count checks. It returns NULL when it
+    // can't, such as for division by zero, and when the arguments aren't
+    // integers the call goes back to calling the builtin for good, or until
+    // its operator changes.
+    bool isIntegerCall() const { return m_intOp != INT_OP_NONE; }
+    bool isIntegerCall(malValuePtr op) const {
+        return m_intOp != INT_OP_NONE && op == m_op;
+    }
+    malValuePtr callIntegers(const malValueVec& args) const;
+    void recordCall(malValuePtr op, const malValueVec& args) const {
+        if (m_intOp == INT_OP_NONE && !m_isGeneric) {
+            recordFirstCall(op, args);
+        }
+    }
+
+    // Self-specialising nodes. A list is rewritten in place, the first
+    // time EVAL evaluates it, into the kind of node it turned out to be, so
+    // that EVAL can switch on its kind rather than look for special forms
+    // by name each time. Lists are immutable, so that only changes for
+    // calls through a symbol: one that found a builtin, which wasn't a
+    // macro, and didn't fold, becomes a builtin call, which calls the
+    // builtin directly while the symbol still finds it, and falls back to
+    // a plain call through a symbol, for good, once it doesn't.
+    malNodeKind nodeKind() const { return m_kind; }
+    void setNodeKind(malNodeKind kind) const { m_kind = kind; }
+    void specialiseBuiltinCall(malValuePtr builtin) const {
+        m_kind = NODE_BUILTIN_CALL;
+        m_op = builtin;
+        m_value = NULL;
+    }
+    bool isBuiltinCall(const malValuePtr& op) const {
+        return op.ptr() == m_op.ptr();
+    }
+
     WITH_META(malList);
+
+private:
+    malValuePtr foldCall(malValuePtr op) const;
+    void recordFirstCall(malValuePtr op, const malValueVec& args) const;
+
+    // Lists are immutable, so a call site's macro expansion, or folded
+    // value, only changes if the operator does. Holding the operator keeps
+    // its address from being reused. These only ever hold macros and
+    // builtins, so they don't keep closures alive.
+    mutable malValuePtr m_op;
+    mutable malValuePtr m_value;
+    mutable malIntOp    m_intOp;
+    mutable bool        m_isGeneric;
+    mutable malNodeKind m_kind;
 };
 
 class malVector : public malSequence {
 public:
-    malVector(malValueVec* items) : malSequence(items) { }
+    malVector(malValueVec* items)
+        : malSequence(items), m_constness(UNKNOWN) { }
     malVector(malValueIter begin, malValueIter end)
-        : malSequence(begin, end) { }
+        : malSequence(begin, end), m_constness(UNKNOWN) { }
     malVector(const malVector& that, malValuePtr meta)
-        : malSequence(that, meta) { }
+        : malSequence(that, meta), m_constness(that.m_constness) { }
 
     virtual malValuePtr eval(malEnvPtr env);
+
+    // True when every item evaluates to itself, so that the vector does
+    // too. This is worked out once, on the vector's first evaluation.
+    bool isConstant() const;
+
     virtual String print(bool readably) const;
 
     virtual malValuePtr conj(malValueIter argsBegin,
                              malValueIter argsEnd) const;
 
     WITH_META(malVector);
+
+private:
+    mutable Constness m_constness;
 };
 
 class malApplicable : public malValue {
@@ -228,6 +437,11 @@ public:
 
     virtual malValuePtr apply(malValueIter argsBegin,
                                malValueIter argsEnd) const = 0;
+
+    virtual bool isMacro() const { return false; }
+
+    // See malList::fold.
+    virtual bool isPure() const { return false; }
 };
 
 class malHash : public malValue {
@@ -236,16 +450,23 @@ public:
 
     malHash(malValueIter argsBegin, malValueIter argsEnd, bool isEvaluated);
     malHash(const malHash::Map& map);
-    malHash(const malHash& that, malValuePtr meta)
-    : malValue(meta), m_map(that.m_map), m_isEvaluated(that.m_isEvaluated) { }
+    malHash(const malHash& that, malValuePtr meta);
+    ~malHash();
 
-    malValuePtr assoc(malValueIter argsBegin, malValueIter argsEnd) const;
-    malValuePtr dissoc(malValueIter argsBegin, malValueIter argsEnd) const;
-    bool contains(malValuePtr key) const;
+    virtual malValuePtr assoc(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+    virtual malValuePtr dissoc(malValueIter argsBegin,
+                               malValueIter argsEnd) const;
+    virtual bool contains(malValuePtr key) const;
     malValuePtr eval(malEnvPtr env);
-    malValuePtr get(malValuePtr key) const;
-    malValuePtr keys() const;
-    malValuePtr values() const;
+    virtual malValuePtr get(malValuePtr key) const;
+    virtual malValuePtr keys() const;
+    virtual malValuePtr values() const;
+
+    bool isEvaluated() const { return m_isEvaluated; }
+
+    // As for malVector. Evaluated hash-maps are always constant.
+    bool isConstant() const;
 
     virtual String print(bool readably) const;
 
@@ -253,9 +474,93 @@ public:
 
     WITH_META(malHash);
 
+protected:
+    // For malRecord, which keeps its entries elsewhere.
+    malHash() : m_isEvaluated(true), m_constness(CONSTANT) { }
+    malHash(malValuePtr meta)
+    : malValue(meta), m_isEvaluated(true), m_constness(CONSTANT) { }
+
 private:
     const Map m_map;
     const bool m_isEvaluated;
+    mutable Constness m_constness;
+};
+
+// The shape shared by all the records made by one defrecord: the record's
+// name and its field keywords, in order. This is also the ->Name function,
+// which makes a record from one argument per field.
+class malRecordType : public malApplicable {
+public:
+    malRecordType(const String& name, const malValueVec& fields);
+    malRecordType(const malRecordType& that, malValuePtr meta);
+
+    virtual malValuePtr apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    // The slot holding the field, or -1 if there isn't one.
+    int slotOf(const String& key) const {
+        auto it = m_slots.find(key);
+        return it == m_slots.end() ? -1 : it->second;
+    }
+
+    const String&      getName() const { return m_name; }
+    malValuePtr        getType() const { return m_type; }
+    const malValueVec& getFields() const { return m_fields; }
+    int                fieldCount() const { return m_fields.size(); }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    virtual String print(bool readably) const {
+        return STRF("#record-type(%s)", m_name.c_str());
+    }
+
+    WITH_META(malRecordType);
+
+private:
+    const String                         m_name;
+    const malValuePtr                    m_type;   // the keyword :Name
+    const malValueVec                    m_fields;
+    std::unordered_map<String, int>      m_slots;  // keyed by ":field"
+};
+
+// A hash-map with a fixed set of keyword keys, whose values are held in
+// an array of slots laid out by a shared malRecordType. Associating an
+// existing field keeps the record's type, anything else makes a malHash.
+class malRecord : public malHash {
+public:
+    malRecord(malValuePtr type, malValueVec* slots);
+    malRecord(const malRecord& that, malValuePtr meta);
+    ~malRecord();
+
+    virtual malValuePtr assoc(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+    virtual malValuePtr dissoc(malValueIter argsBegin,
+                               malValueIter argsEnd) const;
+    virtual bool contains(malValuePtr key) const;
+    virtual malValuePtr get(malValuePtr key) const;
+    virtual malValuePtr keys() const;
+    virtual malValuePtr values() const;
+
+    malValuePtr getType() const { return m_type; }
+    const malValueVec& getSlots() const { return *m_slots; }
+
+    virtual String print(bool readably) const;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const;
+
+    WITH_META(malRecord);
+
+private:
+    const malRecordType* type() const {
+        return static_cast<const malRecordType*>(m_type.ptr());
+    }
+    int slotOf(malValuePtr key) const;
+    malHash::Map toMap() const;
+
+    const malValuePtr  m_type;
+    malValueVec* const m_slots;
 };
 
 class malBuiltIn : public malApplicable {
@@ -264,43 +569,223 @@ public:
                                     malValueIter argsBegin,
                                     malValueIter argsEnd);
 
-    malBuiltIn(const String& name, ApplyFunc* handler)
-    : m_name(name), m_handler(handler) { }
+    malBuiltIn(const String& name, ApplyFunc* handler,
+               bool isMacro = false, bool isPure = false,
+               malIntOp intOp = INT_OP_NONE)
+    : m_name(name), m_handler(handler), m_isMacro(isMacro), m_isPure(isPure)
+    , m_intOp(intOp) { }
 
     malBuiltIn(const malBuiltIn& that, malValuePtr meta)
-    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler) { }
+    : malApplicable(meta), m_name(that.m_name), m_handler(that.m_handler)
+    , m_isMacro(that.m_isMacro), m_isPure(that.m_isPure)
+    , m_intOp(that.m_intOp) { }
 
+    // Makes any tail call the handler returns, see malTailCall.
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
+    // Returns the handler's result as it is, for EVAL.
+    malValuePtr call(malValueIter argsBegin, malValueIter argsEnd) const {
+        return m_handler(m_name, argsBegin, argsEnd);
+    }
+
     virtual String print(bool readably) const {
-        return STRF("#builtin-function(%s)", m_name.c_str());
+        return STRF("#builtin-%s(%s)",
+                    m_isMacro ? "macro" : "function", m_name.c_str());
     }
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // these are singletons
     }
 
-    String name() const { return m_name; }
+    const String& name() const { return m_name; }
+
+    virtual bool isMacro() const { return m_isMacro; }
+    virtual bool isPure() const { return m_isPure; }
+
+    // The operation a call site can do itself, for two integers.
+    malIntOp intOp() const { return m_intOp; }
 
     WITH_META(malBuiltIn);
 
 private:
     const String m_name;
     ApplyFunc* m_handler;
+    const bool m_isMacro;
+    const bool m_isPure;
+    const malIntOp m_intOp;
+};
+
+// A builtin, such as apply, can return one of these instead of making its
+// final call itself. EVAL then makes the call in its own loop, so that tail
+// calls through builtins don't use any C++ stack; everywhere else,
+// malBuiltIn::apply makes the call. These are never seen by mal code.
+class malTailCall : public malValue {
+public:
+    malTailCall(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+    : m_op(op), m_args(argsBegin, argsEnd) { }
+    malTailCall(const malTailCall& that, malValuePtr meta)
+    : malValue(meta), m_op(that.m_op), m_args(that.m_args) { }
+
+    malValuePtr        op() const { return m_op; }
+    const malValueVec& args() const { return m_args; }
+
+    virtual String print(bool readably) const {
+        return STRF("#tail-call(%s)", m_op->print(readably).c_str());
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malTailCall);
+
+private:
+    const malValuePtr m_op;
+    const malValueVec m_args;
+};
+
+// The head of a list (guard optimised original), made by the optimiser for
+// a fn* body it rewrote, see Optimizer.cpp. EVAL evaluates the optimised
+// form while the guard holds, that is while the global bindings that the
+// rewrite depended on are unchanged, and the original form once they
+// aren't. These are never seen by mal code, other than by DEBUG-EVAL.
+class malGuard : public malValue {
+public:
+    // A global name that must not have been bound locally, and the value
+    // it must still be bound to, if cell isn't NULL.
+    struct Assumption {
+        const malName*     name;
+        const malValuePtr* cell;
+        malValuePtr        value;
+    };
+    typedef std::vector<Assumption> Assumptions;
+
+    malGuard(const Assumptions& assumptions) : m_assumptions(assumptions) { }
+    malGuard(const malGuard& that, malValuePtr meta)
+    : malValue(meta), m_assumptions(that.m_assumptions) { }
+
+    bool holds() const;
+
+    virtual String print(bool readably) const { return "#guard"; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malGuard);
+
+private:
+    const Assumptions m_assumptions;
+};
+
+// The head of a list (compiled), which malBindingPlan::enter gives EVAL in
+// place of a fn* or loop* body once it is hot, see Compiler.cpp. Like
+// malGuard, these are never seen by mal code, other than by DEBUG-EVAL.
+class malCompiled : public malValue {
+public:
+    // How running the body ended. For VALUE, value is its value, or a
+    // raised error. The others are left to EVAL, in tail position: FORM is
+    // the form in ast, to be evaluated in env; CALL is a call of value to
+    // args, made by the form in ast; RECUR is a recur to args.
+    enum Tail { VALUE, FORM, CALL, RECUR };
+
+    malCompiled(malValuePtr body) : m_body(body) { }
+    malCompiled(const malCompiled& that, malValuePtr meta)
+    : malValue(meta), m_body(that.m_body) { }
+
+    virtual Tail run(malValuePtr& ast, malEnvPtr& env,
+                     malValuePtr& value, malValueVec& args) const = 0;
+
+    // The body this was compiled from.
+    malValuePtr body() const { return m_body; }
+
+    virtual String print(bool readably) const { return "#compiled"; }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+private:
+    const malValuePtr m_body;
+};
+
+// The value EVAL and builtins return in place of a result when mal code
+// throws, or a builtin's arguments are wrong. The malException is held on
+// the side until try* takes it, so an error caught by try* in the same
+// EVAL loop costs a few pointer compares rather than a C++ unwind. Where
+// C++ code expects a result, the malException is thrown instead. Like
+// malTailCall, this is never seen by mal code.
+class malError : public malValue {
+public:
+    // Records the error, with a backtrace from the current malCallFrame
+    // unless it already has one, and returns the marker.
+    static malValuePtr raise(const malException& error);
+
+    static bool isRaised(const malValuePtr& value) {
+        return value.ptr() == s_raised.ptr();
+    }
+
+    // Clears the error and returns the value try* binds.
+    static malValuePtr take();
+
+    // Clears the error and throws it as a C++ exception.
+    [[noreturn]] static void rethrow();
+
+    virtual String print(bool readably) const {
+        return "#error";
+    }
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+
+    WITH_META(malError);
+
+private:
+    malError() { }
+    malError(const malError& that, malValuePtr meta) : malValue(meta) { }
+
+    static const malValuePtr s_raised;
+    static malException s_pending;
 };
 
 class malLambda : public malApplicable {
 public:
-    malLambda(const StringVec& bindings, malValuePtr body, malEnvPtr env);
+    // One (params body) clause of a fn*. A plain (fn* params body) has
+    // just the one.
+    struct Arity {
+        malValuePtr       params;
+        malValuePtr       body;
+        malBindingPlanPtr plan;
+    };
+    typedef std::vector<Arity> Arities;
+
+    malLambda(malValuePtr params, malValuePtr body, malEnvPtr env);
+    malLambda(const Arities& arities, malEnvPtr env);
     malLambda(const malLambda& that, malValuePtr meta);
     malLambda(const malLambda& that, bool isMacro);
 
     virtual malValuePtr apply(malValueIter argsBegin,
                               malValueIter argsEnd) const;
 
-    malValuePtr getBody() const { return m_body; }
+    // The clause which takes argCount arguments.
+    const Arity& getArity(int argCount) const {
+        if (m_arities.size() == 1) {
+            return m_arities[0]; // let the binding plan check the count
+        }
+        if (argCount < (int)m_byCount.size() && m_byCount[argCount] >= 0) {
+            return m_arities[m_byCount[argCount]];
+        }
+        return getVariadic(argCount);
+    }
+
+    const Arities& getArities() const { return m_arities; }
+    malValuePtr getBody() const { return m_arities[0].body; }
+    malEnvPtr getEnv() const;
     malEnvPtr makeEnv(malValueIter argsBegin, malValueIter argsEnd) const;
+    malEnvPtr makeEnv(const Arity& arity,
+                      malValueIter argsBegin, malValueIter argsEnd) const;
 
     virtual bool doIsEqualTo(const malValue* rhs) const {
         return this == rhs; // do we need to do a deep inspection?
@@ -310,17 +795,125 @@ public:
         return STRF("#user-%s(%p)", m_isMacro ? "macro" : "function", this);
     }
 
-    bool isMacro() const { return m_isMacro; }
+    virtual bool isMacro() const { return m_isMacro; }
 
     virtual malValuePtr doWithMeta(malValuePtr meta) const;
 
+    WITH_ACCOUNTING(malLambda);
+
 private:
-    const StringVec   m_bindings;
-    const malValuePtr m_body;
+    void buildDispatch();
+    const Arity& getVariadic(int argCount) const;
+
+    Arities           m_arities;
+    std::vector<int>  m_byCount;    // index into m_arities, or -1
+    int               m_variadic;   // index into m_arities, or -1
     const malEnvPtr   m_env;
     const bool        m_isMacro;
 };
 
+// Protocol methods and multimethods choose an implementation from their
+// arguments, and then call it. EVAL calls dispatch() itself, so that the
+// implementation is called in tail position.
+class malDispatcher : public malApplicable {
+public:
+    malDispatcher() { }
+    malDispatcher(malValuePtr meta) : malApplicable(meta) { }
+
+    virtual malValuePtr apply(malValueIter argsBegin,
+                              malValueIter argsEnd) const;
+
+    virtual malValuePtr dispatch(malValueIter argsBegin,
+                                 malValueIter argsEnd) const = 0;
+
+    virtual bool doIsEqualTo(const malValue* rhs) const {
+        return this == rhs;
+    }
+};
+
+// A method made by defprotocol. As in lib/protocols.mal, the protocol is an
+// atom holding a map from type keyword (see mal::typeOf) to a map from
+// method keyword to implementation, which extend replaces.
+class malProtocolMethod : public malDispatcher {
+public:
+    malProtocolMethod(malValuePtr protocol, malValuePtr method);
+    malProtocolMethod(const malProtocolMethod& that, malValuePtr meta);
+
+    virtual malValuePtr dispatch(malValueIter argsBegin,
+                                 malValueIter argsEnd) const;
+
+    malValuePtr getProtocol() const { return m_protocol; }
+    malValuePtr getMethod() const { return m_method; }
+
+    virtual String print(bool readably) const {
+        return STRF("#protocol-method(%s)", m_method->print(true).c_str());
+    }
+
+    WITH_META(malProtocolMethod);
+
+private:
+    // The implementations for the last few types seen. These are dropped
+    // whenever the protocol's map changes.
+    enum { CACHE_SIZE = 4 };
+    struct CacheEntry {
+        String      type;
+        malValuePtr impl;
+    };
+
+    const malValuePtr   m_protocol;
+    const malValuePtr   m_method;
+    mutable malValuePtr m_cachedMap;
+    mutable CacheEntry  m_cache[CACHE_SIZE];
+    mutable int         m_cacheCount;
+    mutable int         m_cacheNext;
+};
+
+// A function made by defmulti, which calls the method added by defmethod
+// for the value its dispatch function returns, or else the :default one.
+// A keyword dispatch function is looked up in the first argument.
+class malMultiMethod : public malDispatcher {
+public:
+    // Methods, keyed by the printed dispatch value, hold that value and
+    // the method.
+    typedef std::map<String, std::pair<malValuePtr, malValuePtr> > Methods;
+
+    malMultiMethod(const String& name, malValuePtr dispatchFn);
+    malMultiMethod(const malMultiMethod& that, malValuePtr meta);
+
+    virtual malValuePtr dispatch(malValueIter argsBegin,
+                                 malValueIter argsEnd) const;
+
+    void addMethod(malValuePtr dispatchValue, malValuePtr method);
+
+    const String&  getName() const { return m_name; }
+    malValuePtr    getDispatchFn() const { return m_dispatchFn; }
+    const Methods& getMethods() const { return m_methods; }
+
+    virtual String print(bool readably) const {
+        return STRF("#multimethod(%s)", m_name.c_str());
+    }
+
+    WITH_META(malMultiMethod);
+
+private:
+    malValuePtr findMethod(malValuePtr dispatchValue) const;
+
+    // The methods for the last few dispatch values, which saves printing
+    // them. These are dropped whenever a method is added.
+    enum { CACHE_SIZE = 4 };
+    struct CacheEntry {
+        malValuePtr value;
+        malValuePtr method;
+    };
+
+    const String        m_name;
+    const malValuePtr   m_dispatchFn;
+    Methods             m_methods;
+    mutable CacheEntry  m_cache[CACHE_SIZE];
+    mutable int         m_cacheCount;
+    mutable int         m_cacheNext;
+};
+
 class malAtom : public malValue {
 public:
     malAtom(malValuePtr value) : m_value(value) { }
@@ -345,6 +938,10 @@ private:
     malValuePtr m_value;
 };
 
+// Whether form evaluates to itself, as a literal number, string, keyword,
+// empty list, or constant vector or hash-map does.
+bool evaluatesToItself(const malValuePtr& form);
+
 namespace mal {
     malValuePtr atom(malValuePtr value);
     malValuePtr boolean(bool value);
@@ -357,16 +954,25 @@ namespace mal {
     malValuePtr integer(const String& token);
     malValuePtr keyword(const String& token);
     malValuePtr lambda(const StringVec&, malValuePtr, malEnvPtr);
+    malValuePtr lambda(malValuePtr params, malValuePtr, malEnvPtr);
+    malValuePtr lambda(const malLambda::Arities& arities, malEnvPtr);
     malValuePtr list(malValueVec* items);
     malValuePtr list(malValueIter begin, malValueIter end);
     malValuePtr list(malValuePtr a);
     malValuePtr list(malValuePtr a, malValuePtr b);
     malValuePtr list(malValuePtr a, malValuePtr b, malValuePtr c);
     malValuePtr macro(const malLambda& lambda);
+    malValuePtr multiMethod(const String& name, malValuePtr dispatchFn);
     malValuePtr nilValue();
+    malValuePtr protocolMethod(malValuePtr protocol, malValuePtr method);
+    malValuePtr record(malValuePtr type, malValueVec* slots);
+    malValuePtr recordType(const String& name, const malValueVec& fields);
     malValuePtr string(const String& token);
     malValuePtr symbol(const String& token);
+    malValuePtr tailCall(malValuePtr op,
+                         malValueIter argsBegin, malValueIter argsEnd);
     malValuePtr trueValue();
+    malValuePtr typeOf(malValuePtr obj);
     malValuePtr vector(malValueVec* items);
     malValuePtr vector(malValueIter begin, malValueIter end);
 };
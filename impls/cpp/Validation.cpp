@@ -1,26 +1,28 @@
 #include "Validation.h"
 
+#include "Types.h"
+
 int checkArgsIs(const char* name, int expected, int got)
 {
-    MAL_CHECK(got == expected,
-           "\"%s\" expects %d arg%s, %d supplied",
-           name, expected, PLURAL(expected), got);
+    if (got != expected) {
+        throw malException::argCount(name, expected, expected, got);
+    }
     return got;
 }
 
 int checkArgsBetween(const char* name, int min, int max, int got)
 {
-    MAL_CHECK((got >= min) && (got <= max),
-           "\"%s\" expects between %d and %d arg%s, %d supplied",
-           name, min, max, PLURAL(max), got);
+    if ((got < min) || (got > max)) {
+        throw malException::argCount(name, min, max, got);
+    }
     return got;
 }
 
 int checkArgsAtLeast(const char* name, int min, int got)
 {
-    MAL_CHECK(got >= min,
-           "\"%s\" expects at least %d arg%s, %d supplied",
-           name, min, PLURAL(min), got);
+    if (got < min) {
+        throw malException::argCount(name, min, -1, got);
+    }
     return got;
 }
 
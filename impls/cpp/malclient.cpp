@@ -0,0 +1,107 @@
+//  Sends a request to the daemon run by stepA_mal --serve, see Server.h,
+//  and copies what the request writes back to stdout. It links nothing of
+//  the interpreter, nor the C++ library, so that starting it costs next to
+//  nothing.
+//
+//  usage: malclient SOCKET [SCRIPT [ARGS...]]
+//
+//  With no script, the mal source to run is read from stdin.
+
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static int fail(const char* what, const char* path)
+{
+    fprintf(stderr, "malclient: can't %s %s, %s\n", what, path,
+            strerror(errno));
+    return 1;
+}
+
+// A growable buffer, rather than a std::string, which would need the C++
+// library.
+struct Buffer {
+    char*  data;
+    size_t size;
+    size_t capacity;
+};
+
+static void append(Buffer& buffer, const char* data, size_t size)
+{
+    if (buffer.size + size > buffer.capacity) {
+        buffer.capacity = (buffer.size + size) * 2;
+        buffer.data = (char*)realloc(buffer.data, buffer.capacity);
+        if (!buffer.data) {
+            fprintf(stderr, "malclient: out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(buffer.data + buffer.size, data, size);
+    buffer.size += size;
+}
+
+static bool writeAll(int fd, const char* data, size_t size)
+{
+    for (size_t done = 0; done < size; ) {
+        ssize_t wrote = write(fd, data + done, size - done);
+        if (wrote < 0 && errno != EINTR) {
+            return false;
+        }
+        done += wrote > 0 ? wrote : 0;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        fprintf(stderr, "usage: malclient SOCKET [SCRIPT [ARGS...]]\n");
+        return 1;
+    }
+    const char* path = argv[1];
+
+    char directory[PATH_MAX];
+    if (!getcwd(directory, sizeof(directory))) {
+        return fail("find", "the working directory");
+    }
+    Buffer request = { NULL, 0, 0 };
+    append(request, directory, strlen(directory) + 1);
+    for (int i = 2; i < argc; i++) {
+        append(request, argv[i], strlen(argv[i]) + 1);
+    }
+    append(request, "", 1);
+    char buffer[4096];
+    ssize_t got;
+    if (argc == 2) {
+        while ((got = read(STDIN_FILENO, buffer, sizeof(buffer))) > 0) {
+            append(request, buffer, got);
+        }
+    }
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strncpy(address.sun_path, path, sizeof(address.sun_path) - 1);
+    int server = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (server < 0
+            || connect(server, (sockaddr*)&address, sizeof(address)) < 0) {
+        return fail("connect to", path);
+    }
+    if (!writeAll(server, request.data, request.size)
+            || shutdown(server, SHUT_WR) < 0) {
+        return fail("send a request to", path);
+    }
+
+    while ((got = read(server, buffer, sizeof(buffer))) > 0) {
+        if (!writeAll(STDOUT_FILENO, buffer, got)) {
+            return fail("write", "stdout");
+        }
+    }
+    return 0;
+}
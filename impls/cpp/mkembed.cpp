@@ -0,0 +1,140 @@
+//  Pre-reads mal source at build time, and writes the forms out as C++ data
+//  to be linked into libmal.a. At runtime they are restored by imageToValue,
+//  without going through the reader.
+//
+//  usage: mkembed OUTPUT.cpp [FILE.mal...]
+//
+//  The stepA prelude is always embedded, with no path, so that load-file
+//  can't find it. Each file is embedded under its last two path components,
+//  eg. "lib/trivial.mal", along with its canonical path, so that only that
+//  file is replaced, and its size and modification time, so that it isn't
+//  once it has been changed.
+
+#include "MAL.h"
+#include "Prelude.h"
+#include "Types.h"
+
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include <sys/stat.h>
+
+// Nothing is evaluated here, but Types.cpp refers to these.
+malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+{
+    MAL_FAIL("mkembed cannot evaluate %s", ast->print(true).c_str());
+}
+
+malValuePtr APPLY(malValuePtr op, malValueIter argsBegin, malValueIter argsEnd)
+{
+    MAL_FAIL("mkembed cannot apply %s", op->print(true).c_str());
+}
+
+static malValuePtr readPrelude()
+{
+    malValueVec* items = new malValueVec;
+    items->push_back(mal::symbol("do"));
+    for (auto &function : malFunctionTable) {
+        items->push_back(readStr(function));
+    }
+    return mal::list(items);
+}
+
+static malValuePtr readSource(const String& filename)
+{
+    // This matches readFileForms, in Core.cpp.
+    std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+    MAL_CHECK(!file.fail(), "Cannot open %s", filename.c_str());
+
+    std::ostringstream data;
+    data << file.rdbuf();
+    return readStr("(do " + data.str() + "\nnil)");
+}
+
+static String embeddedName(const String& filename)
+{
+    String::size_type slash = filename.rfind('/');
+    if (slash != String::npos && slash > 0) {
+        slash = filename.rfind('/', slash - 1);
+    }
+    return slash == String::npos ? filename : filename.substr(slash + 1);
+}
+
+static void writeData(std::ostream& out, int index, const String& image)
+{
+    out << "static const char embedded" << index << "[] =";
+    for (size_t i = 0; i < image.size(); i++) {
+        if (i % 16 == 0) {
+            out << "\n    \"";
+        }
+        out << STRF("\\%03o", (unsigned char)image[i]);
+        if (i % 16 == 15 || i == image.size() - 1) {
+            out << "\"";
+        }
+    }
+    out << ";\n\n";
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 2) {
+        std::cerr << "usage: " << argv[0] << " OUTPUT.cpp [FILE.mal...]\n";
+        return 1;
+    }
+
+    std::ostringstream out;
+    StringVec names, paths;
+    std::vector<struct stat> stats;
+    try {
+        out << "// Generated by mkembed, do not edit.\n\n"
+            << "#include \"MAL.h\"\n\n";
+
+        writeData(out, 0, valueToImage(readPrelude()));
+        names.push_back("prelude");
+        paths.push_back("");
+        stats.resize(1);
+
+        for (int i = 2; i < argc; i++) {
+            // Taken first, so that a change made while it is read shows.
+            struct stat status;
+            MAL_CHECK(stat(argv[i], &status) == 0, "Cannot find %s", argv[i]);
+            stats.push_back(status);
+            writeData(out, names.size(), valueToImage(readSource(argv[i])));
+            names.push_back(embeddedName(argv[i]));
+            char path[PATH_MAX];
+            MAL_CHECK(realpath(argv[i], path), "Cannot find %s", argv[i]);
+            paths.push_back(path);
+        }
+    }
+    catch (malException& e) {
+        std::cerr << argv[0] << ": " << e.message() << "\n";
+        return 1;
+    }
+    catch (String& s) {
+        std::cerr << argv[0] << ": " << s << "\n";
+        return 1;
+    }
+
+    out << "const malEmbeddedFile embeddedFiles[] = {\n";
+    for (size_t i = 0; i < names.size(); i++) {
+        String path = paths[i].empty() ? "NULL" : escape(paths[i]);
+        out << STRF("    { \"%s\", %s, embedded%d, sizeof(embedded%d) - 1,\n"
+                    "      %lldLL, %lldLL },\n",
+                    names[i].c_str(), path.c_str(), (int)i, (int)i,
+                    (long long)stats[i].st_size,
+                    (long long)stats[i].st_mtime);
+    }
+    out << "    { NULL, NULL, NULL, 0, 0, 0 },\n};\n";
+
+    std::ofstream file(argv[1]);
+    file << out.str();
+    file.close();
+    if (file.fail()) {
+        std::cerr << argv[0] << ": cannot write " << argv[1] << "\n";
+        return 1;
+    }
+    return 0;
+}
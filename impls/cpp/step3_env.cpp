@@ -27,6 +27,9 @@ int main(int argc, char* argv[])
         catch (malEmptyInputException&) {
             continue; // no output
         }
+        catch (malException& e) {
+            out = e.message();
+        }
         catch (String& s) {
             out = s;
         };
@@ -48,6 +48,9 @@ static String safeRep(const String& input, malEnvPtr env)
     catch (malEmptyInputException&) {
         return String();
     }
+    catch (malException& e) {
+        return e.message();
+    }
     catch (String& s) {
         return s;
     };
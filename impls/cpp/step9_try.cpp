@@ -48,8 +48,8 @@ static String safeRep(const String& input, malEnvPtr env)
     catch (malEmptyInputException&) {
         return String();
     }
-    catch (malValuePtr& mv) {
-        return "Error: " + mv->print(true);
+    catch (malException& e) {
+        return "Error: " + e.message();
     }
     catch (String& s) {
         return "Error: " + s;
@@ -209,8 +209,8 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                     // Not an error, continue as if we got nil
                     ast = mal::nilValue();
                 }
-                catch(malValuePtr& o) {
-                    excVal = o;
+                catch(malException& e) {
+                    excVal = e.value();
                 };
 
                 if (excVal) {
@@ -1,11 +1,19 @@
 #include "MAL.h"
 
+#include "Budget.h"
 #include "Environment.h"
+#include "Malc.h"
+#include "Prelude.h"
 #include "ReadLine.h"
+#include "Server.h"
 #include "Types.h"
 
+#include <algorithm>
+#include <climits>
+#include <cstdlib>
 #include <iostream>
 #include <memory>
+#include <typeinfo>
 
 malValuePtr READ(const String& input);
 String PRINT(malValuePtr ast);
@@ -14,22 +22,215 @@ static void installFunctions(malEnvPtr env);
 
 static void makeArgv(malEnvPtr env, int argc, char* argv[]);
 static String safeRep(const String& input, malEnvPtr env);
+static bool safeLoadImage(const String& filename);
+static bool safeSaveImage(const String& filename);
+static bool safeCompile(const String& filename, const String& output);
+static void safeRun(malcProgram* program);
+static void serveRequest(const malServer::Request& request);
+static bool setMemoryQuota(const String& text);
 static malValuePtr quasiquote(malValuePtr obj);
+static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env);
+static bool isArityClause(malValuePtr obj);
+static bool closureNames(malValuePtr params, malValuePtr body,
+                         malNameVec& names, const malEnvPtr& env);
+static malValuePtr evalInFrame(malValuePtr& ast, malEnvPtr& env,
+                               malCallFrame& frame);
+static malValuePtr evalArgs(const malList* list, malEnvPtr env,
+                            malValueVec& args, bool isDirect = false);
+static malNodeKind nodeKindOf(const malList* list);
+static malValuePtr callBuiltins(malValuePtr& op, malValueVec& args);
+static malValuePtr evalCascade(const malList* list, const malEnvPtr& env,
+                               bool isAnd, malValuePtr& ast);
 
 static ReadLine s_readLine("~/.mal-history");
 
+static const malSymbol debugEval("DEBUG-EVAL");
+
 static malEnvPtr replEnv(new malEnv);
 
+// The calls, and recur jumps, into a fn* or loop* body after which it is
+// compiled, unless --tier-up says otherwise. See malBindingPlan::enter.
+static const int DEFAULT_TIER_THRESHOLD = 100;
+
+// The engines that run fn* and loop* bodies, chosen with --engine, or
+// MAL_ENGINE. They share the reader, the builtins in Core.cpp, EVAL and
+// the REPL. Each installs the compiler that EVAL hands a body to once it
+// has been entered often enough, see malBindingPlan::setTiering, and which
+// turns it into a malCompiled that EVAL runs in its place; a compiler for
+// another kind of code plugs in the same way.
+struct malEngine {
+    const char* name;
+    void (*install)(int tierThreshold);
+};
+
+static void installTiered(int tierThreshold)
+{
+    malBindingPlan::setTiering(tierThreshold, compileBody);
+}
+
+static void installTreeWalker(int)
+{
+    malBindingPlan::setTiering(0, NULL);
+}
+
+static void installAnalysed(int)
+{
+    malBindingPlan::setTiering(1, compileBody);
+}
+
+static const malEngine engines[] = {
+    { "tiered",   installTiered },      // walks, then compiles hot bodies
+    { "tree",     installTreeWalker },  // only walks the tree
+    { "analysed", installAnalysed },    // compiles each body when first run
+};
+
+static const malEngine* findEngine(const String& name)
+{
+    for (auto& engine : engines) {
+        if (name == engine.name) {
+            return &engine;
+        }
+    }
+    return NULL;
+}
+
 int main(int argc, char* argv[])
 {
     String prompt = "user> ";
     String input;
-    installCore(replEnv);
-    installFunctions(replEnv);
+    String loadImageFile, saveImageFile, compileFile, serveSocket;
+    int tierThreshold = DEFAULT_TIER_THRESHOLD;
+    const char* engineVar = getenv("MAL_ENGINE");
+    String engineName = engineVar ? engineVar : "tiered";
+    while (argc > 1) {
+        // Options take a value, as "--option value" or "--option=value".
+        String option = argv[1], value;
+        int used = 1;
+        size_t equals = option.find('=');
+        if (option.compare(0, 2, "--") == 0 && equals != String::npos) {
+            value = option.substr(equals + 1);
+            option.erase(equals);
+        }
+        else if (argc > 2) {
+            value = argv[2];
+            used = 2;
+        }
+        else {
+            break;
+        }
+        if (option == "--image") {
+            loadImageFile = value;
+        }
+        else if (option == "--save-image") {
+            saveImageFile = value;
+        }
+        else if (option == "--compile") {
+            compileFile = value;
+        }
+        else if (option == "--serve") {
+            serveSocket = value;
+        }
+        else if (option == "--engine") {
+            engineName = value;
+        }
+        else if (option == "--optimize") {
+            if (!setOptimizerPasses(value)) {
+                std::cerr << "Error: unknown optimizer pass in "
+                          << value << "\n";
+                return 1;
+            }
+        }
+        else if (option == "--memory-quota") {
+            if (!setMemoryQuota(value)) {
+                std::cerr << "Error: --memory-quota needs a number of "
+                          << "bytes, with K, M or G after it for more\n";
+                return 1;
+            }
+        }
+        else if (option == "--fuel" || option == "--deadline") {
+            char* end;
+            long long limit = strtoll(value.c_str(), &end, 10);
+            if (*end || end == value.c_str() || limit < 0) {
+                std::cerr << "Error: " << option << " needs a number of "
+                          << (option == "--fuel" ? "steps" : "msecs")
+                          << ", or 0 for no limit\n";
+                return 1;
+            }
+            if (option == "--fuel") {
+                malBudget::setFuel(limit);
+            }
+            else {
+                malBudget::setDeadline(limit);
+            }
+        }
+        else if (option == "--tier-up") {
+            char* end;
+            long calls = strtol(value.c_str(), &end, 10);
+            if (*end || end == value.c_str() || calls < 0 || calls > INT_MAX) {
+                std::cerr << "Error: --tier-up needs a number of calls, "
+                          << "or 0 to turn it off\n";
+                return 1;
+            }
+            tierThreshold = calls;
+        }
+        else {
+            break;
+        }
+        argc -= used;
+        argv += used;
+    }
+
+    const malEngine* engine = findEngine(engineName);
+    if (!engine) {
+        std::cerr << "Error: unknown engine " << engineName << ", try";
+        for (auto& e : engines) {
+            std::cerr << " " << e.name;
+        }
+        std::cerr << "\n";
+        return 1;
+    }
+    engine->install(tierThreshold);
+
+    if (loadImageFile.empty()) {
+        installCore(replEnv);
+        installFunctions(replEnv);
+    }
+    else if (!safeLoadImage(loadImageFile)) {
+        return 1;
+    }
+    if (!compileFile.empty()) {
+        if (argc < 2) {
+            std::cerr << "Error: --compile needs a program to compile\n";
+            return 1;
+        }
+        return safeCompile(argv[1], compileFile) ? 0 : 1;
+    }
+    if (!serveSocket.empty()) {
+        // A script given with --serve, such as one that loads libraries,
+        // runs once, in the daemon, before it serves any requests.
+        if (argc > 1) {
+            makeArgv(replEnv, argc - 2, argv + 2);
+            String filename = escape(argv[1]);
+            safeRep(STRF("(load-file %s)", filename.c_str()), replEnv);
+        }
+        return malServer::serve(serveSocket, serveRequest) ? 0 : 1;
+    }
+    if (malcProgram* program = malcProgram::linked()) {
+        // A program compiled by malc runs, rather than the REPL.
+        program->load(replEnv);
+        makeArgv(replEnv, argc - 1, argv + 1);
+        safeRun(program);
+        return 0;
+    }
     makeArgv(replEnv, argc - 2, argv + 2);
     if (argc > 1) {
         String filename = escape(argv[1]);
         safeRep(STRF("(load-file %s)", filename.c_str()), replEnv);
+    }
+    if (!saveImageFile.empty()) {
+        return safeSaveImage(saveImageFile) ? 0 : 1;
+    }
+    if (argc > 1) {
         return 0;
     }
     rep("(println (str \"Mal [\" *host-language* \"]\"))", replEnv);
@@ -49,14 +250,126 @@ static String safeRep(const String& input, malEnvPtr env)
     catch (malEmptyInputException&) {
         return String();
     }
-    catch (malValuePtr& mv) {
-        return "Error: " + mv->print(true);
+    catch (malException& e) {
+        return "Error: " + e.message() + e.backtrace();
     }
     catch (String& s) {
         return "Error: " + s;
     };
 }
 
+static bool safeLoadImage(const String& filename)
+{
+    try {
+        malEnvPtr builtins(new malEnv);
+        installCore(builtins);
+        replEnv = loadImage(filename, builtins);
+        return true;
+    }
+    catch (malException& e) {
+        std::cerr << "Error: " << e.message() << "\n";
+        return false;
+    }
+    catch (String& s) {
+        std::cerr << "Error: " << s << "\n";
+        return false;
+    }
+}
+
+static bool safeSaveImage(const String& filename)
+{
+    try {
+        saveImage(replEnv, filename);
+        return true;
+    }
+    catch (malException& e) {
+        std::cerr << "Error: " << e.message() << "\n";
+        return false;
+    }
+    catch (String& s) {
+        std::cerr << "Error: " << s << "\n";
+        return false;
+    }
+}
+
+static bool safeCompile(const String& filename, const String& output)
+{
+    try {
+        compileProgram(filename, output, replEnv);
+        return true;
+    }
+    catch (malException& e) {
+        std::cerr << "Error: " << e.message() << "\n";
+        return false;
+    }
+    catch (String& s) {
+        std::cerr << "Error: " << s << "\n";
+        return false;
+    }
+}
+
+//  Runs the top-level forms of a program compiled by malc, up to the first
+//  error.
+//  Runs a program compiled by malc as stepA_mal runs a script: it stops at
+//  the first error that isn't caught, which isn't reported.
+static void safeRun(malcProgram* program)
+{
+    malBudget::start();
+    for (auto& form : program->forms()) {
+        malName::markLocalDefs(form, false);
+        try {
+            EVAL(form, replEnv);
+        }
+        catch (malException&) {
+            return;
+        }
+        catch (String&) {
+            return;
+        }
+    }
+}
+
+//  Runs a request to the daemon, in a child of it, as stepA_mal would run
+//  the script, or the source it was sent in place of one. Unlike a script
+//  run directly, an error is reported, since the client has no other way
+//  to tell.
+static void serveRequest(const malServer::Request& request)
+{
+    std::vector<char*> args;
+    for (auto& arg : request.args) {
+        args.push_back(const_cast<char*>(arg.c_str()));
+    }
+    String out;
+    if (args.empty()) {
+        makeArgv(replEnv, 0, NULL);
+        out = safeRep("(do " + request.input + "\nnil)", replEnv);
+    }
+    else {
+        makeArgv(replEnv, args.size() - 1, args.data() + 1);
+        String filename = escape(request.args[0]);
+        out = safeRep(STRF("(load-file %s)", filename.c_str()), replEnv);
+    }
+    if (out.compare(0, 7, "Error: ") == 0) {
+        std::cerr << out << "\n";
+    }
+}
+
+//  Sets the memory quota from a number of bytes, or of K, M or G bytes.
+static bool setMemoryQuota(const String& text)
+{
+    char* end;
+    long long quota = strtoll(text.c_str(), &end, 10);
+    String unit = end;
+    size_t scale = unit == "K" ? 1 << 10 :
+                   unit == "M" ? 1 << 20 :
+                   unit == "G" ? 1 << 30 : unit.empty() ? 1 : 0;
+    if (end == text.c_str() || quota < 0 || !scale) {
+        return false;
+    }
+    malMemory::setQuota(quota * scale);
+    return true;
+}
+
 static void makeArgv(malEnvPtr env, int argc, char* argv[])
 {
     malValueVec* args = new malValueVec();
@@ -68,7 +381,10 @@ static void makeArgv(malEnvPtr env, int argc, char* argv[])
 
 String rep(const String& input, malEnvPtr env)
 {
-    return PRINT(EVAL(READ(input), env));
+    malValuePtr form = READ(input);
+    malName::markLocalDefs(form, false);
+    malBudget::start();
+    return PRINT(EVAL(form, env));
 }
 
 malValuePtr READ(const String& input)
@@ -77,14 +393,67 @@ malValuePtr READ(const String& input)
 }
 
 malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
+{
+    malValuePtr result = evalRaising(ast, env);
+    if (malError::isRaised(result)) {
+        malError::rethrow();
+    }
+    return result;
+}
+
+//  EVAL, but returning any error mal code raises, see malError, so that
+//  try* can catch it without unwinding. Errors thrown by builtins are
+//  raised here too, while the malCallFrame they happened in still exists.
+malValuePtr evalRaising(malValuePtr ast, malEnvPtr env)
+{
+    malCallFrame frame(ast);
+    try {
+        malValuePtr result = evalInFrame(ast, env, frame);
+        malEnv::recycle(env);
+        return result;
+    }
+    catch (malException& e) {
+        return malError::raise(e);
+    }
+    catch (String& s) {
+        return malError::raise(malException::message(s));
+    }
+}
+
+//  Everything evaluated here checks for a raised error and passes it
+//  straight back. The form and environment are evalRaising's, updated in
+//  place by each tail call.
+static malValuePtr evalInFrame(malValuePtr& ast, malEnvPtr& env,
+                               malCallFrame& frame)
 {
     if (!env) {
+        // A form from eval, about to run in the global environment.
         env = replEnv;
+        malName::markLocalDefs(ast, false);
+    }
+
+    // The frame which recur binds again, while we are in tail position of
+    // its body. Anything evaluated by a nested call to EVAL isn't.
+    malEnvPtr recurEnv;
+    if (env->isRecurTarget(ast)) {
+        recurEnv = env;
     }
+
+    // Evaluated arguments, reused by each call and recur made from here.
+    malValueVec args;
+
     while (1) {
 
-       const malEnvPtr dbgenv = env->find("DEBUG-EVAL");
-       if (dbgenv && dbgenv->get("DEBUG-EVAL")->isTrue()) {
+        if (malValuePtr error = malMemory::checkQuota()) {
+            return error;
+        }
+        if (malValuePtr error = malBudget::spend()) {
+            return error;
+        }
+
+       const malValuePtr dbgeval = debugEval.lookup(env);
+       const bool isDebugging = dbgeval && dbgeval->isTrue();
+       if (isDebugging) {
            std::cout << "EVAL: " << PRINT(ast) << "\n";
        }
 
@@ -94,55 +463,144 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
         }
 
         // From here on down we are evaluating a non-empty list.
-        // First handle the special forms.
-        if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
-            String special = symbol->value();
-            int argCount = list->count() - 1;
+        // A call to an arithmetic builtin which has only been passed
+        // integers here is checked for before the special forms.
+        if (list->isIntegerCall()) {
+            malValuePtr op = isDebugging
+                ? evalRaising(list->item(0), env)
+                : STATIC_CAST(malSymbol, list->item(0))->lookup(env);
+            if (op && malError::isRaised(op)) {
+                return op;
+            }
+            if (op && list->isIntegerCall(op)) {
+                if (malValuePtr error = evalArgs(list, env, args,
+                                                 !isDebugging)) {
+                    return error;
+                }
+                if (malValuePtr value = list->callIntegers(args)) {
+                    return value;
+                }
+                return STATIC_CAST(malBuiltIn, op)->call(args.begin(),
+                                                         args.end());
+            }
+        }
 
-            if (special == "def!") {
+        // The function to call, if a compiled body, or a builtin, ends in a
+        // tail call.
+        malValuePtr op;
+
+        // Then switch on the kind of node this list has been found to be,
+        // see malList::nodeKind, working it out if this is its first run.
+        malNodeKind kind = list->nodeKind();
+        bool isFirstRun = kind == NODE_UNKNOWN;
+        if (isFirstRun) {
+            kind = nodeKindOf(list);
+            list->setNodeKind(kind);
+        }
+        int argCount = list->count() - 1;
+
+        switch (kind) {
+            case NODE_AND:
+            case NODE_OR: {
+                // Evaluates the arguments here, rather than expanding the
+                // call, while the symbol still finds the builtin macro.
+                op = STATIC_CAST(malSymbol, list->item(0))->lookup(env);
+                if (!op || !isBuiltinMacro(op, kind == NODE_AND ? "and"
+                                                                : "or")) {
+                    list->setNodeKind(NODE_SYMBOL_CALL);
+                    op = NULL;
+                    break;
+                }
+                if (malValuePtr value = evalCascade(list, env,
+                                                    kind == NODE_AND, ast)) {
+                    return value;
+                }
+                continue; // TCO
+            }
+
+            case NODE_DEF: {
                 checkArgsIs("def!", 2, argCount);
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                return env->set(id->value(), EVAL(list->item(2), env));
+                malValuePtr value = evalRaising(list->item(2), env);
+                if (malError::isRaised(value)) {
+                    return value;
+                }
+                return env->set(id->value(), value);
             }
 
-            if (special == "defmacro!") {
+            case NODE_DEFMACRO: {
                 checkArgsIs("defmacro!", 2, argCount);
 
                 const malSymbol* id = VALUE_CAST(malSymbol, list->item(1));
-                malValuePtr body = EVAL(list->item(2), env);
+                malValuePtr body = evalRaising(list->item(2), env);
+                if (malError::isRaised(body)) {
+                    return body;
+                }
                 const malLambda* lambda = VALUE_CAST(malLambda, body);
                 return env->set(id->value(), mal::macro(*lambda));
             }
 
-            if (special == "do") {
+            case NODE_DO: {
                 checkArgsAtLeast("do", 1, argCount);
 
                 for (int i = 1; i < argCount; i++) {
-                    EVAL(list->item(i), env);
+                    malValuePtr value = evalRaising(list->item(i), env);
+                    if (malError::isRaised(value)) {
+                        return value;
+                    }
                 }
                 ast = list->item(argCount);
                 continue; // TCO
             }
 
-            if (special == "fn*") {
-                checkArgsIs("fn*", 2, argCount);
+            case NODE_FN: {
+                checkArgsAtLeast("fn*", 1, argCount);
 
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                StringVec params;
-                for (int i = 0; i < bindings->count(); i++) {
-                    const malSymbol* sym =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    params.push_back(sym->value());
+                bool isMultiArity = isArityClause(list->item(1)) &&
+                    (argCount != 2 || isArityClause(list->item(2)));
+                // Inside a local environment, close over just the values
+                // of the free variables, if we can find them.
+                bool isLocal = env->getOuter();
+                malNameVec names;
+                if (!isMultiArity) {
+                    checkArgsIs("fn*", 2, argCount);
+                    malValuePtr params = list->item(1), body = list->item(2);
+                    if (isOptimizing()) {
+                        body = optimizeBody(params, body, env);
+                    }
+                    if (isLocal && closureNames(params, body, names, env)) {
+                        return mal::lambda(params, body, env->capture(names));
+                    }
+                    return mal::lambda(params, body, env);
                 }
 
-                return mal::lambda(params, list->item(2), env);
+                malLambda::Arities arities(argCount);
+                for (int i = 0; i < argCount; i++) {
+                    malValuePtr clause = list->item(i + 1);
+                    MAL_CHECK(isArityClause(clause),
+                              "%s is not a ([params] body) clause",
+                              clause->print(true).c_str());
+                    const malList* c = STATIC_CAST(malList, clause);
+                    arities[i].params = c->item(0);
+                    arities[i].body = isOptimizing()
+                        ? optimizeBody(c->item(0), c->item(1), env)
+                        : c->item(1);
+                    isLocal = isLocal && closureNames(arities[i].params,
+                                                      arities[i].body,
+                                                      names, env);
+                }
+                return mal::lambda(arities,
+                                   isLocal ? env->capture(names) : env);
             }
 
-            if (special == "if") {
+            case NODE_IF: {
                 checkArgsBetween("if", 2, 3, argCount);
 
-                bool isTrue = EVAL(list->item(1), env)->isTrue();
+                malValuePtr test = evalRaising(list->item(1), env);
+                if (malError::isRaised(test)) {
+                    return test;
+                }
+                bool isTrue = test->isTrue();
                 if (!isTrue && (argCount == 2)) {
                     return mal::nilValue();
                 }
@@ -150,34 +608,69 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 continue; // TCO
             }
 
-            if (special == "let*") {
+            case NODE_LET: {
                 checkArgsIs("let*", 2, argCount);
-                const malSequence* bindings =
-                    VALUE_CAST(malSequence, list->item(1));
-                int count = checkArgsEven("let*", bindings->count());
-                malEnvPtr inner(new malEnv(env));
-                for (int i = 0; i < count; i += 2) {
-                    const malSymbol* var =
-                        VALUE_CAST(malSymbol, bindings->item(i));
-                    inner->set(var->value(), EVAL(bindings->item(i+1), inner));
+                malBindingPlanPtr plan = malBindingPlan::forLet(list->item(1));
+                malEnvPtr inner = malEnv::make(env, plan->slotCount());
+                for (int i = 0; i < plan->letCount(); i++) {
+                    malValuePtr value = evalRaising(plan->letValue(i), inner);
+                    if (malError::isRaised(value)) {
+                        return value;
+                    }
+                    plan->bindLet(i, value, inner.ptr());
                 }
                 ast = list->item(2);
                 env = inner;
                 continue; // TCO
             }
 
-            if (special == "quasiquote") {
+            case NODE_LOOP: {
+                checkArgsIs("loop*", 2, argCount);
+                malBindingPlanPtr plan = malBindingPlan::forLet(list->item(1));
+                malEnvPtr inner = malEnv::make(env, plan->slotCount());
+                for (int i = 0; i < plan->letCount(); i++) {
+                    malValuePtr value = evalRaising(plan->letValue(i), inner);
+                    if (malError::isRaised(value)) {
+                        return value;
+                    }
+                    plan->bindLet(i, value, inner.ptr());
+                }
+                inner->setRecurTarget(plan, list->item(2));
+                ast = plan->enter(list->item(2));
+                env = inner;
+                recurEnv = inner;
+                continue; // TCO
+            }
+
+            case NODE_MACROEXPAND: {
+                checkArgsIs("macroexpand", 1, argCount);
+                return macroExpand(list->item(1), env);
+            }
+
+            case NODE_QUASIQUOTE: {
                 checkArgsIs("quasiquote", 1, argCount);
                 ast = quasiquote(list->item(1));
                 continue; // TCO
             }
 
-            if (special == "quote") {
+            case NODE_QUOTE: {
                 checkArgsIs("quote", 1, argCount);
                 return list->item(1);
             }
 
-            if (special == "try*") {
+            case NODE_RECUR: {
+                MAL_CHECK(recurEnv,
+                          "recur must be in tail position of a loop* or fn*");
+                if (malValuePtr error = evalArgs(list, env, args,
+                                                 !isDebugging)) {
+                    return error;
+                }
+                ast = recur(recurEnv, args);
+                env = recurEnv;
+                continue; // TCO
+            }
+
+            case NODE_TRY: {
                 malValuePtr tryBody = list->item(1);
 
                 if (argCount == 1) {
@@ -201,44 +694,162 @@ malValuePtr EVAL(malValuePtr ast, malEnvPtr env)
                 malValuePtr excVal;
 
                 try {
-                    return EVAL(tryBody, env);
-                }
-                catch(String& s) {
-                    excVal = mal::string(s);
+                    malValuePtr result = evalRaising(tryBody, env);
+                    if (!malError::isRaised(result)) {
+                        return result;
+                    }
+                    excVal = malError::take();
                 }
                 catch (malEmptyInputException&) {
                     // Not an error, continue as if we got nil
                     ast = mal::nilValue();
                 }
-                catch(malValuePtr& o) {
-                    excVal = o;
-                };
 
                 if (excVal) {
-                    // we got some exception
-                    env = malEnvPtr(new malEnv(env));
+                    // we got some exception, and can't recur from here
+                    recurEnv = NULL;
+                    env = malEnv::make(env, 1);
                     env->set(excSym->value(), excVal);
                     ast = catchBlock->item(2);
                 }
                 continue; // TCO
             }
+
+            case NODE_GUARD: {
+                // A body rewritten by the optimiser, see Optimizer.cpp.
+                const malGuard* guard = STATIC_CAST(malGuard, list->item(0));
+                ast = list->item(guard->holds() ? 1 : 2);
+                continue; // TCO
+            }
+
+            case NODE_COMPILED: {
+                // A hot body, see Compiler.cpp, which is run as it is,
+                // unless DEBUG-EVAL wants to see each step. Running it
+                // replaces ast.
+                const malCompiled* compiled =
+                    STATIC_CAST(malCompiled, list->item(0));
+                if (isDebugging) {
+                    ast = compiled->body();
+                    continue; // TCO
+                }
+                if (!recurEnv && env->isRecurTarget(compiled->body())) {
+                    recurEnv = env;
+                }
+                malValuePtr value;
+                switch (compiled->run(ast, env, value, args)) {
+                    case malCompiled::VALUE:
+                        return value;
+                    case malCompiled::FORM:
+                        continue; // TCO
+                    case malCompiled::RECUR:
+                        MAL_CHECK(recurEnv, "recur must be in tail position "
+                                            "of a loop* or fn*");
+                        ast = recur(recurEnv, args);
+                        env = recurEnv;
+                        continue; // TCO
+                    case malCompiled::CALL:
+                        op = value;
+                        break;
+                }
+                break;
+            }
+
+            case NODE_BUILTIN_CALL: {
+                // Calls the builtin directly, while the symbol still finds
+                // it, and DEBUG-EVAL isn't watching.
+                if (isDebugging) {
+                    break;
+                }
+                op = STATIC_CAST(malSymbol, list->item(0))->lookup(env);
+                if (!op || !list->isBuiltinCall(op)) {
+                    list->setNodeKind(NODE_SYMBOL_CALL);
+                    op = NULL;
+                    break;
+                }
+                if (malValuePtr error = evalArgs(list, env, args, true)) {
+                    return error;
+                }
+                malValuePtr result =
+                    STATIC_CAST(malBuiltIn, op)->call(args.begin(), args.end());
+                const malTailCall* tail = DYNAMIC_CAST(malTailCall, result);
+                if (!tail) {
+                    return result;
+                }
+                // Such as apply, handing its final call back to us.
+                op = tail->op();
+                args = tail->args();
+                break;
+            }
+
+            case NODE_UNKNOWN:
+            case NODE_CALL:
+            case NODE_SYMBOL_CALL:
+                break;
         }
 
-        // Now we're left with the case of a regular list to be evaluated.
-        malValuePtr op = EVAL(list->item(0), env);
-        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
-            if (lambda->isMacro()) {
-                ast = lambda->apply(list->begin()+1, list->end());
+        if (!op) {
+            // Now we're left with the case of a regular list to be evaluated.
+            // The operator of a call through a symbol is looked up directly.
+            op = kind != NODE_CALL && !isDebugging
+                ? STATIC_CAST(malSymbol, list->item(0))->lookup(env)
+                : malValuePtr();
+            if (!op) {
+                op = evalRaising(list->item(0), env); // or raise the error
+            }
+            if (malError::isRaised(op)) {
+                return op;
+            }
+            const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
+            if (handler && handler->isMacro()) {
+                bool isAnd = isBuiltinMacro(op, "and");
+                if (isAnd || isBuiltinMacro(op, "or")) {
+                    if (kind == NODE_SYMBOL_CALL) {
+                        list->setNodeKind(isAnd ? NODE_AND : NODE_OR);
+                    }
+                    if (malValuePtr value = evalCascade(list, env, isAnd,
+                                                        ast)) {
+                        return value;
+                    }
+                    continue; // TCO
+                }
+                bool isNew = !list->isExpandedBy(op);
+                ast = list->expandMacro(op);
+                if (isNew) {
+                    malName::markLocalDefs(ast, env->getOuter());
+                }
                 continue; // TCO
             }
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
-            ast = lambda->getBody();
-            env = lambda->makeEnv(items->begin(), items->end());
+            if (handler && handler->isPure()) {
+                if (malValuePtr value = list->fold(op)) {
+                    return value;
+                }
+            }
+            if (malValuePtr error = evalArgs(list, env, args, !isDebugging)) {
+                return error;
+            }
+            list->recordCall(op, args);
+            if (isFirstRun && kind == NODE_SYMBOL_CALL &&
+                !list->isIntegerCall() && DYNAMIC_CAST(malBuiltIn, op)) {
+                list->specialiseBuiltinCall(op);
+            }
+        }
+        if (malValuePtr result = callBuiltins(op, args)) {
+            return result;
+        }
+        if (const malLambda* lambda = DYNAMIC_CAST(malLambda, op)) {
+            const malLambda::Arity& arity = lambda->getArity(args.size());
+            frame.setCallSite(ast);
+            ast = arity.plan->enter(arity.body);
+            // The frame we're leaving can be reused, unless it has escaped.
+            malEnvPtr callee = lambda->makeEnv(arity, args.begin(), args.end());
+            recurEnv = NULL;
+            malEnv::recycle(env);
+            env = callee;
+            recurEnv = env;
             continue; // TCO
         }
         else {
-            malValueVec* items = STATIC_CAST(malList, list->rest())->evalItems(env);
-            return APPLY(op, items->begin(), items->end());
+            return APPLY(op, args.begin(), args.end());
         }
     }
 }
@@ -273,6 +884,407 @@ static malValuePtr starts_with(const malValuePtr ast, const char* sym)
     return list->item(1);
 }
 
+//  Evaluate the arguments of a call, or of recur, into args. Returns the
+//  error if one is raised, else NULL. Unless DEBUG-EVAL is watching, the
+//  symbols and integers among them, which are most arguments, are
+//  evaluated directly, without a nested EVAL.
+static malValuePtr evalArgs(const malList* list, malEnvPtr env,
+                            malValueVec& args, bool isDirect)
+{
+    args.clear();
+    for (int i = 1, count = list->count(); i < count; i++) {
+        const malValuePtr& form = list->item(i);
+        if (isDirect) {
+            // Cheaper than a dynamic_cast, since nothing derives from these.
+            const std::type_info& type = typeid(*form.ptr());
+            if (type == typeid(malInteger)) {
+                args.push_back(form);
+                continue;
+            }
+            if (type == typeid(malSymbol)) {
+                if (malValuePtr value =
+                        STATIC_CAST(malSymbol, form)->lookup(env)) {
+                    args.push_back(value);
+                    continue;
+                }
+            }
+        }
+        malValuePtr value = evalRaising(form, env);
+        if (malError::isRaised(value)) {
+            return value;
+        }
+        args.push_back(value);
+    }
+    return NULL;
+}
+
+//  The special forms, and the kinds of node they are, see malList::nodeKind.
+static const struct {
+    const char* name;
+    malNodeKind kind;
+} specialForms[] = {
+    { "def!", NODE_DEF },               { "defmacro!", NODE_DEFMACRO },
+    { "do", NODE_DO },                  { "fn*", NODE_FN },
+    { "if", NODE_IF },                  { "let*", NODE_LET },
+    { "loop*", NODE_LOOP },             { "macroexpand", NODE_MACROEXPAND },
+    { "quasiquote", NODE_QUASIQUOTE },  { "quote", NODE_QUOTE },
+    { "recur", NODE_RECUR },            { "try*", NODE_TRY },
+};
+
+//  The names EVAL handles as special forms, also used by Compiler.cpp and
+//  malc.
+bool isSpecialForm(const String& name)
+{
+    for (auto& special : specialForms) {
+        if (name == special.name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+//  What kind of node a non-empty list is, from its head. Special forms are
+//  found by name, before the symbol is looked up, so redefining one of
+//  their names doesn't change what they are.
+static malNodeKind nodeKindOf(const malList* list)
+{
+    malValuePtr head = list->item(0);
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, head)) {
+        for (auto& special : specialForms) {
+            if (symbol->value() == special.name) {
+                return special.kind;
+            }
+        }
+        return NODE_SYMBOL_CALL;
+    }
+    if (DYNAMIC_CAST(malGuard, head)) {
+        return NODE_GUARD;
+    }
+    if (DYNAMIC_CAST(malCompiled, head)) {
+        return NODE_COMPILED;
+    }
+    return NODE_CALL;
+}
+
+//  Whether op is the builtin macro of that name. Calls to and and or are
+//  run by EVAL and the compiled tiers themselves, while the symbol still
+//  finds the builtin, rather than expanded.
+bool isBuiltinMacro(malValuePtr op, const char* name)
+{
+    const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn, op);
+    return builtin && builtin->isMacro() && builtin->name() == name;
+}
+
+//  Evaluates a call to the builtin and, or or, as the macros in
+//  lib/test_cascade.mal do, stopping at the first argument which is false,
+//  or true. Returns its value, or NULL with the last argument in ast, for
+//  EVAL to evaluate in tail position.
+static malValuePtr evalCascade(const malList* list, const malEnvPtr& env,
+                               bool isAnd, malValuePtr& ast)
+{
+    int argCount = list->count() - 1;
+    if (argCount == 0) {
+        return isAnd ? mal::trueValue() : mal::nilValue();
+    }
+    for (int i = 1; i < argCount; i++) {
+        malValuePtr value = evalRaising(list->item(i), env);
+        if (malError::isRaised(value) || value->isTrue() != isAnd) {
+            return value;
+        }
+    }
+    ast = list->item(argCount);
+    return NULL;
+}
+
+//  Calls op while it is a builtin, or a protocol method or multimethod,
+//  which calls the implementation it chooses. Returns the result, or NULL
+//  when op is left as some other function, for the caller to call.
+static malValuePtr callBuiltins(malValuePtr& op, malValueVec& args)
+{
+    while (1) {
+        if (const malDispatcher* d = DYNAMIC_CAST(malDispatcher, op)) {
+            // Call the chosen protocol method or multimethod directly.
+            op = d->dispatch(args.begin(), args.end());
+        }
+        const malBuiltIn* builtin = DYNAMIC_CAST(malBuiltIn, op);
+        if (!builtin) {
+            return NULL;
+        }
+        // Builtins such as apply can hand their final call back to us.
+        malValuePtr result = builtin->call(args.begin(), args.end());
+        const malTailCall* tail = DYNAMIC_CAST(malTailCall, result);
+        if (!tail) {
+            return result;
+        }
+        op = tail->op();
+        args = tail->args();
+    }
+}
+
+//  Binds the frame of the loop* or fn* that recur jumps back to again, and
+//  returns the body to go on with.
+malValuePtr recur(malEnvPtr& recurEnv, malValueVec& args)
+{
+    if (recurEnv->isCaptured()) {
+        // A closure holds on to this frame, so make a new one.
+        malBindingPlanPtr plan = recurEnv->recurPlan();
+        malEnvPtr frame = malEnv::make(recurEnv->getOuter(),
+                                       plan->slotCount());
+        frame->setRecurTarget(plan, recurEnv->recurBody());
+        recurEnv = frame;
+    }
+    malBindingPlanPtr plan = recurEnv->recurPlan();
+    plan->rebind(recurEnv.ptr(), args.begin(), args.end());
+    return plan->enter(recurEnv->recurBody(), true);
+}
+
+//  Calls op with the arguments that the call form evaluated to, as EVAL
+//  does the call, but not in tail position. Compiled bodies evaluate the
+//  operator and arguments of a call themselves, see Compiler.cpp.
+malValuePtr evalCall(malValuePtr form, malValuePtr op, malValueVec& args)
+{
+    malValuePtr ast = form;
+    malEnvPtr env;
+    malCallFrame frame(ast);
+    try {
+        if (malValuePtr result = callBuiltins(op, args)) {
+            return result;
+        }
+        const malLambda* lambda = DYNAMIC_CAST(malLambda, op);
+        if (!lambda) {
+            return APPLY(op, args.begin(), args.end());
+        }
+        const malLambda::Arity& arity = lambda->getArity(args.size());
+        frame.setCallSite(ast);
+        env = lambda->makeEnv(arity, args.begin(), args.end());
+        ast = arity.plan->enter(arity.body);
+        malValuePtr result = evalInFrame(ast, env, frame);
+        malEnv::recycle(env);
+        return result;
+    }
+    catch (malException& e) {
+        return malError::raise(e);
+    }
+    catch (String& s) {
+        return malError::raise(malException::message(s));
+    }
+}
+
+//  Return true when obj is a ([params] body) clause of a multi-arity fn*.
+//  The parameters must be a vector, so that (fn* ([a] b) ([c] d)) can't be
+//  mistaken for a (fn* params body) whose body calls a vector, though
+//  (fn* ([a] b) body) is still a single destructuring fn*.
+static bool isArityClause(malValuePtr obj)
+{
+    const malList* list = DYNAMIC_CAST(malList, obj);
+    return list && list->count() == 2 && DYNAMIC_CAST(malVector, list->item(0));
+}
+
+//  Return the macro when obj is a call to one, else NULL.
+static malValuePtr macroOf(malValuePtr obj, malEnvPtr env)
+{
+    const malList* list = DYNAMIC_CAST(malList, obj);
+    if (!list || list->isEmpty()) {
+        return NULL;
+    }
+    const malSymbol* sym = DYNAMIC_CAST(malSymbol, list->item(0));
+    malValuePtr op = sym ? sym->lookup(env) : malValuePtr();
+    const malApplicable* handler = DYNAMIC_CAST(malApplicable, op);
+    return handler && handler->isMacro() ? op : malValuePtr();
+}
+
+static malValuePtr macroExpand(malValuePtr obj, malEnvPtr env)
+{
+    while (malValuePtr macro = macroOf(obj, env)) {
+        obj = STATIC_CAST(malList, obj)->expandMacro(macro);
+    }
+    return obj;
+}
+
+static bool collectFreeNames(malValuePtr form, malNameVec& bound,
+                             malNameVec& free, const malEnvPtr& env);
+
+//  Collect the free names of the items of seq from start on.
+static bool collectFreeNames(const malSequence* seq, int start,
+                             malNameVec& bound, malNameVec& free,
+                             const malEnvPtr& env)
+{
+    for (int i = start, count = seq->count(); i < count; i++) {
+        if (!collectFreeNames(seq->item(i), bound, free, env)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+//  Collect the free names of a fn* body, and of its parameters' defaults.
+static bool collectFreeNames(malValuePtr params, malValuePtr body,
+                             malNameVec& bound, malNameVec& free,
+                             const malEnvPtr& env)
+{
+    malBindingPlanPtr plan = malBindingPlan::forParams(params);
+    malNameVec names;
+    malValueVec defaults;
+    plan->paramNames(names, defaults);
+    for (auto& value : defaults) {
+        if (!collectFreeNames(value, bound, free, env)) {
+            return false;
+        }
+    }
+    size_t boundCount = bound.size();
+    bound.insert(bound.end(), names.begin(), names.end());
+    bool found = collectFreeNames(body, bound, free, env);
+    bound.resize(boundCount);
+    return found;
+}
+
+//  Add the names which form refers to, but doesn't bind, to free. Returns
+//  false when we can't tell what they are, as when form calls a macro
+//  written in mal, whose expansion could refer to anything.
+static bool collectFreeNames(malValuePtr form, malNameVec& bound,
+                             malNameVec& free, const malEnvPtr& env)
+{
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, form)) {
+        const malName* name = symbol->name();
+        if (std::find(bound.begin(), bound.end(), name) == bound.end() &&
+            std::find(free.begin(), free.end(), name) == free.end()) {
+            free.push_back(name);
+        }
+        return true;
+    }
+    if (const malVector* vector = DYNAMIC_CAST(malVector, form)) {
+        return collectFreeNames(vector, 0, bound, free, env);
+    }
+    if (const malHash* hash = DYNAMIC_CAST(malHash, form)) {
+        return hash->isEvaluated() ||
+            collectFreeNames(STATIC_CAST(malSequence, hash->values()), 0,
+                             bound, free, env);
+    }
+    const malList* list = DYNAMIC_CAST(malList, form);
+    if (!list || list->isEmpty()) {
+        return true;
+    }
+
+    // The special forms, as handled by EVAL.
+    if (const malSymbol* symbol = DYNAMIC_CAST(malSymbol, list->item(0))) {
+        const String& special = symbol->value();
+        int argCount = list->count() - 1;
+
+        if (special == "quote") {
+            return true;
+        }
+        if (special == "quasiquote") {
+            checkArgsIs("quasiquote", 1, argCount);
+            return collectFreeNames(quasiquote(list->item(1)),
+                                    bound, free, env);
+        }
+        if (special == "def!" || special == "defmacro!") {
+            return collectFreeNames(list, 2, bound, free, env);
+        }
+        if (special == "fn*") {
+            checkArgsAtLeast("fn*", 1, argCount);
+            if (!isArityClause(list->item(1)) ||
+                (argCount == 2 && !isArityClause(list->item(2)))) {
+                checkArgsIs("fn*", 2, argCount);
+                return collectFreeNames(list->item(1), list->item(2),
+                                        bound, free, env);
+            }
+            for (int i = 1; i <= argCount; i++) {
+                const malList* c = VALUE_CAST(malList, list->item(i));
+                checkArgsIs("fn*", 2, c->count());
+                if (!collectFreeNames(c->item(0), c->item(1),
+                                      bound, free, env)) {
+                    return false;
+                }
+            }
+            return true;
+        }
+        if (special == "let*" || special == "loop*") {
+            checkArgsIs(special.c_str(), 2, argCount);
+            malBindingPlanPtr plan = malBindingPlan::forLet(list->item(1));
+            size_t boundCount = bound.size();
+            bool found = true;
+            for (int i = 0; found && i < plan->letCount(); i++) {
+                malNameVec names;
+                malValueVec defaults;
+                plan->letNames(i, names, defaults);
+                found = collectFreeNames(plan->letValue(i), bound, free, env);
+                for (auto& value : defaults) {
+                    found = found && collectFreeNames(value, bound, free, env);
+                }
+                bound.insert(bound.end(), names.begin(), names.end());
+            }
+            found = found && collectFreeNames(list->item(2), bound, free, env);
+            bound.resize(boundCount);
+            return found;
+        }
+        if (special == "try*") {
+            checkArgsBetween("try*", 1, 2, argCount);
+            if (!collectFreeNames(list->item(1), bound, free, env)) {
+                return false;
+            }
+            if (argCount == 1) {
+                return true;
+            }
+            const malList* catchBlock = VALUE_CAST(malList, list->item(2));
+            checkArgsIs("catch*", 2, catchBlock->count() - 1);
+            const malSymbol* excSym =
+                VALUE_CAST(malSymbol, catchBlock->item(1));
+            bound.push_back(excSym->name());
+            bool found = collectFreeNames(catchBlock->item(2),
+                                          bound, free, env);
+            bound.pop_back();
+            return found;
+        }
+        if (special == "do" || special == "if" ||
+            special == "macroexpand" || special == "recur") {
+            return collectFreeNames(list, 1, bound, free, env);
+        }
+    }
+
+    // The builtin macros only rearrange their arguments.
+    malValuePtr macro = macroOf(form, env);
+    if (macro && !DYNAMIC_CAST(malBuiltIn, macro)) {
+        return false;
+    }
+    return collectFreeNames(list, 0, bound, free, env);
+}
+
+//  Add the free names of a fn* clause to names, if they can be found. They
+//  are kept with its parameters' binding plan, for the next time this fn*
+//  is evaluated. Any error in the clause is left for the call to find, so
+//  this doesn't change when errors are raised.
+static bool closureNames(malValuePtr params, malValuePtr body,
+                         malNameVec& names, const malEnvPtr& env)
+{
+    malBindingPlanPtr plan;
+    try {
+        plan = malBindingPlan::forParams(params);
+        if (!plan->hasFreeNames(body)) {
+            malNameVec bound, free;
+            bool found = collectFreeNames(params, body, bound, free, env);
+            plan->setFreeNames(body, found ? &free : NULL);
+        }
+    }
+    catch (malException&) {
+        return false;
+    }
+    catch (String&) {
+        return false;
+    }
+
+    const malNameVec* free = plan->freeNames();
+    if (!free) {
+        return false;
+    }
+    for (const malName* name : *free) {
+        if (std::find(names.begin(), names.end(), name) == names.end()) {
+            names.push_back(name);
+        }
+    }
+    return true;
+}
+
 static malValuePtr quasiquote(malValuePtr obj)
 {
     if (DYNAMIC_CAST(malSymbol, obj) || DYNAMIC_CAST(malHash, obj))
@@ -300,15 +1312,12 @@ static malValuePtr quasiquote(malValuePtr obj)
     return res;
 }
 
-static const char* malFunctionTable[] = {
-    "(defmacro! cond (fn* (& xs) (if (> (count xs) 0) (list 'if (first xs) (if (> (count xs) 1) (nth xs 1) (throw \"odd number of forms to cond\")) (cons 'cond (rest (rest xs)))))))",
-    "(def! not (fn* (cond) (if cond false true)))",
-    "(def! load-file (fn* (filename) \
-        (eval (read-string (str \"(do \" (slurp filename) \"\nnil)\")))))",
-    "(def! *host-language* \"C++\")",
-};
-
 static void installFunctions(malEnvPtr env) {
+    // The prelude is normally pre-read at build time, see mkembed.cpp.
+    if (malValuePtr prelude = embeddedPrelude()) {
+        EVAL(prelude, env);
+        return;
+    }
     for (auto &function : malFunctionTable) {
         rep(function, env);
     }